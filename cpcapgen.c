@@ -0,0 +1,103 @@
+/*
+ * Generates the register name perfect hash tables for libcpcaprw
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Runs on the build host, the output is included by libcpcaprw.c.
+ * The buckets with the most names are placed first, each with the
+ * first seed that puts all of its names into free slots.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "cpcaprw.h"
+#include "cpcaphash.h"
+
+#define CPCAP_GEN_MAX_SEED	0xffff
+
+static const char * const names[CPCAP_NUM_REG_CPCAP] = {
+#define R(name, address, constant_mask, rbw_mask)	\
+	[CPCAP_REG_##name] = #name,
+	CPCAP_REGISTERS(R)
+#undef R
+};
+
+static unsigned char slots[CPCAP_NAME_SLOTS];	/* Index plus one */
+static unsigned short seeds[CPCAP_NAME_BUCKETS];
+static int bucket_size[CPCAP_NAME_BUCKETS];
+
+static int cpcap_gen_place(int bucket, unsigned int seed)
+{
+	int i, slot, placed[CPCAP_NUM_REG_CPCAP], n = 0;
+
+	for (i = 0; i < CPCAP_NUM_REG_CPCAP; i++) {
+		if (cpcap_name_hash(names[i], 0) % CPCAP_NAME_BUCKETS != bucket)
+			continue;
+		slot = cpcap_name_hash(names[i], seed) % CPCAP_NAME_SLOTS;
+		if (slots[slot])
+			break;
+		slots[slot] = i + 1;
+		placed[n++] = slot;
+	}
+	if (i == CPCAP_NUM_REG_CPCAP)
+		return 0;
+
+	while (n--)
+		slots[placed[n]] = 0;
+
+	return -1;
+}
+
+int main(void)
+{
+	int i, j, bucket, size;
+	unsigned int seed;
+
+	for (i = 0; i < CPCAP_NUM_REG_CPCAP; i++) {
+		for (j = 0; j < i; j++) {
+			if (!strcasecmp(names[i], names[j])) {
+				fprintf(stderr, "duplicate name %s\n", names[i]);
+				return 1;
+			}
+		}
+		bucket_size[cpcap_name_hash(names[i], 0) % CPCAP_NAME_BUCKETS]++;
+	}
+
+	for (size = CPCAP_NUM_REG_CPCAP; size > 0; size--) {
+		for (bucket = 0; bucket < CPCAP_NAME_BUCKETS; bucket++) {
+			if (bucket_size[bucket] != size)
+				continue;
+			for (seed = 1; seed <= CPCAP_GEN_MAX_SEED; seed++) {
+				if (!cpcap_gen_place(bucket, seed))
+					break;
+			}
+			if (seed > CPCAP_GEN_MAX_SEED) {
+				fprintf(stderr, "no seed for bucket %i\n",
+					bucket);
+				return 1;
+			}
+			seeds[bucket] = seed;
+		}
+	}
+
+	printf("/* Generated by cpcapgen from cpcaprw.h, do not edit */\n\n");
+	printf("static const unsigned short "
+	       "cpcap_name_seed_tbl[CPCAP_NAME_BUCKETS] = {");
+	for (i = 0; i < CPCAP_NAME_BUCKETS; i++)
+		printf("%s%u,", i % 8 ? " " : "\n\t", seeds[i]);
+	printf("\n};\n\n");
+
+	printf("/* Register index plus one, zero for an empty slot */\n");
+	printf("static const unsigned char "
+	       "cpcap_name_slot_tbl[CPCAP_NAME_SLOTS] = {");
+	for (i = 0; i < CPCAP_NAME_SLOTS; i++)
+		printf("%s%u,", i % 12 ? " " : "\n\t", slots[i]);
+	printf("\n};\n");
+
+	return 0;
+}
@@ -0,0 +1,34 @@
+/*
+ * Register name hash shared by libcpcaprw and cpcapgen
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * FNV-1a with bit 5 of each character cleared so that the hash does
+ * not depend on the case of the letters. Names are looked up with the
+ * hash and displace scheme: the seed 0 hash selects a bucket, and the
+ * bucket seed from cpcap_name_seed_tbl selects the slot. cpcapgen
+ * searches for bucket seeds that put every name in its own slot.
+ */
+
+#ifndef CPCAPHASH_H
+#define CPCAPHASH_H
+
+#define CPCAP_NAME_BUCKETS	64
+#define CPCAP_NAME_SLOTS	512
+
+static inline unsigned int cpcap_name_hash(const char *name,
+					   unsigned int seed)
+{
+	unsigned int h = 2166136261U ^ (seed * 0x9e3779b9U);
+
+	while (*name) {
+		h ^= *name++ & ~0x20;
+		h *= 16777619U;
+	}
+
+	return h ^ (h >> 16);
+}
+
+#endif /* CPCAPHASH_H */
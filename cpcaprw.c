@@ -6,634 +6,7462 @@
  * published by the Free Software Foundation.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
-#include <asm/errno.h>
-#include <sys/ioctl.h>
-
-#define CPCAP_REG_MAX_OFFSET	0x7d18
-
-/*
- * Copied from Motorola mapphone Linux kernel include/linux/spi/cpcap.h
- */
-enum cpcap_reg {
-	CPCAP_REG_START,        /* Start of CPCAP registers. */
-
-	CPCAP_REG_INT1 = CPCAP_REG_START, /* Interrupt 1 */
-	CPCAP_REG_INT2,		/* Interrupt 2 */
-	CPCAP_REG_INT3,		/* Interrupt 3 */
-	CPCAP_REG_INT4,		/* Interrupt 4 */
-	CPCAP_REG_INTM1,	/* Interrupt Mask 1 */
-	CPCAP_REG_INTM2,	/* Interrupt Mask 2 */
-	CPCAP_REG_INTM3,	/* Interrupt Mask 3 */
-	CPCAP_REG_INTM4,	/* Interrupt Mask 4 */
-	CPCAP_REG_INTS1,	/* Interrupt Sense 1 */
-	CPCAP_REG_INTS2,	/* Interrupt Sense 2 */
-	CPCAP_REG_INTS3,	/* Interrupt Sense 3 */
-	CPCAP_REG_INTS4,	/* Interrupt Sense 4 */
-	CPCAP_REG_ASSIGN1,	/* Resource Assignment 1 */
-	CPCAP_REG_ASSIGN2,	/* Resource Assignment 2 */
-	CPCAP_REG_ASSIGN3,	/* Resource Assignment 3 */
-	CPCAP_REG_ASSIGN4,	/* Resource Assignment 4 */
-	CPCAP_REG_ASSIGN5,	/* Resource Assignment 5 */
-	CPCAP_REG_ASSIGN6,	/* Resource Assignment 6 */
-	CPCAP_REG_VERSC1,	/* Version Control 1 */
-	CPCAP_REG_VERSC2,	/* Version Control 2 */
-
-	CPCAP_REG_MI1,		/* Macro Interrupt 1 */
-	CPCAP_REG_MIM1,		/* Macro Interrupt Mask 1 */
-	CPCAP_REG_MI2,		/* Macro Interrupt 2 */
-	CPCAP_REG_MIM2,		/* Macro Interrupt Mask 2 */
-	CPCAP_REG_UCC1,		/* UC Control 1 */
-	CPCAP_REG_UCC2,		/* UC Control 2 */
-	CPCAP_REG_PC1,		/* Power Cut 1 */
-	CPCAP_REG_PC2,		/* Power Cut 2 */
-	CPCAP_REG_BPEOL,	/* BP and EOL */
-	CPCAP_REG_PGC,		/* Power Gate and Control */
-	CPCAP_REG_MT1,		/* Memory Transfer 1 */
-	CPCAP_REG_MT2,		/* Memory Transfer 2 */
-	CPCAP_REG_MT3,		/* Memory Transfer 3 */
-	CPCAP_REG_PF,		/* Print Format */
-
-	CPCAP_REG_SCC,		/* System Clock Control */
-	CPCAP_REG_SW1,		/* Stop Watch 1 */
-	CPCAP_REG_SW2,		/* Stop Watch 2 */
-	CPCAP_REG_UCTM,		/* UC Turbo Mode */
-	CPCAP_REG_TOD1,		/* Time of Day 1 */
-	CPCAP_REG_TOD2,		/* Time of Day 2 */
-	CPCAP_REG_TODA1,	/* Time of Day Alarm 1 */
-	CPCAP_REG_TODA2,	/* Time of Day Alarm 2 */
-	CPCAP_REG_DAY,		/* Day */
-	CPCAP_REG_DAYA,		/* Day Alarm */
-	CPCAP_REG_VAL1,		/* Validity 1 */
-	CPCAP_REG_VAL2,		/* Validity 2 */
-
-	CPCAP_REG_SDVSPLL,	/* Switcher DVS and PLL */
-	CPCAP_REG_SI2CC1,	/* Switcher I2C Control 1 */
-	CPCAP_REG_Si2CC2,	/* Switcher I2C Control 2 */
-	CPCAP_REG_S1C1,	        /* Switcher 1 Control 1 */
-	CPCAP_REG_S1C2,	        /* Switcher 1 Control 2 */
-	CPCAP_REG_S2C1,	        /* Switcher 2 Control 1 */
-	CPCAP_REG_S2C2,	        /* Switcher 2 Control 2 */
-	CPCAP_REG_S3C,	        /* Switcher 3 Control */
-	CPCAP_REG_S4C1,	        /* Switcher 4 Control 1 */
-	CPCAP_REG_S4C2,	        /* Switcher 4 Control 2 */
-	CPCAP_REG_S5C,	        /* Switcher 5 Control */
-	CPCAP_REG_S6C,	        /* Switcher 6 Control */
-	CPCAP_REG_VCAMC,	/* VCAM Control */
-	CPCAP_REG_VCSIC,	/* VCSI Control */
-	CPCAP_REG_VDACC,	/* VDAC Control */
-	CPCAP_REG_VDIGC,	/* VDIG Control */
-	CPCAP_REG_VFUSEC,	/* VFUSE Control */
-	CPCAP_REG_VHVIOC,	/* VHVIO Control */
-	CPCAP_REG_VSDIOC,	/* VSDIO Control */
-	CPCAP_REG_VPLLC,	/* VPLL Control */
-	CPCAP_REG_VRF1C,	/* VRF1 Control */
-	CPCAP_REG_VRF2C,	/* VRF2 Control */
-	CPCAP_REG_VRFREFC,	/* VRFREF Control */
-	CPCAP_REG_VWLAN1C,	/* VWLAN1 Control */
-	CPCAP_REG_VWLAN2C,	/* VWLAN2 Control */
-	CPCAP_REG_VSIMC,	/* VSIM Control */
-	CPCAP_REG_VVIBC,	/* VVIB Control */
-	CPCAP_REG_VUSBC,	/* VUSB Control */
-	CPCAP_REG_VUSBINT1C,	/* VUSBINT1 Control */
-	CPCAP_REG_VUSBINT2C,	/* VUSBINT2 Control */
-	CPCAP_REG_URT,		/* Useroff Regulator Trigger */
-	CPCAP_REG_URM1,		/* Useroff Regulator Mask 1 */
-	CPCAP_REG_URM2,		/* Useroff Regulator Mask 2 */
-
-	CPCAP_REG_VAUDIOC,	/* VAUDIO Control */
-	CPCAP_REG_CC,		/* Codec Control */
-	CPCAP_REG_CDI,		/* Codec Digital Interface */
-	CPCAP_REG_SDAC,		/* Stereo DAC */
-	CPCAP_REG_SDACDI,	/* Stereo DAC Digital Interface */
-	CPCAP_REG_TXI,		/* TX Inputs */
-	CPCAP_REG_TXMP,		/* TX MIC PGA's */
-	CPCAP_REG_RXOA,		/* RX Output Amplifiers */
-	CPCAP_REG_RXVC,		/* RX Volume Control */
-	CPCAP_REG_RXCOA,	/* RX Codec to Output Amps */
-	CPCAP_REG_RXSDOA,	/* RX Stereo DAC to Output Amps */
-	CPCAP_REG_RXEPOA,	/* RX External PGA to Output Amps */
-	CPCAP_REG_RXLL,		/* RX Low Latency */
-	CPCAP_REG_A2LA,		/* A2 Loudspeaker Amplifier */
-	CPCAP_REG_MIPIS1,	/* MIPI Slimbus 1 */
-	CPCAP_REG_MIPIS2,	/* MIPI Slimbus 2 */
-	CPCAP_REG_MIPIS3,	/* MIPI Slimbus 3. */
-	CPCAP_REG_LVAB,		/* LMR Volume and A4 Balanced. */
-
-	CPCAP_REG_CCC1,		/* Coulomb Counter Control 1 */
-	CPCAP_REG_CRM,		/* Charger and Reverse Mode */
-	CPCAP_REG_CCCC2,	/* Coincell and Coulomb Ctr Ctrl 2 */
-	CPCAP_REG_CCS1,		/* Coulomb Counter Sample 1 */
-	CPCAP_REG_CCS2,		/* Coulomb Counter Sample 2 */
-	CPCAP_REG_CCA1,		/* Coulomb Counter Accumulator 1 */
-	CPCAP_REG_CCA2,		/* Coulomb Counter Accumulator 2 */
-	CPCAP_REG_CCM,		/* Coulomb Counter Mode */
-	CPCAP_REG_CCO,		/* Coulomb Counter Offset */
-	CPCAP_REG_CCI,		/* Coulomb Counter Integrator */
-
-	CPCAP_REG_ADCC1,	/* A/D Converter Configuration 1 */
-	CPCAP_REG_ADCC2,	/* A/D Converter Configuration 2 */
-	CPCAP_REG_ADCD0,	/* A/D Converter Data 0 */
-	CPCAP_REG_ADCD1,	/* A/D Converter Data 1 */
-	CPCAP_REG_ADCD2,	/* A/D Converter Data 2 */
-	CPCAP_REG_ADCD3,	/* A/D Converter Data 3 */
-	CPCAP_REG_ADCD4,	/* A/D Converter Data 4 */
-	CPCAP_REG_ADCD5,	/* A/D Converter Data 5 */
-	CPCAP_REG_ADCD6,	/* A/D Converter Data 6 */
-	CPCAP_REG_ADCD7,	/* A/D Converter Data 7 */
-	CPCAP_REG_ADCAL1,	/* A/D Converter Calibration 1 */
-	CPCAP_REG_ADCAL2,	/* A/D Converter Calibration 2 */
-
-	CPCAP_REG_USBC1,	/* USB Control 1 */
-	CPCAP_REG_USBC2,	/* USB Control 2 */
-	CPCAP_REG_USBC3,	/* USB Control 3 */
-	CPCAP_REG_UVIDL,	/* ULPI Vendor ID Low */
-	CPCAP_REG_UVIDH,	/* ULPI Vendor ID High */
-	CPCAP_REG_UPIDL,	/* ULPI Product ID Low */
-	CPCAP_REG_UPIDH,	/* ULPI Product ID High */
-	CPCAP_REG_UFC1,		/* ULPI Function Control 1 */
-	CPCAP_REG_UFC2,		/* ULPI Function Control 2 */
-	CPCAP_REG_UFC3,		/* ULPI Function Control 3 */
-	CPCAP_REG_UIC1,		/* ULPI Interface Control 1 */
-	CPCAP_REG_UIC2,		/* ULPI Interface Control 2 */
-	CPCAP_REG_UIC3,		/* ULPI Interface Control 3 */
-	CPCAP_REG_USBOTG1,	/* USB OTG Control 1 */
-	CPCAP_REG_USBOTG2,	/* USB OTG Control 2 */
-	CPCAP_REG_USBOTG3,	/* USB OTG Control 3 */
-	CPCAP_REG_UIER1,	/* USB Interrupt Enable Rising 1 */
-	CPCAP_REG_UIER2,	/* USB Interrupt Enable Rising 2 */
-	CPCAP_REG_UIER3,	/* USB Interrupt Enable Rising 3 */
-	CPCAP_REG_UIEF1,	/* USB Interrupt Enable Falling 1 */
-	CPCAP_REG_UIEF2,	/* USB Interrupt Enable Falling 1 */
-	CPCAP_REG_UIEF3,	/* USB Interrupt Enable Falling 1 */
-	CPCAP_REG_UIS,		/* USB Interrupt Status */
-	CPCAP_REG_UIL,		/* USB Interrupt Latch */
-	CPCAP_REG_USBD,		/* USB Debug */
-	CPCAP_REG_SCR1,		/* Scratch 1 */
-	CPCAP_REG_SCR2,		/* Scratch 2 */
-	CPCAP_REG_SCR3,		/* Scratch 3 */
-	CPCAP_REG_VMC,		/* Video Mux Control */
-	CPCAP_REG_OWDC,		/* One Wire Device Control */
-	CPCAP_REG_GPIO0,	/* GPIO 0 Control */
-	CPCAP_REG_GPIO1,	/* GPIO 1 Control */
-	CPCAP_REG_GPIO2,	/* GPIO 2 Control */
-	CPCAP_REG_GPIO3,	/* GPIO 3 Control */
-	CPCAP_REG_GPIO4,	/* GPIO 4 Control */
-	CPCAP_REG_GPIO5,	/* GPIO 5 Control */
-	CPCAP_REG_GPIO6,	/* GPIO 6 Control */
-
-	CPCAP_REG_MDLC,		/* Main Display Lighting Control */
-	CPCAP_REG_KLC,		/* Keypad Lighting Control */
-	CPCAP_REG_ADLC,		/* Aux Display Lighting Control */
-	CPCAP_REG_REDC,		/* Red Triode Control */
-	CPCAP_REG_GREENC,	/* Green Triode Control */
-	CPCAP_REG_BLUEC,	/* Blue Triode Control */
-	CPCAP_REG_CFC,		/* Camera Flash Control */
-	CPCAP_REG_ABC,		/* Adaptive Boost Control */
-	CPCAP_REG_BLEDC,	/* Bluetooth LED Control */
-	CPCAP_REG_CLEDC,	/* Camera Privacy LED Control */
-
-	CPCAP_REG_OW1C,		/* One Wire 1 Command */
-	CPCAP_REG_OW1D,		/* One Wire 1 Data */
-	CPCAP_REG_OW1I,		/* One Wire 1 Interrupt */
-	CPCAP_REG_OW1IE,	/* One Wire 1 Interrupt Enable */
-	CPCAP_REG_OW1,		/* One Wire 1 Control */
-	CPCAP_REG_OW2C,		/* One Wire 2 Command */
-	CPCAP_REG_OW2D,		/* One Wire 2 Data */
-	CPCAP_REG_OW2I,		/* One Wire 2 Interrupt */
-	CPCAP_REG_OW2IE,	/* One Wire 2 Interrupt Enable */
-	CPCAP_REG_OW2,		/* One Wire 2 Control */
-	CPCAP_REG_OW3C,		/* One Wire 3 Command */
-	CPCAP_REG_OW3D,		/* One Wire 3 Data */
-	CPCAP_REG_OW3I,		/* One Wire 3 Interrupt */
-	CPCAP_REG_OW3IE,	/* One Wire 3 Interrupt Enable */
-	CPCAP_REG_OW3,		/* One Wire 3 Control */
-	CPCAP_REG_GCAIC,	/* GCAI Clock Control */
-	CPCAP_REG_GCAIM,	/* GCAI GPIO Mode */
-	CPCAP_REG_LGDIR,	/* LMR GCAI GPIO Direction */
-	CPCAP_REG_LGPU,		/* LMR GCAI GPIO Pull-up */
-	CPCAP_REG_LGPIN,	/* LMR GCAI GPIO Pin */
-	CPCAP_REG_LGMASK,	/* LMR GCAI GPIO Mask */
-	CPCAP_REG_LDEB,		/* LMR Debounce Settings */
-	CPCAP_REG_LGDET,	/* LMR GCAI Detach Detect */
-	CPCAP_REG_LMISC,	/* LMR Misc Bits */
-	CPCAP_REG_LMACE,	/* LMR Mace IC Support */
-	CPCAP_REG_TEST,         /* Test */
-	CPCAP_REG_ST_TEST1,     /* ST Test1 */
-	CPCAP_REG_ST_TEST2,     /* ST Test2 */
-	CPCAP_REG_END = CPCAP_REG_ST_TEST2, /* End of CPCAP registers. */
-
-	CPCAP_REG_MAX		/* The largest valid register value. */
-	= CPCAP_REG_END,
-
-	CPCAP_REG_SIZE = CPCAP_REG_MAX + 1,
-	CPCAP_REG_UNUSED = CPCAP_REG_MAX + 2,
-};
-
-#define CPCAP_NUM_REG_CPCAP (CPCAP_REG_END - CPCAP_REG_START + 1)
-#define CONFIG_EMU_UART_DEBUG
-
-/*
- * Copied from drivers/mfd/cpcap-regacc.c in Motorola mapphone Linux
- * kernel tree
- */
-static const struct {
-	unsigned short address;         /* Address of the register */
-	unsigned short constant_mask;	/* Constant modifiability mask */
-	unsigned short rbw_mask;	/* Read-before-write mask */
-} register_info_tbl[CPCAP_NUM_REG_CPCAP] = {
-	[CPCAP_REG_INT1]      = {0, 0x0004, 0x0000},
-	[CPCAP_REG_INT2]      = {1, 0x0000, 0x0000},
-	[CPCAP_REG_INT3]      = {2, 0x0000, 0x0000},
-	[CPCAP_REG_INT4]      = {3, 0xFC00, 0x0000},
-	[CPCAP_REG_INTM1]     = {4, 0x0004, 0xFFFF},
-	[CPCAP_REG_INTM2]     = {5, 0x0000, 0xFFFF},
-	[CPCAP_REG_INTM3]     = {6, 0x0000, 0xFFFF},
-	[CPCAP_REG_INTM4]     = {7, 0xFC00, 0xFFFF},
-	[CPCAP_REG_INTS1]     = {8, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_INTS2]     = {9, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_INTS3]     = {10, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_INTS4]     = {11, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_ASSIGN1]   = {12, 0x80F8, 0xFFFF},
-	[CPCAP_REG_ASSIGN2]   = {13, 0x0000, 0xFFFF},
-	[CPCAP_REG_ASSIGN3]   = {14, 0x0004, 0xFFFF},
-	[CPCAP_REG_ASSIGN4]   = {15, 0x0068, 0xFFFF},
-	[CPCAP_REG_ASSIGN5]   = {16, 0x0000, 0xFFFF},
-	[CPCAP_REG_ASSIGN6]   = {17, 0xFC00, 0xFFFF},
-	[CPCAP_REG_VERSC1]    = {18, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_VERSC2]    = {19, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_MI1]       = {128, 0x0000, 0x0000},
-	[CPCAP_REG_MIM1]      = {129, 0x0000, 0xFFFF},
-	[CPCAP_REG_MI2]       = {130, 0x0000, 0xFFFF},
-	[CPCAP_REG_MIM2]      = {131, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_UCC1]      = {132, 0xF000, 0xFFFF},
-	[CPCAP_REG_UCC2]      = {133, 0xFC00, 0xFFFF},
-	[CPCAP_REG_PC1]       = {135, 0xFC00, 0xFFFF},
-	[CPCAP_REG_PC2]       = {136, 0xFC00, 0xFFFF},
-	[CPCAP_REG_BPEOL]     = {137, 0xFE00, 0xFFFF},
-	[CPCAP_REG_PGC]       = {138, 0xFE00, 0xFFFF},
-	[CPCAP_REG_MT1]       = {139, 0x0000, 0x0000},
-	[CPCAP_REG_MT2]       = {140, 0x0000, 0x0000},
-	[CPCAP_REG_MT3]       = {141, 0x0000, 0x0000},
-	[CPCAP_REG_PF]        = {142, 0x0000, 0xFFFF},
-	[CPCAP_REG_SCC]       = {256, 0xFF00, 0xFFFF},
-	[CPCAP_REG_SW1]       = {257, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_SW2]       = {258, 0xFC7F, 0xFFFF},
-	[CPCAP_REG_UCTM]      = {259, 0xFFFE, 0xFFFF},
-	[CPCAP_REG_TOD1]      = {260, 0xFF00, 0xFFFF},
-	[CPCAP_REG_TOD2]      = {261, 0xFE00, 0xFFFF},
-	[CPCAP_REG_TODA1]     = {262, 0xFF00, 0xFFFF},
-	[CPCAP_REG_TODA2]     = {263, 0xFE00, 0xFFFF},
-	[CPCAP_REG_DAY]       = {264, 0x8000, 0xFFFF},
-	[CPCAP_REG_DAYA]      = {265, 0x8000, 0xFFFF},
-	[CPCAP_REG_VAL1]      = {266, 0x0000, 0xFFFF},
-	[CPCAP_REG_VAL2]      = {267, 0x0000, 0xFFFF},
-	[CPCAP_REG_SDVSPLL]   = {384, 0x2488, 0xFFFF},
-	[CPCAP_REG_SI2CC1]    = {385, 0x8000, 0xFFFF},
-	[CPCAP_REG_Si2CC2]    = {386, 0xFF00, 0xFFFF},
-	[CPCAP_REG_S1C1]      = {387, 0x9080, 0xFFFF},
-	[CPCAP_REG_S1C2]      = {388, 0x8080, 0xFFFF},
-	[CPCAP_REG_S2C1]      = {389, 0x9080, 0xFFFF},
-	[CPCAP_REG_S2C2]      = {390, 0x8080, 0xFFFF},
-	[CPCAP_REG_S3C]       = {391, 0xFA84, 0xFFFF},
-	[CPCAP_REG_S4C1]      = {392, 0x9080, 0xFFFF},
-	[CPCAP_REG_S4C2]      = {393, 0x8080, 0xFFFF},
-	[CPCAP_REG_S5C]       = {394, 0xFFD7, 0xFFFF},
-	[CPCAP_REG_S6C]       = {395, 0xFFF4, 0xFFFF},
-	[CPCAP_REG_VCAMC]     = {396, 0xFF48, 0xFFFF},
-	[CPCAP_REG_VCSIC]     = {397, 0xFFA8, 0xFFFF},
-	[CPCAP_REG_VDACC]     = {398, 0xFF48, 0xFFFF},
-	[CPCAP_REG_VDIGC]     = {399, 0xFF48, 0xFFFF},
-	[CPCAP_REG_VFUSEC]    = {400, 0xFF50, 0xFFFF},
-	[CPCAP_REG_VHVIOC]    = {401, 0xFFE8, 0xFFFF},
-	[CPCAP_REG_VSDIOC]    = {402, 0xFF40, 0xFFFF},
-	[CPCAP_REG_VPLLC]     = {403, 0xFFA4, 0xFFFF},
-	[CPCAP_REG_VRF1C]     = {404, 0xFF50, 0xFFFF},
-	[CPCAP_REG_VRF2C]     = {405, 0xFFD4, 0xFFFF},
-	[CPCAP_REG_VRFREFC]   = {406, 0xFFD4, 0xFFFF},
-	[CPCAP_REG_VWLAN1C]   = {407, 0xFFA8, 0xFFFF},
-	[CPCAP_REG_VWLAN2C]   = {408, 0xFD32, 0xFFFF},
-	[CPCAP_REG_VSIMC]     = {409, 0xE154, 0xFFFF},
-	[CPCAP_REG_VVIBC]     = {410, 0xFFF2, 0xFFFF},
-#ifdef CONFIG_EMU_UART_DEBUG
-	[CPCAP_REG_VUSBC]     = {411, 0xFFFF, 0xFFFF},
-#else
-	[CPCAP_REG_VUSBC]     = {411, 0xFEA2, 0xFFFF},
-#endif
-	[CPCAP_REG_VUSBINT1C] = {412, 0xFFD4, 0xFFFF},
-	[CPCAP_REG_VUSBINT2C] = {413, 0xFFD4, 0xFFFF},
-	[CPCAP_REG_URT]       = {414, 0xFFFE, 0xFFFF},
-	[CPCAP_REG_URM1]      = {415, 0x0000, 0xFFFF},
-	[CPCAP_REG_URM2]      = {416, 0xFC00, 0xFFFF},
-	[CPCAP_REG_VAUDIOC]   = {512, 0xFF88, 0xFFFF},
-	[CPCAP_REG_CC]        = {513, 0x0000, 0xFEDF},
-	[CPCAP_REG_CDI]       = {514, 0x4000, 0xFFFF},
-	[CPCAP_REG_SDAC]      = {515, 0xF000, 0xFCFF},
-	[CPCAP_REG_SDACDI]    = {516, 0xC000, 0xFFFF},
-	[CPCAP_REG_TXI]       = {517, 0x0000, 0xFFFF},
-	[CPCAP_REG_TXMP]      = {518, 0xF000, 0xFFFF},
-	[CPCAP_REG_RXOA]      = {519, 0xF800, 0xFFFF},
-	[CPCAP_REG_RXVC]      = {520, 0x00C3, 0xFFFF},
-	[CPCAP_REG_RXCOA]     = {521, 0xF800, 0xFFFF},
-	[CPCAP_REG_RXSDOA]    = {522, 0xE000, 0xFFFF},
-	[CPCAP_REG_RXEPOA]    = {523, 0x8000, 0xFFFF},
-	[CPCAP_REG_RXLL]      = {524, 0x0000, 0xFFFF},
-	[CPCAP_REG_A2LA]      = {525, 0xFF00, 0xFFFF},
-	[CPCAP_REG_MIPIS1]    = {526, 0x0000, 0xFFFF},
-	[CPCAP_REG_MIPIS2]    = {527, 0xFF00, 0xFFFF},
-	[CPCAP_REG_MIPIS3]    = {528, 0xFFFC, 0xFFFF},
-	[CPCAP_REG_LVAB]      = {529, 0xFFFC, 0xFFFF},
-	[CPCAP_REG_CCC1]      = {640, 0xFFF0, 0xFFFF},
-	[CPCAP_REG_CRM]       = {641, 0xC000, 0xFFFF},
-	[CPCAP_REG_CCCC2]     = {642, 0xFFC0, 0xFFFF},
-	[CPCAP_REG_CCS1]      = {643, 0x0000, 0xFFFF},
-	[CPCAP_REG_CCS2]      = {644, 0xFF00, 0xFFFF},
-	[CPCAP_REG_CCA1]      = {645, 0x0000, 0xFFFF},
-	[CPCAP_REG_CCA2]      = {646, 0x0000, 0xFFFF},
-	[CPCAP_REG_CCM]       = {647, 0xFC00, 0xFFFF},
-	[CPCAP_REG_CCO]       = {648, 0xFC00, 0xFFFF},
-	[CPCAP_REG_CCI]       = {649, 0xC000, 0xFFFF},
-	[CPCAP_REG_ADCC1]     = {768, 0x0000, 0xFFFF},
-	[CPCAP_REG_ADCC2]     = {769, 0x0080, 0xFFFF},
-	[CPCAP_REG_ADCD0]     = {770, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_ADCD1]     = {771, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_ADCD2]     = {772, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_ADCD3]     = {773, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_ADCD4]     = {774, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_ADCD5]     = {775, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_ADCD6]     = {776, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_ADCD7]     = {777, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_ADCAL1]    = {778, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_ADCAL2]    = {779, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_USBC1]     = {896, 0x0000, 0xFFFF},
-#ifdef CONFIG_EMU_UART_DEBUG
-	[CPCAP_REG_USBC2]     = {897, 0x0F07, 0xFFFF},
-#else
-	[CPCAP_REG_USBC2]     = {897, 0x0000, 0xFFFF},
-#endif
-	[CPCAP_REG_USBC3]     = {898, 0x8200, 0xFFFF},
-	[CPCAP_REG_UVIDL]     = {899, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_UVIDH]     = {900, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_UPIDL]     = {901, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_UPIDH]     = {902, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_UFC1]      = {903, 0xFF80, 0xFFFF},
-	[CPCAP_REG_UFC2]      = {904, 0xFF80, 0xFFFF},
-	[CPCAP_REG_UFC3]      = {905, 0xFF80, 0xFFFF},
-	[CPCAP_REG_UIC1]      = {906, 0xFF64, 0xFFFF},
-	[CPCAP_REG_UIC2]      = {907, 0xFF64, 0xFFFF},
-	[CPCAP_REG_UIC3]      = {908, 0xFF64, 0xFFFF},
-	[CPCAP_REG_USBOTG1]   = {909, 0xFFC0, 0xFFFF},
-	[CPCAP_REG_USBOTG2]   = {910, 0xFFC0, 0xFFFF},
-	[CPCAP_REG_USBOTG3]   = {911, 0xFFC0, 0xFFFF},
-	[CPCAP_REG_UIER1]     = {912, 0xFFE0, 0xFFFF},
-	[CPCAP_REG_UIER2]     = {913, 0xFFE0, 0xFFFF},
-	[CPCAP_REG_UIER3]     = {914, 0xFFE0, 0xFFFF},
-	[CPCAP_REG_UIEF1]     = {915, 0xFFE0, 0xFFFF},
-	[CPCAP_REG_UIEF2]     = {916, 0xFFE0, 0xFFFF},
-	[CPCAP_REG_UIEF3]     = {917, 0xFFE0, 0xFFFF},
-	[CPCAP_REG_UIS]       = {918, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_UIL]       = {919, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_USBD]      = {920, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_SCR1]      = {921, 0xFF00, 0xFFFF},
-	[CPCAP_REG_SCR2]      = {922, 0xFF00, 0xFFFF},
-	[CPCAP_REG_SCR3]      = {923, 0xFF00, 0xFFFF},
-	[CPCAP_REG_VMC]       = {939, 0xFFFE, 0xFFFF},
-	[CPCAP_REG_OWDC]      = {940, 0xFFFC, 0xFFFF},
-	[CPCAP_REG_GPIO0]     = {941, 0x0D11, 0x3FFF},
-	[CPCAP_REG_GPIO1]     = {943, 0x0D11, 0x3FFF},
-	[CPCAP_REG_GPIO2]     = {945, 0x0D11, 0x3FFF},
-	[CPCAP_REG_GPIO3]     = {947, 0x0D11, 0x3FFF},
-	[CPCAP_REG_GPIO4]     = {949, 0x0D11, 0x3FFF},
-	[CPCAP_REG_GPIO5]     = {951, 0x0C11, 0x3FFF},
-	[CPCAP_REG_GPIO6]     = {953, 0x0C11, 0x3FFF},
-	[CPCAP_REG_MDLC]      = {1024, 0x0000, 0xFFFF},
-	[CPCAP_REG_KLC]       = {1025, 0x8000, 0xFFFF},
-	[CPCAP_REG_ADLC]      = {1026, 0x8000, 0xFFFF},
-	[CPCAP_REG_REDC]      = {1027, 0xFC00, 0xFFFF},
-	[CPCAP_REG_GREENC]    = {1028, 0xFC00, 0xFFFF},
-	[CPCAP_REG_BLUEC]     = {1029, 0xFC00, 0xFFFF},
-	[CPCAP_REG_CFC]       = {1030, 0xF000, 0xFFFF},
-	[CPCAP_REG_ABC]       = {1031, 0xFFC3, 0xFFFF},
-	[CPCAP_REG_BLEDC]     = {1032, 0xFC00, 0xFFFF},
-	[CPCAP_REG_CLEDC]     = {1033, 0xFC00, 0xFFFF},
-	[CPCAP_REG_OW1C]      = {1152, 0xFF00, 0xFFFF},
-	[CPCAP_REG_OW1D]      = {1153, 0xFF00, 0xFFFF},
-	[CPCAP_REG_OW1I]      = {1154, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_OW1IE]     = {1155, 0xFF00, 0xFFFF},
-	[CPCAP_REG_OW1]       = {1157, 0xFF00, 0xFFFF},
-	[CPCAP_REG_OW2C]      = {1160, 0xFF00, 0xFFFF},
-	[CPCAP_REG_OW2D]      = {1161, 0xFF00, 0xFFFF},
-	[CPCAP_REG_OW2I]      = {1162, 0xFFFF, 0xFFFF},
-	[CPCAP_REG_OW2IE]     = {1163, 0xFF00, 0xFFFF},
-	[CPCAP_REG_OW2]       = {1165, 0xFF00, 0xFFFF},
-	[CPCAP_REG_OW3C]      = {1168, 0xFF00, 0xFFFF},
-	[CPCAP_REG_OW3D]      = {1169, 0xFF00, 0xFFFF},
-	[CPCAP_REG_OW3I]      = {1170, 0xFF00, 0xFFFF},
-	[CPCAP_REG_OW3IE]     = {1171, 0xFF00, 0xFFFF},
-	[CPCAP_REG_OW3]       = {1173, 0xFF00, 0xFFFF},
-	[CPCAP_REG_GCAIC]     = {1174, 0xFF00, 0xFFFF},
-	[CPCAP_REG_GCAIM]     = {1175, 0xFF00, 0xFFFF},
-	[CPCAP_REG_LGDIR]     = {1176, 0xFFE0, 0xFFFF},
-	[CPCAP_REG_LGPU]      = {1177, 0xFFE0, 0xFFFF},
-	[CPCAP_REG_LGPIN]     = {1178, 0xFF00, 0xFFFF},
-	[CPCAP_REG_LGMASK]    = {1179, 0xFFE0, 0xFFFF},
-	[CPCAP_REG_LDEB]      = {1180, 0xFF00, 0xFFFF},
-	[CPCAP_REG_LGDET]     = {1181, 0xFF00, 0xFFFF},
-	[CPCAP_REG_LMISC]     = {1182, 0xFF07, 0xFFFF},
-	[CPCAP_REG_LMACE]     = {1183, 0xFFF8, 0xFFFF},
-	[CPCAP_REG_TEST]      = {7936, 0x0000, 0xFFFF},
-	[CPCAP_REG_ST_TEST1]  = {8002, 0x0000, 0xFFFF},
-	[CPCAP_REG_ST_TEST2]  = {8006, 0xFFFC, 0xFFFF},
+#include <stdarg.h>
+#include <strings.h>
+#include <errno.h>
+#include <sys/prctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "cpcaprw.h"
+
+/* The bits that are not in constant_mask for comparing registers */
+static const unsigned short register_care_tbl[CPCAP_NUM_REG_CPCAP] = {
+#define R(name, address, constant_mask, rbw_mask)	\
+	[CPCAP_REG_##name] = (unsigned short)~(constant_mask),
+	CPCAP_REGISTERS(R)
+#undef R
+};
+
+#define CPCAP_DUMP_LINE_LEN	11	/* "oooo: vvvv\n" */
+#define CPCAP_FIELDS_LEN_MAX	320	/* cpcap_fmt_fields() output */
+
+/*
+ * Large enough for one line per offset in the debugfs layout, and the
+ * fields of each register
+ */
+static char dump_buf[(CPCAP_REG_MAX_OFFSET / 4 + 1) * CPCAP_DUMP_LINE_LEN +
+		     CPCAP_NUM_REG_CPCAP * CPCAP_FIELDS_LEN_MAX];
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static char *cpcap_fmt_hex16(char *p, unsigned short val)
+{
+	p[0] = hex_digits[(val >> 12) & 0xf];
+	p[1] = hex_digits[(val >> 8) & 0xf];
+	p[2] = hex_digits[(val >> 4) & 0xf];
+	p[3] = hex_digits[val & 0xf];
+
+	return p + 4;
+}
+
+static char *cpcap_fmt_dec(char *p, unsigned long long val, int width)
+{
+	char tmp[20];
+	int n = 0;
+
+	do {
+		tmp[n++] = '0' + val % 10;
+		val /= 10;
+	} while (val || n < width);
+
+	while (n)
+		*p++ = tmp[--n];
+
+	return p;
+}
+
+static char *cpcap_fmt_line(char *p, unsigned short offset,
+			    unsigned short val)
+{
+	p = cpcap_fmt_hex16(p, offset);
+	*p++ = ':';
+	*p++ = ' ';
+	p = cpcap_fmt_hex16(p, val);
+	*p++ = '\n';
+
+	return p;
+}
+
+static char *cpcap_fmt_str(char *p, const char *str)
+{
+	while (*str)
+		*p++ = *str++;
+
+	return p;
+}
+
+/*
+ * Formats " NAME field..." for a register value from the fields in
+ * cpcap_reg_db: the name of each flag that is set, and name=value for
+ * the other fields, with the value name if there is one or in hex.
+ * Only copies strings from the tables, nothing is printf formatted.
+ */
+static char *cpcap_fmt_fields(char *p, int index, unsigned short val)
+{
+	const struct cpcap_reg_desc *d = &cpcap_reg_db[index];
+	const struct cpcap_field *f, *end;
+	unsigned int v;
+	int shift;
+
+	*p++ = ' ';
+	p = cpcap_fmt_str(p, d->name);
+
+	end = d->fields->field + d->fields->n;
+	for (f = d->fields->field; f < end; f++) {
+		v = (val & f->mask) >> f->shift;
+		if (!f->values && f->mask == 1 << f->shift) {
+			if (v) {
+				*p++ = ' ';
+				p = cpcap_fmt_str(p, f->name);
+			}
+			continue;
+		}
+
+		*p++ = ' ';
+		p = cpcap_fmt_str(p, f->name);
+		*p++ = '=';
+		if (v < f->nvalues && f->values[v]) {
+			p = cpcap_fmt_str(p, f->values[v]);
+			continue;
+		}
+		for (shift = 12; shift && !(f->mask >> f->shift >> shift);
+		     shift -= 4)
+			;
+		for (; shift >= 0; shift -= 4)
+			*p++ = hex_digits[(v >> shift) & 0xf];
+	}
+
+	return p;
+}
+
+/* Formats " name=value" for a group */
+static char *cpcap_fmt_group(char *p, int group, const unsigned short *vals)
+{
+	long long val = cpcap_group_value(group, vals);
+
+	*p++ = ' ';
+	p = cpcap_fmt_str(p, cpcap_group_tbl[group].name);
+	*p++ = '=';
+	if (val < 0) {
+		*p++ = '-';
+		val = -val;
+	}
+
+	return cpcap_fmt_dec(p, val, 1);
+}
+
+/*
+ * Reads the groups of a snapshot again where a carry may have torn
+ * them, see cpcap_read_group(). Returns a bitmap of the groups that
+ * did not settle.
+ */
+static int cpcap_fix_groups(struct cpcap_dev *dev, unsigned short *vals)
+{
+	unsigned short words[CPCAP_GROUP_REGS];
+	const struct cpcap_group *g;
+	int group, i, torn = 0;
+
+	for (group = 0; group < CPCAP_NUM_GROUPS; group++) {
+		g = &cpcap_group_tbl[group];
+		for (i = 0; i < g->n; i++)
+			words[i] = vals[cpcap_offset_to_index(g->offsets[i])];
+		if (cpcap_read_group(dev, group, words, 1) < 0)
+			torn |= 1 << group;
+		for (i = 0; i < g->n; i++)
+			vals[cpcap_offset_to_index(g->offsets[i])] = words[i];
+	}
+
+	return torn;
+}
+
+static int cpcap_write_buf(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Produces output similar to mainline kernel debugfs for
+ * cat /sys/kernel/debug/regmap/spi1.0/registers.
+ *
+ * Note that some values are not read by the ioctl with the
+ * Android kernel and those are always shown as 0000. With sparse
+ * set, only the registers in cpcap_register_info_tbl are shown.
+ *
+ * The output is collected into dump_buf and written out with a
+ * single write() at the end. With fields set, the lines of the
+ * registers in cpcap_register_info_tbl also have the register name and
+ * fields, and the last register of each group the group value.
+ *
+ * The multi register counters are read again if the snapshot may have
+ * torn them, which only costs reads when one is close to a carry.
+ */
+static int cpcap_dump_all(struct cpcap_dev *dev, int sparse, int fields)
+{
+	unsigned short vals[CPCAP_NUM_REG_CPCAP], words[CPCAP_GROUP_REGS];
+	const struct cpcap_group *g;
+	int i, j, index, offset, next = 0, group, torn, error;
+	char *p = dump_buf;
+
+	error = cpcap_snapshot(dev, vals);
+	if (error < 0) {
+		fprintf(stderr, "read failed: %i\n", error);
+		return error;
+	}
+
+	torn = cpcap_fix_groups(dev, vals);
+	for (group = 0; group < CPCAP_NUM_GROUPS; group++) {
+		if (torn & 1 << group)
+			fprintf(stderr, "%s may be torn\n",
+				cpcap_group_tbl[group].name);
+	}
+
+	for (i = 0; i < CPCAP_NUM_REG_CPCAP; i++) {
+		offset = cpcap_register_info_tbl[i].address * 4;
+
+		/* Just print 0000 for unlisted registers */
+		for (; !sparse && next < offset; next += 4)
+			p = cpcap_fmt_line(p, next, 0);
+		next = offset + 4;
+
+		p = cpcap_fmt_line(p, offset, vals[i]);
+		if (!fields)
+			continue;
+
+		p = cpcap_fmt_fields(p - 1, i, vals[i]);
+		for (group = 0; group < CPCAP_NUM_GROUPS; group++) {
+			g = &cpcap_group_tbl[group];
+			if (g->offsets[g->n - 1] != offset)
+				continue;
+			for (j = 0; j < g->n; j++) {
+				index = cpcap_offset_to_index(g->offsets[j]);
+				words[j] = vals[index];
+			}
+			p = cpcap_fmt_group(p, group, words);
+		}
+		*p++ = '\n';
+	}
+
+	for (; !sparse && next <= CPCAP_REG_MAX_OFFSET; next += 4)
+		p = cpcap_fmt_line(p, next, 0);
+
+	if (cpcap_write_buf(STDOUT_FILENO, dump_buf, p - dump_buf) < 0)
+		fprintf(stderr, "could not write dump\n");
+
+	return 0;
+}
+
+static int cpcap_read(struct cpcap_dev *dev, int reg_offset, int *val,
+		      int fields)
+{
+	char buf[CPCAP_FIELDS_LEN_MAX];
+	unsigned short value;
+	int index;
+
+	index = cpcap_read_reg(dev, reg_offset, &value);
+	if (index == -EINVAL)
+		return index;
+	if (index < 0) {
+		fprintf(stderr, "read failed: %i\n", index);
+
+		return index;
+	}
+
+	if (fields) {
+		*cpcap_fmt_fields(buf, index, value) = '\0';
+		printf("CPCAP register%i 0x%04x=0x%04x%s\n",
+		       index, reg_offset, value, buf);
+	} else {
+		printf("CPCAP register%i 0x%04x=0x%04x\n",
+		       index, reg_offset, value);
+	}
+
+	*val = value;
+
+	return 0;
+}
+
+/* Returns the group with name, or -EINVAL */
+static int cpcap_parse_group(const char *name)
+{
+	int group;
+
+	for (group = 0; group < CPCAP_NUM_GROUPS; group++) {
+		if (!strcasecmp(name, cpcap_group_tbl[group].name))
+			return group;
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Reads a group with cpcap_read_group() and prints its value, the
+ * registers, and the number of extra reads it took.
+ */
+static int cpcap_print_group(struct cpcap_dev *dev, int group)
+{
+	const struct cpcap_group *g = &cpcap_group_tbl[group];
+	unsigned short vals[CPCAP_GROUP_REGS];
+	int i, retries;
+
+	retries = cpcap_read_group(dev, group, vals, 0);
+	if (retries < 0 && retries != -EAGAIN) {
+		fprintf(stderr, "read failed: %i\n", retries);
+		return retries;
+	}
+
+	printf("CPCAP group %s=%lli", g->name, cpcap_group_value(group, vals));
+	for (i = 0; i < g->n; i++)
+		printf(" 0x%04x=0x%04x", g->offsets[i], vals[i]);
+	if (retries == -EAGAIN)
+		printf(" torn\n");
+	else
+		printf(" retries=%i\n", retries);
+
+	return retries < 0 ? retries : 0;
+}
+
+/*
+ * Writes the bits in mask, or rbw_mask if mask is 0. With verify, reads
+ * the register back and checks the written bits that are not in
+ * constant_mask.
+ */
+static int cpcap_write(struct cpcap_dev *dev, int value, int reg_offset,
+		       unsigned short mask, int verify)
+{
+	int index, error, tmp;
+
+	index = cpcap_write_reg(dev, reg_offset, value, mask);
+	if (index == -EINVAL)
+		return index;
+	if (index < 0) {
+		fprintf(stderr, "write failed: %i\n", index);
+
+		return index;
+	}
+
+	if (!verify)
+		return 0;
+
+	cpcap_cache_invalidate(dev, index);
+	error = cpcap_read(dev, reg_offset, &tmp, 0);
+	if (error < 0)
+		return error;
+
+	if (!mask)
+		mask = cpcap_register_info_tbl[index].rbw_mask;
+	mask &= register_care_tbl[index];
+	if ((tmp ^ value) & mask) {
+		fprintf(stderr, "verify 0x%04x failed: wrote 0x%04x mask "
+			"0x%04x\n", reg_offset, value & mask, mask);
+
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * The linear table scan cpcap_init_regwrite() used to do, only kept
+ * for comparing against register_index_tbl with --bench lookup.
+ */
+static int cpcap_offset_to_index_linear(int offset)
+{
+	int i;
+
+	for (i = 0; i < CPCAP_NUM_REG_CPCAP; i++) {
+		if ((cpcap_register_info_tbl[i].address * 4) == offset)
+			return i;
+	}
+
+	return -EINVAL;
+}
+
+static unsigned long long cpcap_nsecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define CPCAP_BENCH_LOOKUP_PASSES	200
+
+static int cpcap_name_to_index_linear(const char *name)
+{
+	int i;
+
+	if (!strncasecmp(name, "CPCAP_REG_", 10))
+		name += 10;
+
+	for (i = 0; i < CPCAP_NUM_REG_CPCAP; i++) {
+		if (!strcasecmp(cpcap_reg_db[i].name, name))
+			return i;
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Looks up every register name with a linear scan and with the
+ * generated hash, and formats all registers for --all with and without
+ * --fields. The register values are varied so all the fields are
+ * formatted.
+ */
+static int cpcap_bench_names(void)
+{
+	unsigned long long start, linear, hash, raw, fields;
+	int pass, i, sum1 = 0, sum2 = 0, lookups;
+	char *p;
+
+	for (i = 0; i < CPCAP_NUM_REG_CPCAP; i++) {
+		if (cpcap_name_to_index(cpcap_reg_db[i].name) != i ||
+		    cpcap_name_to_index_linear(cpcap_reg_db[i].name) != i) {
+			fprintf(stderr, "name lookup mismatch for %s\n",
+				cpcap_reg_db[i].name);
+			return -EINVAL;
+		}
+	}
+
+	start = cpcap_nsecs();
+	for (pass = 0; pass < CPCAP_BENCH_LOOKUP_PASSES; pass++)
+		for (i = 0; i < CPCAP_NUM_REG_CPCAP; i++)
+			sum1 += cpcap_name_to_index_linear(cpcap_reg_db[i].name);
+	linear = cpcap_nsecs() - start;
+
+	start = cpcap_nsecs();
+	for (pass = 0; pass < CPCAP_BENCH_LOOKUP_PASSES; pass++)
+		for (i = 0; i < CPCAP_NUM_REG_CPCAP; i++)
+			sum2 += cpcap_name_to_index(cpcap_reg_db[i].name);
+	hash = cpcap_nsecs() - start;
+
+	if (sum1 != sum2)
+		return -EINVAL;
+
+	lookups = CPCAP_BENCH_LOOKUP_PASSES * CPCAP_NUM_REG_CPCAP;
+	printf("name linear: %.2f ns/lookup\n", (double)linear / lookups);
+	printf("name hash:   %.2f ns/lookup\n", (double)hash / lookups);
+
+	start = cpcap_nsecs();
+	for (pass = 0; pass < CPCAP_BENCH_LOOKUP_PASSES; pass++) {
+		p = dump_buf;
+		for (i = 0; i < CPCAP_NUM_REG_CPCAP; i++)
+			p = cpcap_fmt_line(p, cpcap_reg_db[i].offset,
+					   pass * 0x0101 + i);
+	}
+	raw = cpcap_nsecs() - start;
+
+	start = cpcap_nsecs();
+	for (pass = 0; pass < CPCAP_BENCH_LOOKUP_PASSES; pass++) {
+		p = dump_buf;
+		for (i = 0; i < CPCAP_NUM_REG_CPCAP; i++) {
+			p = cpcap_fmt_line(p, cpcap_reg_db[i].offset,
+					   pass * 0x0101 + i);
+			p = cpcap_fmt_fields(p - 1, i, pass * 0x0101 + i);
+			*p++ = '\n';
+		}
+	}
+	fields = cpcap_nsecs() - start;
+
+	printf("format raw:    %.1f us/--all\n",
+	       (double)raw / CPCAP_BENCH_LOOKUP_PASSES / 1000);
+	printf("format fields: %.1f us/--all\n",
+	       (double)fields / CPCAP_BENCH_LOOKUP_PASSES / 1000);
+
+	return 0;
+}
+
+/*
+ * Looks up every offset up to CPCAP_REG_MAX_OFFSET like --all does,
+ * first with the linear scan and then with register_index_tbl.
+ */
+static int cpcap_bench_lookup(void)
+{
+	unsigned long long start, linear, table;
+	int pass, offset, lookups, sum1 = 0, sum2 = 0;
+
+	for (offset = 0; offset <= CPCAP_REG_MAX_OFFSET; offset++) {
+		if (cpcap_offset_to_index_linear(offset) !=
+		    cpcap_offset_to_index(offset)) {
+			fprintf(stderr, "lookup mismatch at 0x%04x\n", offset);
+			return -EINVAL;
+		}
+	}
+
+	start = cpcap_nsecs();
+	for (pass = 0; pass < CPCAP_BENCH_LOOKUP_PASSES; pass++)
+		for (offset = 0; offset <= CPCAP_REG_MAX_OFFSET; offset += 4)
+			sum1 += cpcap_offset_to_index_linear(offset);
+	linear = cpcap_nsecs() - start;
+
+	start = cpcap_nsecs();
+	for (pass = 0; pass < CPCAP_BENCH_LOOKUP_PASSES; pass++)
+		for (offset = 0; offset <= CPCAP_REG_MAX_OFFSET; offset += 4)
+			sum2 += cpcap_offset_to_index(offset);
+	table = cpcap_nsecs() - start;
+
+	if (sum1 != sum2)
+		return -EINVAL;
+
+	lookups = CPCAP_BENCH_LOOKUP_PASSES * (CPCAP_REG_MAX_OFFSET / 4 + 1);
+	printf("lookup linear: %.2f ns/lookup, %.1f us/--all\n",
+	       (double)linear / lookups,
+	       (double)linear / CPCAP_BENCH_LOOKUP_PASSES / 1000);
+	printf("lookup table:  %.2f ns/lookup, %.1f us/--all\n",
+	       (double)table / lookups,
+	       (double)table / CPCAP_BENCH_LOOKUP_PASSES / 1000);
+	printf("lookup speedup: %.1fx\n", (double)linear / (table ? table : 1));
+
+	return cpcap_bench_names();
+}
+
+/*
+ * Parses a register name, or an offset in hex. Names are tried first
+ * for anything that does not start with a digit, so the offsets that
+ * are also names like cc need 0x. Returns the offset or -EINVAL.
+ */
+static int cpcap_parse_offset(const char *str)
+{
+	char *end;
+	long offset;
+	int index;
+
+	if (*str < '0' || *str > '9') {
+		index = cpcap_name_to_index(str);
+		if (index >= 0)
+			return cpcap_reg_db[index].offset;
+	}
+
+	offset = strtol(str, &end, 16);
+	if (end == str || *end != '\0')
+		return -EINVAL;
+
+	if (offset < 0 || offset > CPCAP_REG_MAX_OFFSET)
+		return -EINVAL;
+
+	return offset;
+}
+
+/*
+ * Parses the value of a write, and the mask for the update forms:
+ *
+ *	offset=value		write value
+ *	offset&=mask		clear the bits not in mask
+ *	offset|=bits		set bits
+ *	offset:hi-lo=value	write value to bits hi to lo
+ *
+ * The update forms are done with a single masked write. Returns the
+ * offset, with value and mask set, or negative error. The mask is 0 for
+ * a plain write, and 0 with update set for an update that changes no
+ * bits.
+ */
+static int cpcap_parse_write(char *buf, char *value, int *val,
+			     unsigned short *mask, int *update)
+{
+	char *op = value - 1, *field, *end;
+	long hi, lo;
+
+	*op = '\0';
+	*mask = 0;
+	*update = 0;
+
+	*val = strtol(value, &end, 16);
+	if (end == value || *end != '\0' || *val < 0 || *val > 0xffff)
+		return -EINVAL;
+
+	if (op > buf && (op[-1] == '&' || op[-1] == '|')) {
+		if (op[-1] == '&') {
+			*mask = ~*val;
+			*val = 0;
+		} else {
+			*mask = *val;
+		}
+		*update = 1;
+		op[-1] = '\0';
+	}
+
+	field = strchr(buf, ':');
+	if (field) {
+		*field++ = '\0';
+		hi = strtol(field, &end, 10);
+		if (end == field || *end != '-')
+			return -EINVAL;
+		field = end + 1;
+		lo = strtol(field, &end, 10);
+		if (end == field || *end != '\0' || lo < 0 || hi < lo ||
+		    hi > 15 || *val >> (hi - lo + 1))
+			return -EINVAL;
+		if (*update)
+			return -EINVAL;
+		*mask = ((1 << (hi - lo + 1)) - 1) << lo;
+		*val <<= lo;
+		*update = 1;
+	}
+
+	return cpcap_parse_offset(buf);
+}
+
+/*
+ * Runs a single operation, either --all, offset, a group name or one
+ * of the writes listed for cpcap_parse_write().
+ */
+static int cpcap_run_op(struct cpcap_dev *dev, const char *op, int sparse,
+			int verify, int fields)
+{
+	unsigned short mask;
+	char buf[64], *value;
+	int offset, val, update, group;
+
+	if (!strcmp(op, "--all")) {
+		fflush(stdout);
+
+		return cpcap_dump_all(dev, sparse, fields);
+	}
+
+	if (strlen(op) >= sizeof(buf))
+		return -EINVAL;
+	strcpy(buf, op);
+
+	value = strchr(buf, '=');
+	if (!value) {
+		group = cpcap_parse_group(buf);
+		if (group >= 0)
+			return cpcap_print_group(dev, group);
+
+		offset = cpcap_parse_offset(buf);
+		if (offset < 0)
+			return offset;
+
+		return cpcap_read(dev, offset, &val, fields);
+	}
+
+	offset = cpcap_parse_write(buf, value + 1, &val, &mask, &update);
+	if (offset < 0)
+		return offset;
+
+	if (update && !mask)
+		return cpcap_offset_to_index(offset) < 0 ? -EINVAL : 0;
+
+	return cpcap_write(dev, val, offset, mask, verify);
+}
+
+struct cpcap_batch {
+	struct cpcap_dev *dev;
+	int sparse;
+	int verify;		/* Read back writes */
+	int fields;		/* Decode register fields */
+	int verbose;		/* Report status and time for each op */
+	int ops;
+	int failed;
+	int error;		/* First error seen */
+	unsigned long long nsecs;
+};
+
+static void cpcap_batch_op(struct cpcap_batch *b, const char *op)
+{
+	unsigned long long start, elapsed;
+	int error;
+
+	start = cpcap_nsecs();
+	error = cpcap_run_op(b->dev, op, b->sparse, b->verify, b->fields);
+	elapsed = cpcap_nsecs() - start;
+
+	b->ops++;
+	b->nsecs += elapsed;
+	if (error) {
+		b->failed++;
+		if (!b->error)
+			b->error = error;
+	}
+
+	if (!b->verbose) {
+		if (error)
+			fprintf(stderr, "%s failed: %i\n", op, error);
+		return;
+	}
+
+	fflush(stdout);
+	if (error)
+		fprintf(stderr, "op %i %s: error %i, %.1f us\n",
+			b->ops, op, error, elapsed / 1000.0);
+	else
+		fprintf(stderr, "op %i %s: ok, %.1f us\n",
+			b->ops, op, elapsed / 1000.0);
+}
+
+/*
+ * Reads operations from a script, whitespace separated and with
+ * everything after # on a line ignored.
+ */
+static int cpcap_batch_file(struct cpcap_batch *b, const char *name)
+{
+	char *line = NULL, *p, *token;
+	size_t size = 0;
+	int error;
+	FILE *f;
+
+	if (!strcmp(name, "-")) {
+		f = stdin;
+	} else {
+		f = fopen(name, "r");
+		if (!f) {
+			error = -errno;
+			fprintf(stderr, "Could not open %s: %i\n", name, error);
+			return error;
+		}
+	}
+
+	while (getline(&line, &size, f) > 0) {
+		p = strchr(line, '#');
+		if (p)
+			*p = '\0';
+
+		p = line;
+		while ((token = strsep(&p, " \t\r\n"))) {
+			if (*token)
+				cpcap_batch_op(b, token);
+		}
+	}
+	free(line);
+
+	if (f != stdin)
+		fclose(f);
+
+	return 0;
+}
+
+/*
+ * Binary protocol for --serve. Requests and replies are the same
+ * CPCAP_MSG_LEN byte little-endian message:
+ *
+ *	u8 op, s8 status, u16 tag, u16 offset, u16 value, u16 mask,
+ *	u16 count
+ *
+ * The tag is copied to the reply so clients can pipeline requests.
+ * For writes a zero mask means the register rbw_mask like the command
+ * line writes. A dump reply has count set to the number of registers,
+ * and is followed by count pairs of u16 offset and u16 value.
+ */
+#define CPCAP_MSG_LEN		12
+
+enum cpcap_msg_op {
+	CPCAP_OP_READ = 1,
+	CPCAP_OP_WRITE,
+	CPCAP_OP_DUMP,
+};
+
+struct cpcap_msg {
+	unsigned char op;
+	signed char status;
+	unsigned short tag;
+	unsigned short offset;
+	unsigned short value;
+	unsigned short mask;
+	unsigned short count;
+};
+
+static void cpcap_put16(unsigned char *p, unsigned short val)
+{
+	p[0] = val;
+	p[1] = val >> 8;
+}
+
+static unsigned short cpcap_get16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static void cpcap_msg_pack(unsigned char *p, const struct cpcap_msg *m)
+{
+	p[0] = m->op;
+	p[1] = m->status;
+	cpcap_put16(p + 2, m->tag);
+	cpcap_put16(p + 4, m->offset);
+	cpcap_put16(p + 6, m->value);
+	cpcap_put16(p + 8, m->mask);
+	cpcap_put16(p + 10, m->count);
+}
+
+static void cpcap_msg_unpack(struct cpcap_msg *m, const unsigned char *p)
+{
+	m->op = p[0];
+	m->status = p[1];
+	m->tag = cpcap_get16(p + 2);
+	m->offset = cpcap_get16(p + 4);
+	m->value = cpcap_get16(p + 6);
+	m->mask = cpcap_get16(p + 8);
+	m->count = cpcap_get16(p + 10);
+}
+
+/*
+ * Parses unix:path, tcp:[host:]port or just a port number. TCP
+ * defaults to localhost for use with adb forward.
+ */
+static int cpcap_sockaddr(const char *addr, struct sockaddr_storage *ss,
+			  socklen_t *len)
+{
+	struct sockaddr_un *sun = (struct sockaddr_un *)ss;
+	struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+	char host[64] = "127.0.0.1";
+	const char *port, *colon;
+	char *end;
+	long val;
+
+	memset(ss, 0, sizeof(*ss));
+
+	if (!strncmp(addr, "unix:", 5)) {
+		if (strlen(addr + 5) >= sizeof(sun->sun_path))
+			return -ENAMETOOLONG;
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, addr + 5);
+		*len = sizeof(*sun);
+
+		return AF_UNIX;
+	}
+
+	if (!strncmp(addr, "tcp:", 4))
+		addr += 4;
+
+	port = addr;
+	colon = strrchr(addr, ':');
+	if (colon) {
+		if (colon - addr >= sizeof(host))
+			return -EINVAL;
+		memcpy(host, addr, colon - addr);
+		host[colon - addr] = '\0';
+		port = colon + 1;
+	}
+
+	val = strtol(port, &end, 10);
+	if (end == port || *end != '\0' || val <= 0 || val > 65535)
+		return -EINVAL;
+
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(val);
+	if (inet_pton(AF_INET, host, &sin->sin_addr) != 1)
+		return -EINVAL;
+	*len = sizeof(*sin);
+
+	return AF_INET;
+}
+
+#define CPCAP_SERVE_MAX_CLIENTS	32
+#define CPCAP_SERVE_IN_LEN	(CPCAP_MSG_LEN * 256)
+#define CPCAP_SERVE_OUT_LEN	65536
+
+/* Worst case reply for one request */
+#define CPCAP_SERVE_MAX_REPLY	(CPCAP_MSG_LEN + CPCAP_NUM_REG_CPCAP * 4)
+
+struct cpcap_client {
+	int fd;
+	size_t in_len;
+	size_t out_pos;
+	size_t out_len;
+	unsigned char in[CPCAP_SERVE_IN_LEN];
+	unsigned char out[CPCAP_SERVE_OUT_LEN];
+};
+
+static volatile sig_atomic_t cpcap_stop;
+
+static void cpcap_stop_handler(int sig)
+{
+	cpcap_stop = 1;
+}
+
+static void cpcap_serve_request(struct cpcap_dev *dev, struct cpcap_client *c,
+				const unsigned char *buf)
+{
+	unsigned char *p = c->out + c->out_len;
+	unsigned short vals[CPCAP_NUM_REG_CPCAP];
+	struct cpcap_msg m;
+	int i, error = 0;
+
+	cpcap_msg_unpack(&m, buf);
+	m.status = 0;
+
+	switch (m.op) {
+	case CPCAP_OP_READ:
+		error = cpcap_read_reg(dev, m.offset, &m.value);
+		break;
+	case CPCAP_OP_WRITE:
+		error = cpcap_write_reg(dev, m.offset, m.value, m.mask);
+		break;
+	case CPCAP_OP_DUMP:
+		m.count = 0;
+		error = cpcap_snapshot(dev, vals);
+		if (error < 0)
+			break;
+		for (i = 0; i < CPCAP_NUM_REG_CPCAP; i++) {
+			cpcap_put16(p + CPCAP_MSG_LEN + i * 4,
+				    cpcap_register_info_tbl[i].address * 4);
+			cpcap_put16(p + CPCAP_MSG_LEN + i * 4 + 2, vals[i]);
+		}
+		m.count = CPCAP_NUM_REG_CPCAP;
+		break;
+	default:
+		error = -EINVAL;
+		break;
+	}
+
+	if (error < 0) {
+		m.status = error < -128 ? -EIO : error;
+		m.count = 0;
+	}
+
+	cpcap_msg_pack(p, &m);
+	c->out_len += CPCAP_MSG_LEN + m.count * 4;
+}
+
+/*
+ * Handles all complete requests in the input buffer as long as there
+ * is space for the worst case reply. Anything left over is handled
+ * once the client has read the replies.
+ */
+static void cpcap_serve_process(struct cpcap_dev *dev, struct cpcap_client *c)
+{
+	size_t pos = 0;
+
+	while (c->in_len - pos >= CPCAP_MSG_LEN &&
+	       c->out_len + CPCAP_SERVE_MAX_REPLY <= sizeof(c->out)) {
+		cpcap_serve_request(dev, c, c->in + pos);
+		pos += CPCAP_MSG_LEN;
+	}
+
+	memmove(c->in, c->in + pos, c->in_len - pos);
+	c->in_len -= pos;
+}
+
+/* Returns negative error if the client should be dropped */
+static int cpcap_serve_client(struct cpcap_dev *dev, struct cpcap_client *c,
+			      short revents)
+{
+	ssize_t n;
+
+	if (revents & (POLLIN | POLLHUP | POLLERR)) {
+		n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+		if (n == 0)
+			return -ECONNRESET;
+		if (n < 0 && errno != EAGAIN && errno != EINTR)
+			return -errno;
+		if (n > 0)
+			c->in_len += n;
+	}
+
+	cpcap_serve_process(dev, c);
+
+	while (c->out_pos < c->out_len) {
+		n = write(c->fd, c->out + c->out_pos, c->out_len - c->out_pos);
+		if (n < 0) {
+			if (errno == EAGAIN)
+				break;
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		c->out_pos += n;
+	}
+
+	if (c->out_pos == c->out_len) {
+		c->out_pos = 0;
+		c->out_len = 0;
+
+		/* Replies were blocking requests that are already here */
+		if (c->in_len >= CPCAP_MSG_LEN)
+			return cpcap_serve_client(dev, c, 0);
+	}
+
+	return 0;
+}
+
+/*
+ * Keeps the device open and serves requests from any number of
+ * clients until interrupted.
+ */
+static int cpcap_serve(struct cpcap_dev *dev, const char *addr)
+{
+	struct cpcap_client *clients[CPCAP_SERVE_MAX_CLIENTS] = { 0 };
+	struct pollfd pfd[CPCAP_SERVE_MAX_CLIENTS + 1];
+	struct sockaddr_storage ss;
+	struct cpcap_client *c;
+	int family, lfd, cfd, i, n, error, one = 1;
+	socklen_t len;
+
+	family = cpcap_sockaddr(addr, &ss, &len);
+	if (family < 0) {
+		fprintf(stderr, "invalid address: %s\n", addr);
+		return family;
+	}
+
+	lfd = socket(family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (lfd < 0)
+		return -errno;
+
+	if (family == AF_UNIX)
+		unlink(((struct sockaddr_un *)&ss)->sun_path);
+	else
+		setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(lfd, (struct sockaddr *)&ss, len) < 0 ||
+	    listen(lfd, 16) < 0) {
+		error = -errno;
+		fprintf(stderr, "could not listen on %s: %i\n", addr, error);
+		close(lfd);
+		return error;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, cpcap_stop_handler);
+	signal(SIGTERM, cpcap_stop_handler);
+
+	fprintf(stderr, "serving on %s\n", addr);
+
+	while (!cpcap_stop) {
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < CPCAP_SERVE_MAX_CLIENTS; i++) {
+			c = clients[i];
+			pfd[i + 1].fd = c ? c->fd : -1;
+			pfd[i + 1].events = 0;
+			if (!c)
+				continue;
+			if (c->in_len < sizeof(c->in))
+				pfd[i + 1].events |= POLLIN;
+			if (c->out_len)
+				pfd[i + 1].events |= POLLOUT;
+		}
+
+		n = poll(pfd, CPCAP_SERVE_MAX_CLIENTS + 1, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			cfd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK);
+			for (i = 0; cfd >= 0 && i < CPCAP_SERVE_MAX_CLIENTS; i++) {
+				if (clients[i])
+					continue;
+				clients[i] = calloc(1, sizeof(*c));
+				if (!clients[i])
+					break;
+				clients[i]->fd = cfd;
+				if (family == AF_INET)
+					setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY,
+						   &one, sizeof(one));
+				cfd = -1;
+			}
+			if (cfd >= 0)
+				close(cfd);
+		}
+
+		for (i = 0; i < CPCAP_SERVE_MAX_CLIENTS; i++) {
+			c = clients[i];
+			if (!c || !pfd[i + 1].revents)
+				continue;
+			if (cpcap_serve_client(dev, c, pfd[i + 1].revents) < 0) {
+				close(c->fd);
+				free(c);
+				clients[i] = NULL;
+			}
+		}
+	}
+
+	for (i = 0; i < CPCAP_SERVE_MAX_CLIENTS; i++) {
+		if (clients[i]) {
+			close(clients[i]->fd);
+			free(clients[i]);
+		}
+	}
+	close(lfd);
+	if (family == AF_UNIX)
+		unlink(((struct sockaddr_un *)&ss)->sun_path);
+
+	return 0;
+}
+
+static int cpcap_connect(const char *addr)
+{
+	struct sockaddr_storage ss;
+	int family, fd, one = 1;
+	socklen_t len;
+
+	family = cpcap_sockaddr(addr, &ss, &len);
+	if (family < 0)
+		return family;
+
+	fd = socket(family, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -errno;
+
+	if (connect(fd, (struct sockaddr *)&ss, len) < 0) {
+		close(fd);
+		return -errno;
+	}
+
+	if (family == AF_INET)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	return fd;
+}
+
+static int cpcap_cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+#define CPCAP_LOADGEN_MAX_DEPTH	256
+
+/*
+ * Sends read or dump requests for all registers to a --serve instance,
+ * keeps depth requests in flight and reports the request rate and the
+ * latency percentiles.
+ */
+static int cpcap_loadgen(const char *addr, int requests, int depth, int op)
+{
+	unsigned long long sent[CPCAP_LOADGEN_MAX_DEPTH], *lat, start, elapsed;
+	unsigned char out[CPCAP_MSG_LEN * CPCAP_LOADGEN_MAX_DEPTH];
+	unsigned char in[CPCAP_SERVE_OUT_LEN];
+	int fd, next = 0, done = 0, errors = 0, inflight = 0;
+	size_t in_len = 0, pos, need, olen;
+	struct cpcap_msg m;
+	ssize_t n;
+
+	if (depth < 1 || depth > CPCAP_LOADGEN_MAX_DEPTH || requests < 1)
+		return -EINVAL;
+
+	fd = cpcap_connect(addr);
+	if (fd < 0) {
+		fprintf(stderr, "could not connect to %s: %i\n", addr, fd);
+		return fd;
+	}
+
+	lat = calloc(requests, sizeof(*lat));
+	if (!lat) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	start = cpcap_nsecs();
+	while (done < requests) {
+		olen = 0;
+		while (inflight < depth && next < requests) {
+			memset(&m, 0, sizeof(m));
+			m.op = op;
+			m.tag = next % depth;
+			m.offset = cpcap_register_info_tbl[next % CPCAP_NUM_REG_CPCAP].address * 4;
+			cpcap_msg_pack(out + olen, &m);
+			olen += CPCAP_MSG_LEN;
+			sent[m.tag] = cpcap_nsecs();
+			inflight++;
+			next++;
+		}
+
+		if (olen && cpcap_write_buf(fd, (char *)out, olen) < 0)
+			break;
+
+		n = read(fd, in + in_len, sizeof(in) - in_len);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			break;
+		}
+		in_len += n;
+
+		pos = 0;
+		while (in_len - pos >= CPCAP_MSG_LEN) {
+			cpcap_msg_unpack(&m, in + pos);
+			need = CPCAP_MSG_LEN;
+			if (m.op == CPCAP_OP_DUMP)
+				need += m.count * 4;
+			if (in_len - pos < need)
+				break;
+			if (m.status)
+				errors++;
+			lat[done++] = cpcap_nsecs() - sent[m.tag % depth];
+			inflight--;
+			pos += need;
+		}
+		memmove(in, in + pos, in_len - pos);
+		in_len -= pos;
+	}
+	elapsed = cpcap_nsecs() - start;
+	close(fd);
+
+	if (done < requests)
+		fprintf(stderr, "connection lost after %i replies\n", done);
+
+	if (done) {
+		qsort(lat, done, sizeof(*lat), cpcap_cmp_ull);
+		printf("%i requests, %i errors, depth %i: %.0f req/s, "
+		       "p50 %.1f us, p99 %.1f us, max %.1f us\n",
+		       done, errors, depth, done * 1e9 / elapsed,
+		       lat[done / 2] / 1000.0, lat[done * 99 / 100] / 1000.0,
+		       lat[done - 1] / 1000.0);
+	}
+	free(lat);
+
+	return done < requests ? -EIO : 0;
+}
+
+#define CPCAP_BITS_PER_LONG	(8 * sizeof(unsigned long))
+#define CPCAP_BITMAP_LONGS(n)	(((n) + CPCAP_BITS_PER_LONG - 1) / \
+				 CPCAP_BITS_PER_LONG)
+
+static int cpcap_test_bit(const unsigned long *bitmap, int nr)
+{
+	return (bitmap[nr / CPCAP_BITS_PER_LONG] >>
+		(nr % CPCAP_BITS_PER_LONG)) & 1;
+}
+
+static void cpcap_set_bit(unsigned long *bitmap, int nr)
+{
+	bitmap[nr / CPCAP_BITS_PER_LONG] |= 1UL << (nr % CPCAP_BITS_PER_LONG);
+}
+
+/*
+ * Compares n register values under mask, or all bits if mask is NULL,
+ * and sets a bit in changed for each register that differs. Compares
+ * four registers at a time and only looks at the individual registers
+ * of the words that differ. Returns the number of changed registers.
+ */
+static int cpcap_diff_vals(const unsigned short *a, const unsigned short *b,
+			   const unsigned short *mask, int n,
+			   unsigned long *changed)
+{
+	unsigned long long x, y, m = ~0ULL;
+	int i, j, count = 0;
+
+	memset(changed, 0, CPCAP_BITMAP_LONGS(n) * sizeof(*changed));
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		memcpy(&x, a + i, sizeof(x));
+		memcpy(&y, b + i, sizeof(y));
+		if (mask)
+			memcpy(&m, mask + i, sizeof(m));
+		if (!((x ^ y) & m))
+			continue;
+
+		for (j = i; j < i + 4; j++) {
+			if ((a[j] ^ b[j]) & (mask ? mask[j] : 0xffff)) {
+				cpcap_set_bit(changed, j);
+				count++;
+			}
+		}
+	}
+
+	for (; i < n; i++) {
+		if ((a[i] ^ b[i]) & (mask ? mask[i] : 0xffff)) {
+			cpcap_set_bit(changed, i);
+			count++;
+		}
+	}
+
+	return count;
+}
+
+static int cpcap_read_full(int fd, void *buf, size_t len)
+{
+	size_t pos = 0;
+	ssize_t n;
+
+	while (pos < len) {
+		n = read(fd, (char *)buf + pos, len - pos);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (!n)
+			break;
+		pos += n;
+	}
+
+	return pos;
+}
+
+/*
+ * Snapshot file for --snapshot, --diff and --restore, little-endian:
+ *
+ *	char magic[4] "CPCS", u16 version, u16 count,
+ *	count times u16 offset, u16 value
+ */
+#define CPCAP_SNAP_MAGIC	"CPCS"
+#define CPCAP_SNAP_VERSION	1
+#define CPCAP_SNAP_HDR_LEN	8
+#define CPCAP_SNAP_LEN		(CPCAP_SNAP_HDR_LEN + CPCAP_NUM_REG_CPCAP * 4)
+
+static int cpcap_snapshot_save(struct cpcap_dev *dev, const char *name)
+{
+	unsigned short vals[CPCAP_NUM_REG_CPCAP];
+	unsigned char buf[CPCAP_SNAP_LEN], *p;
+	int i, fd, error;
+
+	error = cpcap_snapshot(dev, vals);
+	if (error < 0) {
+		fprintf(stderr, "read failed: %i\n", error);
+		return error;
+	}
+
+	memcpy(buf, CPCAP_SNAP_MAGIC, 4);
+	cpcap_put16(buf + 4, CPCAP_SNAP_VERSION);
+	cpcap_put16(buf + 6, CPCAP_NUM_REG_CPCAP);
+	p = buf + CPCAP_SNAP_HDR_LEN;
+	for (i = 0; i < CPCAP_NUM_REG_CPCAP; i++, p += 4) {
+		cpcap_put16(p, cpcap_register_info_tbl[i].address * 4);
+		cpcap_put16(p + 2, vals[i]);
+	}
+
+	fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		error = -errno;
+		fprintf(stderr, "Could not open %s: %i\n", name, error);
+		return error;
+	}
+	error = cpcap_write_buf(fd, (char *)buf, sizeof(buf));
+	close(fd);
+
+	return error;
+}
+
+/*
+ * Loads a snapshot into vals by register index, and sets the bits in
+ * valid for the registers found in the file.
+ */
+static int cpcap_snapshot_load(const char *name, unsigned short *vals,
+			       unsigned long *valid)
+{
+	unsigned char buf[CPCAP_SNAP_HDR_LEN + CPCAP_REG_MAX_OFFSET + 4];
+	const unsigned char *p;
+	int fd, len, i, index, count;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		len = -errno;
+		fprintf(stderr, "Could not open %s: %i\n", name, len);
+		return len;
+	}
+	len = cpcap_read_full(fd, buf, sizeof(buf));
+	close(fd);
+
+	if (len < CPCAP_SNAP_HDR_LEN || memcmp(buf, CPCAP_SNAP_MAGIC, 4) ||
+	    cpcap_get16(buf + 4) != CPCAP_SNAP_VERSION)
+		goto invalid;
+
+	count = cpcap_get16(buf + 6);
+	if (len < CPCAP_SNAP_HDR_LEN + count * 4)
+		goto invalid;
+
+	memset(vals, 0, CPCAP_NUM_REG_CPCAP * sizeof(*vals));
+	memset(valid, 0, CPCAP_BITMAP_LONGS(CPCAP_NUM_REG_CPCAP) *
+	       sizeof(*valid));
+
+	p = buf + CPCAP_SNAP_HDR_LEN;
+	for (i = 0; i < count; i++, p += 4) {
+		index = cpcap_offset_to_index(cpcap_get16(p));
+		if (index < 0)
+			continue;
+		vals[index] = cpcap_get16(p + 2);
+		cpcap_set_bit(valid, index);
+	}
+
+	return 0;
+
+invalid:
+	fprintf(stderr, "%s is not a snapshot file\n", name);
+
+	return -EINVAL;
+}
+
+/*
+ * Prints the registers that changed since the snapshot was saved,
+ * ignoring the bits in constant_mask unless all_bits is set.
+ */
+static int cpcap_diff(struct cpcap_dev *dev, const char *name, int all_bits)
+{
+	unsigned long changed[CPCAP_BITMAP_LONGS(CPCAP_NUM_REG_CPCAP)];
+	unsigned long valid[CPCAP_BITMAP_LONGS(CPCAP_NUM_REG_CPCAP)];
+	unsigned short saved[CPCAP_NUM_REG_CPCAP];
+	unsigned short vals[CPCAP_NUM_REG_CPCAP];
+	unsigned short mask;
+	int i, count, error;
+
+	error = cpcap_snapshot_load(name, saved, valid);
+	if (error)
+		return error;
+
+	error = cpcap_snapshot(dev, vals);
+	if (error < 0) {
+		fprintf(stderr, "read failed: %i\n", error);
+		return error;
+	}
+
+	count = cpcap_diff_vals(saved, vals, all_bits ? NULL : register_care_tbl,
+				CPCAP_NUM_REG_CPCAP, changed);
+
+	for (i = 0; i < CPCAP_NUM_REG_CPCAP && count; i++) {
+		if (!cpcap_test_bit(changed, i) || !cpcap_test_bit(valid, i))
+			continue;
+		mask = all_bits ? 0xffff : register_care_tbl[i];
+		printf("CPCAP register%i 0x%04x: 0x%04x -> 0x%04x xor 0x%04x\n",
+		       i, cpcap_register_info_tbl[i].address * 4, saved[i], vals[i],
+		       (saved[i] ^ vals[i]) & mask);
+	}
+
+	return 0;
+}
+
+/*
+ * Writes back the registers that differ from the snapshot with as few
+ * writes as possible. Only the changed bits are written, with the rest
+ * preserved by the read before write in the driver. Bits in
+ * constant_mask are skipped, and so are registers without an rbw_mask
+ * such as the interrupt status registers where a write is not a plain
+ * store. The register table is sorted by address so the writes are
+ * done one register block at a time.
+ */
+static int cpcap_restore(struct cpcap_dev *dev, const char *name,
+			 int dry_run)
+{
+	unsigned long changed[CPCAP_BITMAP_LONGS(CPCAP_NUM_REG_CPCAP)];
+	unsigned long valid[CPCAP_BITMAP_LONGS(CPCAP_NUM_REG_CPCAP)];
+	unsigned short saved[CPCAP_NUM_REG_CPCAP];
+	unsigned short vals[CPCAP_NUM_REG_CPCAP];
+	int i, offset, block = -1, naive = 0, writes = 0, skipped = 0;
+	int failed = 0, error;
+	unsigned short mask;
+
+	error = cpcap_snapshot_load(name, saved, valid);
+	if (error)
+		return error;
+
+	error = cpcap_snapshot(dev, vals);
+	if (error < 0) {
+		fprintf(stderr, "read failed: %i\n", error);
+		return error;
+	}
+
+	cpcap_diff_vals(saved, vals, register_care_tbl, CPCAP_NUM_REG_CPCAP,
+			changed);
+
+	for (i = 0; i < CPCAP_NUM_REG_CPCAP; i++) {
+		if (!cpcap_test_bit(valid, i))
+			continue;
+		naive++;
+		if (!cpcap_test_bit(changed, i))
+			continue;
+
+		mask = (saved[i] ^ vals[i]) & register_care_tbl[i] &
+			cpcap_register_info_tbl[i].rbw_mask;
+		if (!mask) {
+			skipped++;
+			continue;
+		}
+
+		offset = cpcap_register_info_tbl[i].address * 4;
+		if (dry_run && (offset >> 9) != block) {
+			block = offset >> 9;
+			printf("block 0x%04x:\n", offset & ~0x1ff);
+		}
+		if (dry_run) {
+			printf("  0x%04x 0x%04x -> 0x%04x mask 0x%04x\n",
+			       offset, vals[i],
+			       (vals[i] & ~mask) | (saved[i] & mask), mask);
+			writes++;
+			continue;
+		}
+
+		error = cpcap_write_index(dev, i, saved[i], mask);
+		if (error < 0) {
+			fprintf(stderr, "write 0x%04x failed: %i\n",
+				offset, error);
+			failed++;
+			continue;
+		}
+		writes++;
+	}
+
+	fflush(stdout);
+	fprintf(stderr, "%s%i writes instead of %i, %i saved, "
+		"%i registers not writable, %i failed\n",
+		dry_run ? "dry run: " : "", writes, naive, naive - writes,
+		skipped, failed);
+
+	return failed ? -EIO : 0;
+}
+
+#define CPCAP_WATCH_MAX_REGS	32
+#define CPCAP_RING_LEN		8192	/* Samples, must be a power of two */
+
+struct cpcap_sample {
+	unsigned long long t;		/* CLOCK_MONOTONIC in ns */
+	unsigned int read;		/* Registers read for this sample */
+	unsigned short vals[CPCAP_WATCH_MAX_REGS];
+};
+
+/*
+ * Single producer single consumer ring between the sampling loop and
+ * the output thread. The sampler never waits for the output, if the
+ * ring is full the sample is dropped and counted.
+ */
+struct cpcap_ring {
+	struct cpcap_sample *samples;
+	atomic_uint head;		/* Written by the sampler */
+	atomic_uint tail;		/* Written by the output thread */
+	atomic_int done;
+	unsigned long dropped;
+};
+
+static void cpcap_ts_add(struct timespec *ts, unsigned long long ns)
+{
+	ns += ts->tv_nsec;
+	ts->tv_sec += ns / 1000000000ULL;
+	ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static unsigned long long cpcap_ts_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static char *cpcap_fmt_time(char *p, unsigned long long t)
+{
+	p = cpcap_fmt_dec(p, t / 1000000000ULL, 1);
+	*p++ = '.';
+
+	return cpcap_fmt_dec(p, t / 1000 % 1000000, 6);
+}
+
+/*
+ * Formats "seconds.microseconds offset=value..." for a sample.
+ */
+static char *cpcap_fmt_sample(char *p, const unsigned short *offsets,
+			      int nregs, unsigned long long t,
+			      const unsigned short *vals,
+			      const unsigned long *changed)
+{
+	int i;
+
+	p = cpcap_fmt_time(p, t);
+	for (i = 0; i < nregs; i++) {
+		if (changed && !cpcap_test_bit(changed, i))
+			continue;
+		*p++ = ' ';
+		p = cpcap_fmt_hex16(p, offsets[i]);
+		*p++ = '=';
+		p = cpcap_fmt_hex16(p, vals[i]);
+	}
+	*p++ = '\n';
+
+	return p;
+}
+
+/*
+ * Binary capture format for --watch --capture, all little-endian.
+ * The file starts with a header:
+ *
+ *	char magic[4] "CPCW", u16 version, u16 nregs, u32 tick_ns,
+ *	u32 period in ticks, u64 CLOCK_MONOTONIC start in ns,
+ *	u64 CLOCK_REALTIME start in ns, u16 offsets[nregs]
+ *
+ * followed by blocks, each with a header:
+ *
+ *	u32 raw_len, u32 len, u32 samples, u16 flags, u16 reserved,
+ *	u64 first sample time, u64 last sample time, u32 changed,
+ *	u16 values[nregs]
+ *
+ * and len bytes of records, LZ compressed if CPCAP_BLOCK_COMPRESSED is
+ * set in flags. Times are CLOCK_MONOTONIC in ticks of tick_ns, and the
+ * values in the block header are the values of the first sample, so
+ * every block can be decoded on its own. Bit n of changed is set if
+ * register n changes within the block, so a reader looking for one
+ * register can skip the blocks where it is constant. Version 1 files
+ * do not have changed.
+ *
+ * Each record is a varint of the zigzag encoded time since the previous
+ * sample minus the period, a bitmap of the registers that changed, and
+ * a varint of the zigzag encoded difference for each changed register.
+ * The first record of a block is relative to the first sample time
+ * minus the period.
+ */
+#define CPCAP_CAP_MAGIC		"CPCW"
+#define CPCAP_CAP_VERSION	2
+#define CPCAP_CAP_TICK_NS	1000
+#define CPCAP_CAP_HDR_LEN	32	/* Without the offsets */
+#define CPCAP_BLOCK_HDR_LEN	36	/* Without the values */
+#define CPCAP_BLOCK_HDR_LEN_V1	32
+#define CPCAP_BLOCK_LEN		65536	/* Max raw length of records */
+#define CPCAP_BLOCK_COMPRESSED	(1 << 0)
+#define CPCAP_BITMAP_LEN	(CPCAP_WATCH_MAX_REGS / 8)
+#define CPCAP_RECORD_MAX	(10 + CPCAP_BITMAP_LEN + CPCAP_WATCH_MAX_REGS * 3)
+
+struct cpcap_cap_info {
+	int nregs;
+	int block_hdr_len;		/* Without the values */
+	unsigned int tick_ns;
+	unsigned long long period;	/* Ticks */
+	unsigned long long start_mono;	/* ns */
+	unsigned long long start_real;	/* ns */
+	unsigned short offsets[CPCAP_WATCH_MAX_REGS];
+};
+
+struct cpcap_block_info {
+	unsigned int raw_len;
+	unsigned int len;
+	unsigned int samples;
+	unsigned int flags;
+	unsigned long long t_first;	/* Ticks */
+	unsigned long long t_last;
+	unsigned int changed;
+	unsigned short vals[CPCAP_WATCH_MAX_REGS];
+};
+
+static void cpcap_put32(unsigned char *p, unsigned int val)
+{
+	cpcap_put16(p, val);
+	cpcap_put16(p + 2, val >> 16);
+}
+
+static unsigned int cpcap_get32(const unsigned char *p)
+{
+	return cpcap_get16(p) | (unsigned int)cpcap_get16(p + 2) << 16;
+}
+
+static void cpcap_put64(unsigned char *p, unsigned long long val)
+{
+	cpcap_put32(p, val);
+	cpcap_put32(p + 4, val >> 32);
+}
+
+static unsigned long long cpcap_get64(const unsigned char *p)
+{
+	return cpcap_get32(p) | (unsigned long long)cpcap_get32(p + 4) << 32;
+}
+
+static unsigned char *cpcap_put_varint(unsigned char *p, unsigned long long val)
+{
+	while (val >= 0x80) {
+		*p++ = val | 0x80;
+		val >>= 7;
+	}
+	*p++ = val;
+
+	return p;
+}
+
+static const unsigned char *cpcap_get_varint(const unsigned char *p,
+					     const unsigned char *end,
+					     unsigned long long *val)
+{
+	unsigned long long v = 0;
+	int shift = 0;
+
+	while (p < end && shift < 64) {
+		v |= (unsigned long long)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80)) {
+			*val = v;
+			return p;
+		}
+		shift += 7;
+	}
+
+	return NULL;
+}
+
+static unsigned long long cpcap_zigzag(long long val)
+{
+	return ((unsigned long long)val << 1) ^ (val >> 63);
+}
+
+static long long cpcap_unzigzag(unsigned long long val)
+{
+	return (val >> 1) ^ -(long long)(val & 1);
+}
+
+/*
+ * Small LZ77 block compressor using the LZ4 block layout: a token with
+ * the literal and match lengths, the literals, and a u16 match offset.
+ * Good enough for the repeating records of mostly idle registers.
+ */
+#define CPCAP_LZ_HASH_BITS	13
+#define CPCAP_LZ_MIN_MATCH	4
+#define CPCAP_LZ_LAST_LITERALS	5
+#define CPCAP_LZ_BOUND(n)	((n) + (n) / 255 + 16)
+
+static unsigned int cpcap_lz_read32(const unsigned char *p)
+{
+	unsigned int val;
+
+	memcpy(&val, p, sizeof(val));
+
+	return val;
+}
+
+static unsigned char *cpcap_lz_put_len(unsigned char *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+
+	return op;
+}
+
+static unsigned char *cpcap_lz_sequence(unsigned char *op,
+					const unsigned char *lit, size_t nlit,
+					unsigned int offset, size_t mlen)
+{
+	unsigned char *token = op++;
+
+	*token = (nlit < 15 ? nlit : 15) << 4;
+	if (nlit >= 15)
+		op = cpcap_lz_put_len(op, nlit - 15);
+	memcpy(op, lit, nlit);
+	op += nlit;
+
+	if (!mlen)
+		return op;
+
+	*op++ = offset;
+	*op++ = offset >> 8;
+	mlen -= CPCAP_LZ_MIN_MATCH;
+	*token |= mlen < 15 ? mlen : 15;
+	if (mlen >= 15)
+		op = cpcap_lz_put_len(op, mlen - 15);
+
+	return op;
+}
+
+static size_t cpcap_lz_compress(const unsigned char *src, size_t len,
+				unsigned char *dst)
+{
+	static unsigned int table[1 << CPCAP_LZ_HASH_BITS];
+	const unsigned char *ip = src, *anchor = src, *ref;
+	const unsigned char *end = src + len;
+	unsigned char *op = dst;
+	unsigned int h;
+	size_t mlen;
+
+	memset(table, 0, sizeof(table));
+
+	while (ip + CPCAP_LZ_MIN_MATCH + CPCAP_LZ_LAST_LITERALS <= end) {
+		h = (cpcap_lz_read32(ip) * 2654435761U) >>
+			(32 - CPCAP_LZ_HASH_BITS);
+		ref = src + table[h];
+		table[h] = ip - src;
+
+		if (ref >= ip || ip - ref > 0xffff ||
+		    cpcap_lz_read32(ref) != cpcap_lz_read32(ip)) {
+			ip++;
+			continue;
+		}
+
+		mlen = CPCAP_LZ_MIN_MATCH;
+		while (ip + mlen < end - CPCAP_LZ_LAST_LITERALS &&
+		       ref[mlen] == ip[mlen])
+			mlen++;
+
+		op = cpcap_lz_sequence(op, anchor, ip - anchor, ip - ref, mlen);
+		ip += mlen;
+		anchor = ip;
+	}
+
+	op = cpcap_lz_sequence(op, anchor, end - anchor, 0, 0);
+
+	return op - dst;
+}
+
+static int cpcap_lz_get_len(const unsigned char **ip,
+			    const unsigned char *end, size_t *len)
+{
+	unsigned char b;
+
+	do {
+		if (*ip >= end)
+			return -EIO;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+static long cpcap_lz_decompress(const unsigned char *src, size_t len,
+				unsigned char *dst, size_t size)
+{
+	const unsigned char *ip = src, *end = src + len;
+	unsigned char *op = dst, *oend = dst + size;
+	unsigned int token, offset;
+	size_t nlit, mlen;
+
+	while (ip < end) {
+		token = *ip++;
+
+		nlit = token >> 4;
+		if (nlit == 15 && cpcap_lz_get_len(&ip, end, &nlit))
+			return -EIO;
+		if (nlit > end - ip || nlit > oend - op)
+			return -EIO;
+		memcpy(op, ip, nlit);
+		ip += nlit;
+		op += nlit;
+
+		if (ip == end)
+			break;
+
+		if (end - ip < 2)
+			return -EIO;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+
+		mlen = token & 15;
+		if (mlen == 15 && cpcap_lz_get_len(&ip, end, &mlen))
+			return -EIO;
+		mlen += CPCAP_LZ_MIN_MATCH;
+
+		if (!offset || offset > op - dst || mlen > oend - op)
+			return -EIO;
+		while (mlen--) {
+			*op = *(op - offset);
+			op++;
+		}
+	}
+
+	return op - dst;
+}
+
+struct cpcap_capture {
+	int fd;
+	int compress;
+	struct cpcap_cap_info info;
+	struct cpcap_block_info block;
+	unsigned long long prev_t;
+	unsigned short prev[CPCAP_WATCH_MAX_REGS];
+	unsigned long long samples;
+	unsigned long long bytes;	/* Written to the file */
+	size_t len;
+	unsigned char raw[CPCAP_BLOCK_LEN];
+	unsigned char comp[CPCAP_LZ_BOUND(CPCAP_BLOCK_LEN)];
+};
+
+static int cpcap_capture_write(struct cpcap_capture *c, const void *buf,
+			       size_t len)
+{
+	c->bytes += len;
+
+	return cpcap_write_buf(c->fd, buf, len);
+}
+
+static int cpcap_capture_start(struct cpcap_capture *c, int fd,
+			       const unsigned short *offsets, int nregs,
+			       unsigned long long period_ns, int compress)
+{
+	unsigned char hdr[CPCAP_CAP_HDR_LEN + CPCAP_WATCH_MAX_REGS * 2];
+	struct timespec ts;
+	int i;
+
+	memset(c, 0, offsetof(struct cpcap_capture, raw));
+	c->fd = fd;
+	c->compress = compress;
+	c->info.nregs = nregs;
+	c->info.block_hdr_len = CPCAP_BLOCK_HDR_LEN;
+	c->info.tick_ns = CPCAP_CAP_TICK_NS;
+	c->info.period = period_ns / CPCAP_CAP_TICK_NS;
+	memcpy(c->info.offsets, offsets, nregs * sizeof(*offsets));
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	c->info.start_mono = cpcap_ts_ns(&ts);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	c->info.start_real = cpcap_ts_ns(&ts);
+
+	memcpy(hdr, CPCAP_CAP_MAGIC, 4);
+	cpcap_put16(hdr + 4, CPCAP_CAP_VERSION);
+	cpcap_put16(hdr + 6, nregs);
+	cpcap_put32(hdr + 8, c->info.tick_ns);
+	cpcap_put32(hdr + 12, c->info.period);
+	cpcap_put64(hdr + 16, c->info.start_mono);
+	cpcap_put64(hdr + 24, c->info.start_real);
+	for (i = 0; i < nregs; i++)
+		cpcap_put16(hdr + CPCAP_CAP_HDR_LEN + i * 2, offsets[i]);
+
+	return cpcap_capture_write(c, hdr, CPCAP_CAP_HDR_LEN + nregs * 2);
+}
+
+static int cpcap_capture_flush(struct cpcap_capture *c)
+{
+	unsigned char hdr[CPCAP_BLOCK_HDR_LEN + CPCAP_WATCH_MAX_REGS * 2];
+	struct cpcap_block_info *b = &c->block;
+	const unsigned char *payload = c->raw;
+	size_t len = c->len;
+	int i, error;
+
+	if (!b->samples)
+		return 0;
+
+	b->flags = 0;
+	if (c->compress) {
+		len = cpcap_lz_compress(c->raw, c->len, c->comp);
+		if (len < c->len) {
+			payload = c->comp;
+			b->flags |= CPCAP_BLOCK_COMPRESSED;
+		} else {
+			len = c->len;
+		}
+	}
+
+	cpcap_put32(hdr, c->len);
+	cpcap_put32(hdr + 4, len);
+	cpcap_put32(hdr + 8, b->samples);
+	cpcap_put16(hdr + 12, b->flags);
+	cpcap_put16(hdr + 14, 0);
+	cpcap_put64(hdr + 16, b->t_first);
+	cpcap_put64(hdr + 24, b->t_last);
+	cpcap_put32(hdr + 32, b->changed);
+	for (i = 0; i < c->info.nregs; i++)
+		cpcap_put16(hdr + CPCAP_BLOCK_HDR_LEN + i * 2, b->vals[i]);
+
+	error = cpcap_capture_write(c, hdr,
+				    CPCAP_BLOCK_HDR_LEN + c->info.nregs * 2);
+	if (!error)
+		error = cpcap_capture_write(c, payload, len);
+
+	b->samples = 0;
+	c->len = 0;
+
+	return error;
+}
+
+/*
+ * Adds a sample with t in CLOCK_MONOTONIC ns to the capture.
+ */
+static int cpcap_capture_add(struct cpcap_capture *c, unsigned long long t,
+			     const unsigned short *vals)
+{
+	struct cpcap_block_info *b = &c->block;
+	unsigned char *p, *bitmap;
+	int i, nregs = c->info.nregs, error;
+
+	if (c->len + CPCAP_RECORD_MAX > CPCAP_BLOCK_LEN) {
+		error = cpcap_capture_flush(c);
+		if (error)
+			return error;
+	}
+
+	t /= c->info.tick_ns;
+	if (!b->samples) {
+		b->t_first = t;
+		memcpy(b->vals, vals, nregs * sizeof(*vals));
+		memcpy(c->prev, vals, nregs * sizeof(*vals));
+		c->prev_t = t - c->info.period;
+		b->changed = 0;
+	}
+	b->t_last = t;
+	b->samples++;
+	c->samples++;
+
+	p = c->raw + c->len;
+	p = cpcap_put_varint(p, cpcap_zigzag(t - c->prev_t - c->info.period));
+	c->prev_t = t;
+
+	bitmap = p;
+	p += (nregs + 7) / 8;
+	memset(bitmap, 0, p - bitmap);
+
+	for (i = 0; i < nregs; i++) {
+		if (vals[i] == c->prev[i])
+			continue;
+		bitmap[i / 8] |= 1 << (i % 8);
+		b->changed |= 1U << i;
+		p = cpcap_put_varint(p, cpcap_zigzag((short)(vals[i] -
+							     c->prev[i])));
+		c->prev[i] = vals[i];
+	}
+	c->len = p - c->raw;
+
+	return 0;
+}
+
+/*
+ * Parses the capture file header, returns its length or negative error.
+ */
+static int cpcap_cap_parse(struct cpcap_cap_info *info,
+			   const unsigned char *p, size_t len)
+{
+	int i;
+
+	if (len < CPCAP_CAP_HDR_LEN || memcmp(p, CPCAP_CAP_MAGIC, 4))
+		return -EINVAL;
+	switch (cpcap_get16(p + 4)) {
+	case 1:
+		info->block_hdr_len = CPCAP_BLOCK_HDR_LEN_V1;
+		break;
+	case CPCAP_CAP_VERSION:
+		info->block_hdr_len = CPCAP_BLOCK_HDR_LEN;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	info->nregs = cpcap_get16(p + 6);
+	info->tick_ns = cpcap_get32(p + 8);
+	info->period = cpcap_get32(p + 12);
+	info->start_mono = cpcap_get64(p + 16);
+	info->start_real = cpcap_get64(p + 24);
+	if (!info->nregs || info->nregs > CPCAP_WATCH_MAX_REGS ||
+	    !info->tick_ns)
+		return -EINVAL;
+	if (len < CPCAP_CAP_HDR_LEN + info->nregs * 2)
+		return -EINVAL;
+
+	for (i = 0; i < info->nregs; i++)
+		info->offsets[i] = cpcap_get16(p + CPCAP_CAP_HDR_LEN + i * 2);
+
+	return CPCAP_CAP_HDR_LEN + info->nregs * 2;
+}
+
+/*
+ * Parses a block header, returns its length or negative error.
+ */
+static int cpcap_block_parse(const struct cpcap_cap_info *info,
+			     struct cpcap_block_info *b,
+			     const unsigned char *p, size_t len)
+{
+	int i;
+
+	if (len < info->block_hdr_len + info->nregs * 2)
+		return -EINVAL;
+
+	b->raw_len = cpcap_get32(p);
+	b->len = cpcap_get32(p + 4);
+	b->samples = cpcap_get32(p + 8);
+	b->flags = cpcap_get16(p + 12);
+	b->t_first = cpcap_get64(p + 16);
+	b->t_last = cpcap_get64(p + 24);
+	b->changed = info->block_hdr_len > CPCAP_BLOCK_HDR_LEN_V1 ?
+		cpcap_get32(p + 32) : ~0U;
+	if (b->raw_len > CPCAP_BLOCK_LEN ||
+	    b->len > CPCAP_LZ_BOUND(CPCAP_BLOCK_LEN))
+		return -EINVAL;
+
+	for (i = 0; i < info->nregs; i++)
+		b->vals[i] = cpcap_get16(p + info->block_hdr_len + i * 2);
+
+	return info->block_hdr_len + info->nregs * 2;
+}
+
+typedef int (*cpcap_sample_fn)(void *data, unsigned long long t,
+			       const unsigned short *vals);
+
+/*
+ * Decodes the records of a block and calls fn for each sample with
+ * the time in CLOCK_MONOTONIC ns. Returns the number of samples or
+ * negative error.
+ */
+static long cpcap_block_decode(const struct cpcap_cap_info *info,
+			       const struct cpcap_block_info *b,
+			       const unsigned char *raw, size_t len,
+			       cpcap_sample_fn fn, void *data)
+{
+	const unsigned char *p = raw, *end = raw + len, *bitmap;
+	unsigned short vals[CPCAP_WATCH_MAX_REGS];
+	int i, nregs = info->nregs, bitmap_len = (nregs + 7) / 8;
+	unsigned long long t, val;
+	long samples = 0;
+	int error;
+
+	memcpy(vals, b->vals, sizeof(vals));
+	t = b->t_first - info->period;
+
+	while (p < end) {
+		p = cpcap_get_varint(p, end, &val);
+		if (!p || end - p < bitmap_len)
+			return -EIO;
+		t += info->period + cpcap_unzigzag(val);
+
+		bitmap = p;
+		p += bitmap_len;
+		for (i = 0; i < nregs; i++) {
+			if (!(bitmap[i / 8] & (1 << (i % 8))))
+				continue;
+			p = cpcap_get_varint(p, end, &val);
+			if (!p)
+				return -EIO;
+			vals[i] += cpcap_unzigzag(val);
+		}
+
+		error = fn(data, t * info->tick_ns, vals);
+		if (error)
+			return error;
+		samples++;
+	}
+
+	return samples;
+}
+
+enum cpcap_decode_format {
+	CPCAP_DECODE_CSV,
+	CPCAP_DECODE_DEBUGFS,
+	CPCAP_DECODE_TEXT,
+};
+
+struct cpcap_decoder {
+	int out_fd;
+	int format;
+	const struct cpcap_cap_info *info;
+	char *out;
+	size_t out_len;
+	int error;
+};
+
+#define CPCAP_DECODE_OUT_LEN	(1024 * 1024)
+#define CPCAP_DECODE_LINE_MAX	(24 + CPCAP_WATCH_MAX_REGS * 16)
+
+static int cpcap_decode_sample(void *data, unsigned long long t,
+			       const unsigned short *vals)
+{
+	struct cpcap_decoder *d = data;
+	const struct cpcap_cap_info *info = d->info;
+	char *p;
+	int i;
+
+	if (d->out_len + CPCAP_DECODE_LINE_MAX > CPCAP_DECODE_OUT_LEN) {
+		d->error = cpcap_write_buf(d->out_fd, d->out, d->out_len);
+		if (d->error)
+			return d->error;
+		d->out_len = 0;
+	}
+
+	p = d->out + d->out_len;
+	switch (d->format) {
+	case CPCAP_DECODE_CSV:
+		p = cpcap_fmt_time(p, t);
+		for (i = 0; i < info->nregs; i++) {
+			*p++ = ',';
+			p = cpcap_fmt_hex16(p, vals[i]);
+		}
+		*p++ = '\n';
+		break;
+	case CPCAP_DECODE_DEBUGFS:
+		*p++ = '#';
+		*p++ = ' ';
+		p = cpcap_fmt_time(p, t);
+		*p++ = '\n';
+		for (i = 0; i < info->nregs; i++)
+			p = cpcap_fmt_line(p, info->offsets[i], vals[i]);
+		break;
+	default:
+		p = cpcap_fmt_sample(p, info->offsets, info->nregs, t, vals,
+				     NULL);
+		break;
+	}
+	d->out_len = p - d->out;
+
+	return 0;
+}
+
+/*
+ * Opens a capture file and parses its header, returns the fd or
+ * negative error.
+ */
+static int cpcap_cap_open(const char *name, struct cpcap_cap_info *info)
+{
+	unsigned char hdr[CPCAP_CAP_HDR_LEN + CPCAP_WATCH_MAX_REGS * 2];
+	int fd, n, error;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		error = -errno;
+		fprintf(stderr, "Could not open %s: %i\n", name, error);
+		return error;
+	}
+
+	n = cpcap_read_full(fd, hdr, CPCAP_CAP_HDR_LEN);
+	if (n == CPCAP_CAP_HDR_LEN &&
+	    cpcap_get16(hdr + 6) <= CPCAP_WATCH_MAX_REGS)
+		n += cpcap_read_full(fd, hdr + n, cpcap_get16(hdr + 6) * 2);
+	if (n < 0 || cpcap_cap_parse(info, hdr, n) < 0) {
+		fprintf(stderr, "%s is not a capture file\n", name);
+		close(fd);
+		return -EINVAL;
+	}
+
+	return fd;
+}
+
+/*
+ * Reads the blocks of a capture file opened with cpcap_cap_open() and
+ * calls fn for each sample.
+ */
+static int cpcap_cap_replay(int fd, const struct cpcap_cap_info *info,
+			    cpcap_sample_fn fn, void *data,
+			    unsigned long long *samples)
+{
+	unsigned char hdr[CPCAP_BLOCK_HDR_LEN + CPCAP_WATCH_MAX_REGS * 2];
+	unsigned char *buf, *raw;
+	const unsigned char *payload;
+	struct cpcap_block_info b;
+	int n, len, payload_len, error = 0;
+	long count;
+
+	buf = malloc(CPCAP_LZ_BOUND(CPCAP_BLOCK_LEN));
+	raw = malloc(CPCAP_BLOCK_LEN);
+	if (!buf || !raw) {
+		error = -ENOMEM;
+		goto out;
+	}
+
+	*samples = 0;
+	len = info->block_hdr_len + info->nregs * 2;
+	for (;;) {
+		n = cpcap_read_full(fd, hdr, len);
+		if (!n)
+			break;
+		if (n != len || cpcap_block_parse(info, &b, hdr, n) < 0 ||
+		    cpcap_read_full(fd, buf, b.len) != b.len) {
+			fprintf(stderr, "truncated or corrupt block\n");
+			error = -EIO;
+			goto out;
+		}
+
+		payload = buf;
+		payload_len = b.len;
+		if (b.flags & CPCAP_BLOCK_COMPRESSED) {
+			if (cpcap_lz_decompress(buf, b.len, raw,
+						CPCAP_BLOCK_LEN) != b.raw_len) {
+				fprintf(stderr, "corrupt compressed block\n");
+				error = -EIO;
+				goto out;
+			}
+			payload = raw;
+			payload_len = b.raw_len;
+		}
+
+		count = cpcap_block_decode(info, &b, payload, payload_len,
+					   fn, data);
+		if (count < 0) {
+			error = count;
+			goto out;
+		}
+		*samples += count;
+	}
+
+out:
+	free(raw);
+	free(buf);
+
+	return error;
+}
+
+/*
+ * Streams a capture file to out_fd as CSV, debugfs or --watch text.
+ */
+static int cpcap_decode(const char *name, int out_fd, int format,
+			unsigned long long *samples)
+{
+	struct cpcap_decoder d = { 0 };
+	struct cpcap_cap_info info;
+	int fd, i, error;
+	char *p;
+
+	fd = cpcap_cap_open(name, &info);
+	if (fd < 0)
+		return fd;
+
+	d.out = malloc(CPCAP_DECODE_OUT_LEN);
+	if (!d.out) {
+		error = -ENOMEM;
+		goto out;
+	}
+
+	d.out_fd = out_fd;
+	d.format = format;
+	d.info = &info;
+
+	if (format == CPCAP_DECODE_CSV) {
+		p = d.out;
+		memcpy(p, "time", 4);
+		p += 4;
+		for (i = 0; i < info.nregs; i++) {
+			*p++ = ',';
+			p = cpcap_fmt_hex16(p, info.offsets[i]);
+		}
+		*p++ = '\n';
+		d.out_len = p - d.out;
+	}
+
+	error = cpcap_cap_replay(fd, &info, cpcap_decode_sample, &d, samples);
+	if (!error)
+		error = cpcap_write_buf(out_fd, d.out, d.out_len);
+
+out:
+	free(d.out);
+	close(fd);
+
+	return error;
+}
+
+/*
+ * Multi-rate scheduling: each register has its own period and the
+ * next deadlines are kept in a min-heap. The registers due within
+ * CPCAP_SCHED_MERGE_NS of each other are read in one burst. With
+ * adaptive set, the period of a register that changed is halved down
+ * to its period / CPCAP_SCHED_BOOST, and doubled back up after
+ * CPCAP_SCHED_IDLE reads without changes.
+ */
+#define CPCAP_SCHED_MERGE_NS	200000
+#define CPCAP_SCHED_BOOST	8
+#define CPCAP_SCHED_IDLE	4
+
+struct cpcap_sched_reg {
+	unsigned long long deadline;	/* ns */
+	unsigned long long period;	/* ns, current */
+	unsigned long long base;	/* ns, requested */
+	unsigned long long reads;
+	unsigned int idle;
+};
+
+#define CPCAP_WATCH_MAX_TRIGGERS	8
+
+enum {
+	CPCAP_TRIG_RISE,
+	CPCAP_TRIG_FALL,
+	CPCAP_TRIG_ABOVE,
+	CPCAP_TRIG_BELOW,
+	CPCAP_TRIG_CHANGE,
+};
+
+struct cpcap_trigger {
+	const char *expr;
+	int type;
+	int reg;			/* Index in the watch list */
+	unsigned short mask;		/* Bit, mask or threshold */
+	unsigned long long fired;
+};
+
+struct cpcap_watch {
+	struct cpcap_dev *dev;
+	int nregs;
+	unsigned short offsets[CPCAP_WATCH_MAX_REGS];
+	unsigned long long period;	/* ns */
+	unsigned long long count;	/* Samples to take, 0 for no limit */
+	int out_fd;
+	struct cpcap_ring ring;
+	struct cpcap_capture *cap;	/* Binary capture instead of text */
+	int changes_only;
+	unsigned short prev[CPCAP_WATCH_MAX_REGS];
+	unsigned long long emitted;
+	unsigned long output_errors;
+	char *out_buf;
+	size_t out_len;
+
+	/* Multi-rate, set if any register has its own rate */
+	int multirate;
+	int adaptive;
+	double hz[CPCAP_WATCH_MAX_REGS];	/* 0 for the --period rate */
+	struct cpcap_sched_reg sched[CPCAP_WATCH_MAX_REGS];
+	unsigned char heap[CPCAP_WATCH_MAX_REGS];
+	unsigned long long burst_regs;
+
+	/* Triggered capture, history has room for pre samples */
+	struct cpcap_trigger triggers[CPCAP_WATCH_MAX_TRIGGERS];
+	unsigned int ntriggers;
+	unsigned int pre, post, post_left;
+	unsigned long long holdoff;	/* ns */
+	unsigned long long rearm;	/* ns */
+	unsigned long long fired;
+	struct cpcap_sample *history;
+	unsigned int hist_pos, hist_len;
+	unsigned short trig_prev[CPCAP_WATCH_MAX_REGS];
+	int have_prev;
+
+	/* Results */
+	unsigned long long samples;
+	unsigned long long missed;
+	unsigned long long errors;
+	double rate;			/* Hz */
+	double jitter_mean;		/* ns */
+	double jitter_max;		/* ns */
+	double late_sum, late_sq;
+};
+
+#define CPCAP_WATCH_OUT_LEN	65536
+#define CPCAP_WATCH_LINE_MAX	(24 + CPCAP_WATCH_MAX_REGS * 10)
+
+_Static_assert(CPCAP_WATCH_MAX_REGS <= 32, "read bitmap must fit in u32");
+
+/*
+ * Parses a comma separated list of register offsets, each optionally
+ * followed by @hz for its own sampling rate.
+ */
+static int cpcap_watch_parse_regs(struct cpcap_watch *w, const char *list)
+{
+	char buf[512], *p, *token, *rate, *end;
+	int offset;
+
+	if (strlen(list) >= sizeof(buf))
+		return -EINVAL;
+	strcpy(buf, list);
+
+	p = buf;
+	while ((token = strsep(&p, ","))) {
+		if (!*token)
+			continue;
+		rate = strchr(token, '@');
+		if (rate)
+			*rate++ = '\0';
+		offset = cpcap_parse_offset(token);
+		if (offset < 0 || cpcap_offset_to_index(offset) < 0) {
+			fprintf(stderr, "invalid register: %s\n", token);
+			return -EINVAL;
+		}
+		if (w->nregs >= CPCAP_WATCH_MAX_REGS) {
+			fprintf(stderr, "too many registers, max %i\n",
+				CPCAP_WATCH_MAX_REGS);
+			return -EINVAL;
+		}
+		if (rate) {
+			w->hz[w->nregs] = strtod(rate, &end);
+			if (end == rate || *end || w->hz[w->nregs] <= 0 ||
+			    w->hz[w->nregs] > 1e6) {
+				fprintf(stderr, "invalid rate: %s\n", rate);
+				return -EINVAL;
+			}
+			w->multirate = 1;
+		}
+		w->offsets[w->nregs] = offset;
+		w->nregs++;
+	}
+
+	return w->nregs ? 0 : -EINVAL;
+}
+
+static void cpcap_watch_flush(struct cpcap_watch *w)
+{
+	if (w->out_len && cpcap_write_buf(w->out_fd, w->out_buf,
+					  w->out_len) < 0)
+		fprintf(stderr, "could not write samples\n");
+	w->out_len = 0;
+}
+
+/*
+ * Writes out a sample. With changes_only, only the registers that
+ * changed since the previous sample are written, and samples with no
+ * changes are skipped. With multirate, only the registers read for
+ * the sample are written as text, the capture has them all.
+ */
+static void cpcap_watch_emit(struct cpcap_watch *w,
+			     const struct cpcap_sample *s)
+{
+	unsigned long changed[CPCAP_BITMAP_LONGS(CPCAP_WATCH_MAX_REGS)];
+	unsigned long read[CPCAP_BITMAP_LONGS(CPCAP_WATCH_MAX_REGS)] = { 0 };
+	unsigned long *mask = NULL;
+
+	if (w->multirate) {
+		read[0] = s->read;
+		mask = read;
+	}
+
+	if (w->changes_only) {
+		if (w->emitted && !cpcap_diff_vals(w->prev, s->vals, NULL,
+						   w->nregs, changed))
+			return;
+		if (w->emitted)
+			mask = changed;
+		memcpy(w->prev, s->vals, w->nregs * sizeof(*s->vals));
+	}
+	w->emitted++;
+
+	if (w->cap) {
+		if (cpcap_capture_add(w->cap, s->t, s->vals))
+			w->output_errors++;
+		return;
+	}
+
+	w->out_len = cpcap_fmt_sample(w->out_buf + w->out_len, w->offsets,
+				      w->nregs, s->t, s->vals, mask) -
+		w->out_buf;
+}
+/*
+ * Triggered capture. Triggers are evaluated on every sample against
+ * the previous one, and until one fires the samples only go to the
+ * history ring of the last pre samples. When a trigger fires, the
+ * history, the sample and the next post samples are written out, and
+ * the triggers are re-armed holdoff after that. The trigger forms:
+ *
+ *	offset:bit^		bit rises
+ *	offset:bitv		bit falls
+ *	offset>value		value goes above
+ *	offset<value		value goes below
+ *	offset&mask		value changes under mask
+ */
+static int cpcap_trigger_parse(struct cpcap_watch *w, const char *expr)
+{
+	struct cpcap_trigger *tr;
+	char buf[64], *op, *end;
+	unsigned long arg;
+	int offset, i;
+
+	if (w->ntriggers >= CPCAP_WATCH_MAX_TRIGGERS ||
+	    strlen(expr) >= sizeof(buf))
+		return -EINVAL;
+	strcpy(buf, expr);
+	tr = &w->triggers[w->ntriggers];
+	tr->expr = expr;
+
+	op = strpbrk(buf, ":<>&");
+	if (!op)
+		return -EINVAL;
+
+	switch (*op) {
+	case ':':
+		arg = strtoul(op + 1, &end, 10);
+		if (end == op + 1 || arg > 15 || (strcmp(end, "^") &&
+						  strcmp(end, "v")))
+			return -EINVAL;
+		tr->type = *end == '^' ? CPCAP_TRIG_RISE : CPCAP_TRIG_FALL;
+		tr->mask = 1 << arg;
+		break;
+	case '>':
+	case '<':
+	case '&':
+		arg = strtoul(op + 1, &end, 16);
+		if (end == op + 1 || *end || arg > 0xffff)
+			return -EINVAL;
+		tr->type = *op == '>' ? CPCAP_TRIG_ABOVE :
+			*op == '<' ? CPCAP_TRIG_BELOW : CPCAP_TRIG_CHANGE;
+		tr->mask = arg;
+		break;
+	}
+	*op = '\0';
+
+	offset = cpcap_parse_offset(buf);
+	if (offset < 0 || cpcap_offset_to_index(offset) < 0)
+		return -EINVAL;
+
+	/* Watch the register if not in the list already */
+	for (i = 0; i < w->nregs && w->offsets[i] != offset; i++)
+		;
+	if (i == w->nregs) {
+		if (w->nregs >= CPCAP_WATCH_MAX_REGS)
+			return -EINVAL;
+		w->offsets[w->nregs++] = offset;
+	}
+	tr->reg = i;
+	w->ntriggers++;
+
+	return 0;
+}
+
+static int cpcap_trigger_eval(const struct cpcap_trigger *tr,
+			      const unsigned short *prev,
+			      const unsigned short *vals)
+{
+	unsigned short old = prev[tr->reg], val = vals[tr->reg];
+
+	switch (tr->type) {
+	case CPCAP_TRIG_RISE:
+		return !(old & tr->mask) && (val & tr->mask);
+	case CPCAP_TRIG_FALL:
+		return (old & tr->mask) && !(val & tr->mask);
+	case CPCAP_TRIG_ABOVE:
+		return old <= tr->mask && val > tr->mask;
+	case CPCAP_TRIG_BELOW:
+		return old >= tr->mask && val < tr->mask;
+	default:
+		return ((old ^ val) & tr->mask) != 0;
+	}
+}
+
+/*
+ * Output thread side of a sample, either written out directly or
+ * through the triggers.
+ */
+static void cpcap_watch_consume(struct cpcap_watch *w,
+				const struct cpcap_sample *s)
+{
+	struct cpcap_trigger *tr;
+	unsigned int i, fired = 0;
+
+	if (!w->ntriggers) {
+		cpcap_watch_emit(w, s);
+		return;
+	}
+
+	if (w->post_left) {
+		cpcap_watch_emit(w, s);
+		w->post_left--;
+		goto out;
+	}
+
+	if (w->have_prev && s->t >= w->rearm) {
+		for (i = 0; i < w->ntriggers; i++) {
+			tr = &w->triggers[i];
+			if (!cpcap_trigger_eval(tr, w->trig_prev, s->vals))
+				continue;
+			tr->fired++;
+			if (!fired++)
+				fprintf(stderr, "trigger %s at %.6f\n",
+					tr->expr, s->t / 1e9);
+		}
+	}
+
+	if (!fired) {
+		if (w->pre) {
+			w->history[w->hist_pos] = *s;
+			w->hist_pos = (w->hist_pos + 1) % w->pre;
+			if (w->hist_len < w->pre)
+				w->hist_len++;
+		}
+		goto out;
+	}
+
+	/* Oldest first, flushing as the history can be long */
+	for (i = 0; i < w->hist_len; i++) {
+		if (w->out_len + CPCAP_WATCH_LINE_MAX > CPCAP_WATCH_OUT_LEN)
+			cpcap_watch_flush(w);
+		cpcap_watch_emit(w, &w->history[(w->hist_pos + w->pre -
+						 w->hist_len + i) % w->pre]);
+	}
+	if (w->out_len + CPCAP_WATCH_LINE_MAX > CPCAP_WATCH_OUT_LEN)
+		cpcap_watch_flush(w);
+	cpcap_watch_emit(w, s);
+	w->hist_len = 0;
+	w->post_left = w->post;
+	w->rearm = s->t + w->holdoff;
+	w->fired++;
+
+out:
+	memcpy(w->trig_prev, s->vals, sizeof(w->trig_prev));
+	w->have_prev = 1;
+}
+
+/*
+ * Output thread, drains the ring every few milliseconds and writes
+ * the formatted samples out in large chunks.
+ */
+static void *cpcap_watch_output(void *data)
+{
+	struct timespec ts = { 0, 5000000 };
+	struct cpcap_watch *w = data;
+	struct cpcap_ring *r = &w->ring;
+	unsigned int head, tail;
+	int done;
+
+	for (;;) {
+		done = atomic_load_explicit(&r->done, memory_order_acquire);
+		head = atomic_load_explicit(&r->head, memory_order_acquire);
+		tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+		while (tail != head) {
+			if (w->out_len + CPCAP_WATCH_LINE_MAX > CPCAP_WATCH_OUT_LEN)
+				cpcap_watch_flush(w);
+			cpcap_watch_consume(w, &r->samples[tail &
+						(CPCAP_RING_LEN - 1)]);
+			tail++;
+			atomic_store_explicit(&r->tail, tail,
+					      memory_order_release);
+		}
+		cpcap_watch_flush(w);
+
+		if (done)
+			break;
+
+		nanosleep(&ts, NULL);
+	}
+
+	return NULL;
+}
+
+static void cpcap_watch_push(struct cpcap_watch *w,
+			     const struct cpcap_sample *s)
+{
+	struct cpcap_ring *r = &w->ring;
+	unsigned int head, tail;
+
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	if (head - tail >= CPCAP_RING_LEN) {
+		r->dropped++;
+		return;
+	}
+
+	r->samples[head & (CPCAP_RING_LEN - 1)] = *s;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+static void cpcap_watch_late(struct cpcap_watch *w, unsigned long long late)
+{
+	w->late_sum += late;
+	w->late_sq += (double)late * late;
+	if (late > w->jitter_max)
+		w->jitter_max = late;
+}
+
+/*
+ * Samples all the registers at fixed absolute deadlines.
+ */
+static void cpcap_watch_fixed(struct cpcap_watch *w, struct timespec *deadline)
+{
+	unsigned long long t, skip;
+	struct cpcap_sample s;
+	int error;
+
+	s.read = ~0U >> (32 - w->nregs);
+
+	while (!cpcap_stop && (!w->count || w->samples < w->count)) {
+		error = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					deadline, NULL);
+		if (error == EINTR)
+			continue;
+
+		t = cpcap_nsecs();
+		s.t = t;
+		if (cpcap_readv(w->dev, w->offsets, s.vals, w->nregs) < 0)
+			w->errors++;
+		w->samples++;
+		cpcap_watch_push(w, &s);
+		cpcap_watch_late(w, t - cpcap_ts_ns(deadline));
+
+		/* Skip the deadlines that already passed */
+		cpcap_ts_add(deadline, w->period);
+		t = cpcap_nsecs();
+		if (t > cpcap_ts_ns(deadline)) {
+			skip = (t - cpcap_ts_ns(deadline)) / w->period + 1;
+			w->missed += skip;
+			cpcap_ts_add(deadline, skip * w->period);
+		}
+	}
+}
+
+static int cpcap_heap_less(struct cpcap_watch *w, int a, int b)
+{
+	return w->sched[w->heap[a]].deadline < w->sched[w->heap[b]].deadline;
+}
+
+static void cpcap_heap_swap(struct cpcap_watch *w, int a, int b)
+{
+	unsigned char tmp = w->heap[a];
+
+	w->heap[a] = w->heap[b];
+	w->heap[b] = tmp;
+}
+
+static void cpcap_heap_up(struct cpcap_watch *w, int i)
+{
+	while (i > 0 && cpcap_heap_less(w, i, (i - 1) / 2)) {
+		cpcap_heap_swap(w, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void cpcap_heap_down(struct cpcap_watch *w, int i, int n)
+{
+	int child;
+
+	while ((child = 2 * i + 1) < n) {
+		if (child + 1 < n && cpcap_heap_less(w, child + 1, child))
+			child++;
+		if (!cpcap_heap_less(w, child, i))
+			break;
+		cpcap_heap_swap(w, i, child);
+		i = child;
+	}
+}
+
+static void cpcap_sched_adapt(struct cpcap_sched_reg *r, int changed)
+{
+	if (changed) {
+		r->idle = 0;
+		if (r->period / 2 >= r->base / CPCAP_SCHED_BOOST)
+			r->period /= 2;
+		return;
+	}
+
+	if (++r->idle >= CPCAP_SCHED_IDLE && r->period < r->base) {
+		r->period *= 2;
+		if (r->period > r->base)
+			r->period = r->base;
+		r->idle = 0;
+	}
+}
+
+static unsigned long long cpcap_sched_period(const struct cpcap_watch *w,
+					     int reg)
+{
+	return w->hz[reg] ? 1e9 / w->hz[reg] : w->period;
+}
+
+/*
+ * Samples each register at its own rate. Every sample has the latest
+ * values of all the registers, with the ones read for it in read.
+ */
+static void cpcap_watch_sched(struct cpcap_watch *w, unsigned long long start)
+{
+	unsigned short offsets[CPCAP_WATCH_MAX_REGS], vals[CPCAP_WATCH_MAX_REGS];
+	unsigned char list[CPCAP_WATCH_MAX_REGS];
+	unsigned long long t, due, skip;
+	struct cpcap_sched_reg *r;
+	struct cpcap_sample s;
+	int i, n, reg, nheap;
+	struct timespec ts;
+	int error;
+
+	for (i = 0; i < w->nregs; i++) {
+		w->sched[i].base = cpcap_sched_period(w, i);
+		w->sched[i].period = w->sched[i].base;
+		w->sched[i].deadline = start;
+		w->heap[i] = i;
+	}
+	nheap = w->nregs;
+	memset(&s, 0, sizeof(s));
+
+	while (!cpcap_stop && (!w->count || w->samples < w->count)) {
+		due = w->sched[w->heap[0]].deadline;
+		ts.tv_sec = due / 1000000000ULL;
+		ts.tv_nsec = due % 1000000000ULL;
+		error = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+					NULL);
+		if (error == EINTR)
+			continue;
+
+		t = cpcap_nsecs();
+		for (n = 0; nheap && w->sched[w->heap[0]].deadline <=
+			     t + CPCAP_SCHED_MERGE_NS; n++) {
+			list[n] = w->heap[0];
+			offsets[n] = w->offsets[list[n]];
+			w->heap[0] = w->heap[--nheap];
+			cpcap_heap_down(w, 0, nheap);
+		}
+
+		s.t = t;
+		s.read = 0;
+		error = cpcap_readv(w->dev, offsets, vals, n);
+		if (error < 0)
+			w->errors++;
+
+		for (i = 0; i < n; i++) {
+			reg = list[i];
+			r = &w->sched[reg];
+			if (!error) {
+				if (w->adaptive && r->reads)
+					cpcap_sched_adapt(r, s.vals[reg] !=
+							  vals[i]);
+				s.vals[reg] = vals[i];
+				s.read |= 1U << reg;
+				r->reads++;
+			}
+
+			r->deadline += r->period;
+			if (r->deadline <= t) {
+				skip = (t - r->deadline) / r->period + 1;
+				w->missed += skip;
+				r->deadline += skip * r->period;
+			}
+			w->heap[nheap] = reg;
+			cpcap_heap_up(w, nheap++);
+		}
+
+		w->burst_regs += n;
+		w->samples++;
+		cpcap_watch_push(w, &s);
+		cpcap_watch_late(w, t - due);
+	}
+}
+
+/*
+ * Samples the registers at fixed absolute deadlines, or at the rate of
+ * each register with multirate, and reports the achieved rates, the
+ * wake-up jitter and the missed deadlines.
+ */
+static int cpcap_watch(struct cpcap_watch *w)
+{
+	struct cpcap_ring *r = &w->ring;
+	struct timespec deadline;
+	unsigned long long start;
+	double mean, var, elapsed;
+	pthread_t thread;
+	int i, error;
+
+	r->samples = calloc(CPCAP_RING_LEN, sizeof(*r->samples));
+	w->out_buf = malloc(CPCAP_WATCH_OUT_LEN);
+	w->history = calloc(w->pre + 1, sizeof(*w->history));
+	if (!r->samples || !w->out_buf || !w->history) {
+		error = -ENOMEM;
+		goto free;
+	}
+
+	error = pthread_create(&thread, NULL, cpcap_watch_output, w);
+	if (error) {
+		error = -error;
+		goto free;
+	}
+
+	signal(SIGINT, cpcap_stop_handler);
+	signal(SIGTERM, cpcap_stop_handler);
+
+	/* The default 50 us timer slack would show up as jitter */
+	prctl(PR_SET_TIMERSLACK, 1);
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	start = cpcap_ts_ns(&deadline);
+
+	if (w->multirate)
+		cpcap_watch_sched(w, start);
+	else
+		cpcap_watch_fixed(w, &deadline);
+	elapsed = (cpcap_nsecs() - start) / 1e9;
+
+	atomic_store_explicit(&r->done, 1, memory_order_release);
+	pthread_join(thread, NULL);
+
+	if (w->cap && cpcap_capture_flush(w->cap))
+		w->output_errors++;
+
+	if (!w->samples)
+		goto free;
+
+	mean = w->late_sum / w->samples;
+	/* Rounding can take it below 0 when the jitter is constant */
+	var = w->late_sq / w->samples - mean * mean;
+	if (var < 0)
+		var = 0;
+	w->rate = w->samples / elapsed;
+	w->jitter_mean = mean;
+
+	if (w->multirate) {
+		fprintf(stderr, "%llu bursts in %.3f s, %.1f registers per "
+			"burst\n", w->samples, elapsed,
+			(double)w->burst_regs / w->samples);
+		for (i = 0; i < w->nregs; i++)
+			fprintf(stderr, "0x%04x: %.1f Hz, requested %.1f Hz\n",
+				w->offsets[i], w->sched[i].reads / elapsed,
+				1e9 / w->sched[i].base);
+	} else {
+		fprintf(stderr, "%llu samples in %.3f s: %.1f Hz, "
+			"requested %.1f Hz\n", w->samples, elapsed, w->rate,
+			1e9 / w->period);
+	}
+	fprintf(stderr, "jitter: mean %.1f us, stddev %.1f us, max %.1f us\n",
+		mean / 1000, sqrt(var) / 1000,
+		w->jitter_max / 1000.0);
+	fprintf(stderr, "%llu missed deadlines, %lu dropped samples, "
+		"%llu read errors\n", w->missed, r->dropped, w->errors);
+	if (w->cap && w->cap->samples)
+		fprintf(stderr, "capture: %llu bytes, %.2f bytes/sample\n",
+			w->cap->bytes, (double)w->cap->bytes / w->cap->samples);
+	for (i = 0; i < w->ntriggers; i++)
+		fprintf(stderr, "trigger %s: fired %llu times\n",
+			w->triggers[i].expr, w->triggers[i].fired);
+	if (w->ntriggers)
+		fprintf(stderr, "%llu triggers, %llu of %llu samples "
+			"written\n", w->fired, w->emitted, w->samples);
+	if (w->output_errors)
+		fprintf(stderr, "%lu output errors\n", w->output_errors);
+
+	error = w->errors || w->output_errors ? -EIO : 0;
+
+free:
+	free(r->samples);
+	free(w->out_buf);
+	free(w->history);
+
+	return error;
+}
+
+struct cpcap_watch_args {
+	const char *regs;
+	unsigned long long period_us;
+	unsigned long long count;
+	const char *capture;		/* Binary capture file */
+	int compress;
+	int changes_only;
+	int adaptive;
+	const char *triggers[CPCAP_WATCH_MAX_TRIGGERS];
+	unsigned int ntriggers;
+	unsigned int pre, post;		/* Samples around a trigger */
+	unsigned long long holdoff_ms;
+};
+
+static int cpcap_watch_run(struct cpcap_dev *dev,
+			   const struct cpcap_watch_args *args)
+{
+	unsigned long long period;
+	struct cpcap_watch *w;
+	int i, error;
+
+	if (!args->period_us) {
+		fprintf(stderr, "invalid period\n");
+		return -EINVAL;
+	}
+
+	w = calloc(1, sizeof(*w));
+	if (!w)
+		return -ENOMEM;
+
+	w->dev = dev;
+	w->period = args->period_us * 1000;
+	w->count = args->count;
+	w->changes_only = args->changes_only;
+	w->adaptive = args->adaptive;
+	w->out_fd = STDOUT_FILENO;
+
+	error = cpcap_watch_parse_regs(w, args->regs);
+	if (error)
+		goto free;
+
+	for (i = 0; i < args->ntriggers; i++) {
+		error = cpcap_trigger_parse(w, args->triggers[i]);
+		if (error) {
+			fprintf(stderr, "invalid trigger: %s\n",
+				args->triggers[i]);
+			goto free;
+		}
+	}
+	w->pre = args->pre;
+	w->post = args->post;
+	w->holdoff = args->holdoff_ms * 1000000;
+
+	/* The capture period is the fastest rate */
+	period = w->period;
+	for (i = 0; i < w->nregs; i++) {
+		if (cpcap_sched_period(w, i) < period)
+			period = cpcap_sched_period(w, i);
+	}
+
+	if (args->capture) {
+		w->cap = malloc(sizeof(*w->cap));
+		if (!w->cap) {
+			error = -ENOMEM;
+			goto free;
+		}
+
+		w->out_fd = open(args->capture, O_WRONLY | O_CREAT | O_TRUNC,
+				 0644);
+		if (w->out_fd < 0) {
+			error = -errno;
+			fprintf(stderr, "Could not open %s: %i\n",
+				args->capture, error);
+			goto free;
+		}
+
+		error = cpcap_capture_start(w->cap, w->out_fd, w->offsets,
+					    w->nregs, period, args->compress);
+		if (error)
+			goto close;
+	}
+
+	error = cpcap_watch(w);
+
+close:
+	if (w->cap)
+		close(w->out_fd);
+free:
+	free(w->cap);
+	free(w);
+
+	return error;
+}
+
+static int cpcap_decode_run(const char *name, const char *format)
+{
+	unsigned long long samples;
+	int fmt;
+
+	if (!format || !strcmp(format, "csv")) {
+		fmt = CPCAP_DECODE_CSV;
+	} else if (!strcmp(format, "debugfs")) {
+		fmt = CPCAP_DECODE_DEBUGFS;
+	} else if (!strcmp(format, "text")) {
+		fmt = CPCAP_DECODE_TEXT;
+	} else {
+		fprintf(stderr, "unknown format: %s\n", format);
+		return -EINVAL;
+	}
+
+	return cpcap_decode(name, STDOUT_FILENO, fmt, &samples);
+}
+
+/*
+ * Offline queries over capture files for --query. The file is mapped
+ * and the block headers are read first into an index of the position,
+ * time range and changed bitmap of each block. Blocks outside the time
+ * range are skipped, and the records of blocks where the register does
+ * not change are not read at all: every sample has the value from the
+ * block header, so the first and last sample times are enough. The
+ * other blocks are decoded for the one register, skipping the deltas
+ * of the others without decoding them.
+ *
+ * The remaining blocks are split into chunks of CPCAP_QUERY_CHUNK
+ * blocks that the threads take in turn. The sample count and time of
+ * each value go into a table per thread, and the first and last samples
+ * and transitions of each chunk are kept to join the chunks in file
+ * order at the end.
+ */
+#define CPCAP_QUERY_CHUNK	16
+#define CPCAP_QUERY_MAX_THREADS	64
+
+struct cpcap_query_args {
+	const char *where;		/* offset[&mask][=value] */
+	double from;			/* s, as printed by --decode */
+	double to;			/* s, 0 for the end */
+	int threads;			/* 0 for one per cpu */
+};
+
+struct cpcap_query_block {
+	size_t pos;			/* Of the block header */
+	unsigned long long t_first;	/* ns */
+	unsigned long long t_last;
+	unsigned int changed;
+};
+
+struct cpcap_query_trans {
+	unsigned long long t;		/* ns */
+	unsigned short from;
+	unsigned short to;
+};
+
+/* The samples of a chunk, or of the whole file after joining */
+struct cpcap_query_sum {
+	unsigned long long samples;
+	unsigned long long matches;
+	unsigned long long transitions;
+	unsigned long long first_t;
+	unsigned long long last_t;
+	unsigned short first_v;
+	unsigned short last_v;
+	struct cpcap_query_trans first;
+	struct cpcap_query_trans last;
+};
+
+struct cpcap_query_table {
+	unsigned long long samples[0x10000];
+	unsigned long long time[0x10000];	/* ns until the next sample */
+};
+
+struct cpcap_query {
+	const struct cpcap_cap_info *info;
+	const unsigned char *map;
+	size_t size;
+	struct cpcap_query_block *blocks;
+	size_t nblocks;
+	size_t size_blocks;
+	int reg;			/* Index in the capture */
+	unsigned short mask;
+	unsigned short value;
+	int match;			/* Only count value */
+	unsigned long long t0;		/* ns */
+	unsigned long long t1;
+	struct cpcap_query_sum *sums;	/* Per chunk */
+	size_t nchunks;
+	atomic_size_t next;		/* Chunk */
+};
+
+struct cpcap_query_stats {
+	unsigned long long samples;
+	unsigned long long size;	/* Of the file */
+	unsigned long long blocks;
+	unsigned long long skipped;
+	unsigned long long constant;
+	unsigned long long decoded;
+	unsigned long long bytes;	/* Decoded */
+	unsigned long long elapsed;	/* ns */
+	int threads;
+};
+
+struct cpcap_query_thread {
+	pthread_t thread;
+	struct cpcap_query *q;
+	struct cpcap_query_table *table;
+	unsigned char *raw;
+	unsigned long long constant;
+	unsigned long long decoded;
+	unsigned long long bytes;	/* Decoded */
+	int error;
+};
+
+static void cpcap_query_trans(const struct cpcap_query *q,
+			      struct cpcap_query_sum *s, unsigned long long t,
+			      unsigned short from, unsigned short to)
+{
+	if (q->match && to != q->value)
+		return;
+
+	if (!s->transitions)
+		s->first = (struct cpcap_query_trans){ t, from, to };
+	s->last = (struct cpcap_query_trans){ t, from, to };
+	s->transitions++;
+}
+
+static void cpcap_query_add(const struct cpcap_query *q,
+			    struct cpcap_query_sum *s,
+			    struct cpcap_query_table *table,
+			    unsigned long long t, unsigned short v)
+{
+	if (s->samples) {
+		table->time[s->last_v] += t - s->last_t;
+		if (v != s->last_v)
+			cpcap_query_trans(q, s, t, s->last_v, v);
+	} else {
+		s->first_t = t;
+		s->first_v = v;
+	}
+
+	table->samples[v]++;
+	s->samples++;
+	if (!q->match || v == q->value)
+		s->matches++;
+	s->last_t = t;
+	s->last_v = v;
+}
+
+/* Adds n samples from t_first to t_last that all have value v */
+static void cpcap_query_span(const struct cpcap_query *q,
+			     struct cpcap_query_sum *s,
+			     struct cpcap_query_table *table,
+			     unsigned long long t_first,
+			     unsigned long long t_last, unsigned long long n,
+			     unsigned short v)
+{
+	cpcap_query_add(q, s, table, t_first, v);
+	if (n < 2)
+		return;
+
+	table->time[v] += t_last - t_first;
+	table->samples[v] += n - 1;
+	s->samples += n - 1;
+	if (!q->match || v == q->value)
+		s->matches += n - 1;
+	s->last_t = t_last;
+}
+
+/* Appends the chunk summary s to sum */
+static void cpcap_query_join(const struct cpcap_query *q,
+			     struct cpcap_query_sum *sum,
+			     struct cpcap_query_table *table,
+			     const struct cpcap_query_sum *s)
+{
+	if (!s->samples)
+		return;
+	if (!sum->samples) {
+		*sum = *s;
+		return;
+	}
+
+	table->time[sum->last_v] += s->first_t - sum->last_t;
+	if (s->first_v != sum->last_v)
+		cpcap_query_trans(q, sum, s->first_t, sum->last_v, s->first_v);
+	if (s->transitions) {
+		if (!sum->transitions)
+			sum->first = s->first;
+		sum->last = s->last;
+		sum->transitions += s->transitions;
+	}
+
+	sum->samples += s->samples;
+	sum->matches += s->matches;
+	sum->last_t = s->last_t;
+	sum->last_v = s->last_v;
+}
+
+static const unsigned char *cpcap_skip_varints(const unsigned char *p,
+					       const unsigned char *end, int n)
+{
+	while (n && p < end) {
+		if (!(*p++ & 0x80))
+			n--;
+	}
+
+	return n ? NULL : p;
+}
+
+static int cpcap_query_scan(struct cpcap_query_thread *th,
+			    const struct cpcap_query_block *qb,
+			    struct cpcap_query_sum *s)
+{
+	const struct cpcap_query *q = th->q;
+	const struct cpcap_cap_info *info = q->info;
+	int i, n, bitmap_len = (info->nregs + 7) / 8;
+	unsigned int bits, bit = 1U << q->reg, below = bit - 1;
+	const unsigned char *p, *end;
+	unsigned long long t, val;
+	struct cpcap_block_info b;
+	unsigned short v;
+
+	n = cpcap_block_parse(info, &b, q->map + qb->pos, q->size - qb->pos);
+	p = q->map + qb->pos + n;
+	v = b.vals[q->reg];
+
+	if (!(b.changed & bit) && qb->t_first >= q->t0 && qb->t_last <= q->t1) {
+		cpcap_query_span(q, s, th->table, qb->t_first, qb->t_last,
+				 b.samples, v & q->mask);
+		th->constant++;
+		return 0;
+	}
+
+	th->decoded++;
+	th->bytes += b.len;
+	end = p + b.len;
+	if (b.flags & CPCAP_BLOCK_COMPRESSED) {
+		if (cpcap_lz_decompress(p, b.len, th->raw,
+					CPCAP_BLOCK_LEN) != b.raw_len)
+			return -EIO;
+		p = th->raw;
+		end = p + b.raw_len;
+	}
+
+	t = b.t_first - info->period;
+	while (p < end) {
+		p = cpcap_get_varint(p, end, &val);
+		if (!p || end - p < bitmap_len)
+			return -EIO;
+		t += info->period + cpcap_unzigzag(val);
+
+		for (bits = 0, i = 0; i < bitmap_len; i++)
+			bits |= (unsigned int)p[i] << (i * 8);
+		p += bitmap_len;
+
+		/* The deltas are in register order, one per bit set */
+		if (bits & bit) {
+			p = cpcap_skip_varints(p, end,
+					       __builtin_popcount(bits & below));
+			if (p)
+				p = cpcap_get_varint(p, end, &val);
+			if (!p)
+				return -EIO;
+			v += cpcap_unzigzag(val);
+			bits &= ~(below | bit);
+		}
+		p = cpcap_skip_varints(p, end, __builtin_popcount(bits));
+		if (!p)
+			return -EIO;
+
+		if (t * info->tick_ns < q->t0)
+			continue;
+		if (t * info->tick_ns > q->t1)
+			break;
+		cpcap_query_add(q, s, th->table, t * info->tick_ns,
+				v & q->mask);
+	}
+
+	return 0;
+}
+
+static void *cpcap_query_thread(void *data)
+{
+	struct cpcap_query_thread *th = data;
+	struct cpcap_query *q = th->q;
+	size_t chunk, i, end;
+	int error;
+
+	while ((chunk = atomic_fetch_add(&q->next, 1)) < q->nchunks) {
+		end = (chunk + 1) * CPCAP_QUERY_CHUNK;
+		if (end > q->nblocks)
+			end = q->nblocks;
+		for (i = chunk * CPCAP_QUERY_CHUNK; i < end; i++) {
+			error = cpcap_query_scan(th, &q->blocks[i],
+						 &q->sums[chunk]);
+			if (error) {
+				th->error = error;
+				return NULL;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Walks the block headers from pos and indexes the blocks that overlap
+ * the time range. Returns the number of blocks in the file or negative
+ * error.
+ */
+static long cpcap_query_index(struct cpcap_query *q, size_t pos)
+{
+	const struct cpcap_cap_info *info = q->info;
+	struct cpcap_query_block *qb;
+	struct cpcap_block_info b;
+	long total = 0;
+	int n;
+
+	while (pos < q->size) {
+		n = cpcap_block_parse(info, &b, q->map + pos, q->size - pos);
+		if (n < 0 || b.len > q->size - pos - n) {
+			fprintf(stderr, "truncated or corrupt block\n");
+			return -EIO;
+		}
+		total++;
+
+		if (b.t_last * info->tick_ns >= q->t0 &&
+		    b.t_first * info->tick_ns <= q->t1) {
+			if (q->nblocks == q->size_blocks) {
+				q->size_blocks = q->size_blocks ?
+					q->size_blocks * 2 : 1024;
+				qb = realloc(q->blocks, q->size_blocks *
+					     sizeof(*qb));
+				if (!qb)
+					return -ENOMEM;
+				q->blocks = qb;
+			}
+			qb = &q->blocks[q->nblocks++];
+			qb->pos = pos;
+			qb->t_first = b.t_first * info->tick_ns;
+			qb->t_last = b.t_last * info->tick_ns;
+			qb->changed = b.changed;
+		}
+		pos += n + b.len;
+	}
+
+	return total;
+}
+
+static void cpcap_query_report(FILE *out, const char *name,
+			       const struct cpcap_query *q,
+			       const struct cpcap_query_sum *sum,
+			       const struct cpcap_query_table *table)
+{
+	const struct cpcap_query_trans *tr[2] = { &sum->first, &sum->last };
+	unsigned long long span = sum->last_t - sum->first_t;
+	int i;
+
+	fprintf(out, "%s: %llu samples", name, sum->samples);
+	if (sum->samples)
+		fprintf(out, " from %.6f to %.6f", sum->first_t / 1e9,
+			sum->last_t / 1e9);
+	fprintf(out, ", %llu matching, %llu transitions\n", sum->matches,
+		sum->transitions);
+
+	for (i = 0; i < 2 && sum->transitions; i++)
+		fprintf(out, "%s transition %.6f %04x -> %04x\n",
+			i ? "last" : "first", tr[i]->t / 1e9, tr[i]->from,
+			tr[i]->to);
+
+	for (i = 0; i < 0x10000; i++) {
+		if (!table->samples[i] || (q->match && i != q->value))
+			continue;
+		fprintf(out, "%04x %12llu samples %14.6f s %6.2f%%\n", i,
+			table->samples[i], table->time[i] / 1e9,
+			span ? 100.0 * table->time[i] / span : 0.0);
+	}
+}
+
+/*
+ * Runs a query on one capture file and prints the result to out if not
+ * NULL.
+ */
+static int cpcap_query_file(FILE *out, const char *name,
+			    const struct cpcap_query_args *args,
+			    int offset, unsigned short mask, int value,
+			    struct cpcap_query_stats *stats)
+{
+	struct cpcap_query_thread th[CPCAP_QUERY_MAX_THREADS];
+	struct cpcap_query_sum sum = { 0 };
+	struct cpcap_query q = { 0 };
+	struct cpcap_cap_info info;
+	unsigned long long start;
+	int fd, i, j, n, nthreads;
+	struct stat st;
+	long total;
+	int error;
+
+	memset(stats, 0, sizeof(*stats));
+	start = cpcap_nsecs();
+	fd = cpcap_cap_open(name, &info);
+	if (fd < 0)
+		return fd;
+	if (fstat(fd, &st) < 0) {
+		error = -errno;
+		close(fd);
+		return error;
+	}
+
+	q.info = &info;
+	q.size = st.st_size;
+	q.mask = mask;
+	q.value = value;
+	q.match = value >= 0;
+	q.t0 = args->from * 1e9;
+	q.t1 = args->to > 0 ? args->to * 1e9 : ~0ULL;
+	for (q.reg = 0; q.reg < info.nregs; q.reg++) {
+		if (info.offsets[q.reg] == offset)
+			break;
+	}
+	if (q.reg == info.nregs) {
+		fprintf(stderr, "%s does not have register %04x\n", name,
+			offset);
+		close(fd);
+		return -EINVAL;
+	}
+
+	q.map = mmap(NULL, q.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (q.map == MAP_FAILED) {
+		error = -errno;
+		fprintf(stderr, "Could not map %s: %i\n", name, error);
+		return error;
+	}
+
+	total = cpcap_query_index(&q, CPCAP_CAP_HDR_LEN + info.nregs * 2);
+	if (total < 0) {
+		error = total;
+		goto out;
+	}
+
+	q.nchunks = (q.nblocks + CPCAP_QUERY_CHUNK - 1) / CPCAP_QUERY_CHUNK;
+	q.sums = calloc(q.nchunks + 1, sizeof(*q.sums));
+	if (!q.sums) {
+		error = -ENOMEM;
+		goto out;
+	}
+
+	nthreads = args->threads ? args->threads :
+		sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > (int)q.nchunks)
+		nthreads = q.nchunks;
+	if (nthreads > CPCAP_QUERY_MAX_THREADS)
+		nthreads = CPCAP_QUERY_MAX_THREADS;
+	if (nthreads < 1)
+		nthreads = 1;
+
+	memset(th, 0, sizeof(th));
+	error = 0;
+	for (n = 0; n < nthreads; n++) {
+		th[n].q = &q;
+		th[n].table = calloc(1, sizeof(*th[n].table));
+		th[n].raw = malloc(CPCAP_BLOCK_LEN);
+		if (!th[n].table || !th[n].raw) {
+			free(th[n].table);
+			free(th[n].raw);
+			error = -ENOMEM;
+			break;
+		}
+		if (pthread_create(&th[n].thread, NULL, cpcap_query_thread,
+				   &th[n])) {
+			free(th[n].table);
+			free(th[n].raw);
+			error = -EAGAIN;
+			break;
+		}
+	}
+
+	/* Stop the threads that did start if one could not */
+	if (error)
+		atomic_store(&q.next, q.nchunks);
+	for (i = 0; i < n; i++) {
+		pthread_join(th[i].thread, NULL);
+		if (th[i].error && !error) {
+			fprintf(stderr, "corrupt block in %s\n", name);
+			error = th[i].error;
+		}
+		stats->constant += th[i].constant;
+		stats->decoded += th[i].decoded;
+		stats->bytes += th[i].bytes;
+		if (i) {
+			for (j = 0; j < 0x10000; j++) {
+				th[0].table->samples[j] += th[i].table->samples[j];
+				th[0].table->time[j] += th[i].table->time[j];
+			}
+		}
+	}
+
+	if (!error) {
+		for (i = 0; i < (int)q.nchunks; i++)
+			cpcap_query_join(&q, &sum, th[0].table, &q.sums[i]);
+		stats->elapsed = cpcap_nsecs() - start;
+		stats->samples = sum.samples;
+		stats->size = q.size;
+		stats->blocks = total;
+		stats->skipped = total - q.nblocks;
+		stats->threads = nthreads;
+		if (out)
+			cpcap_query_report(out, name, &q, &sum, th[0].table);
+	}
+
+	for (i = 0; i < n; i++) {
+		free(th[i].table);
+		free(th[i].raw);
+	}
+
+out:
+	free(q.sums);
+	free(q.blocks);
+	munmap((void *)q.map, q.size);
+
+	return error;
+}
+
+/*
+ * Parses offset[&mask][=value], returns the offset or negative error,
+ * with value -1 if not given.
+ */
+static int cpcap_query_parse(const char *where, unsigned short *mask,
+			     int *value)
+{
+	char buf[32], *p, *end;
+	unsigned long arg;
+
+	if (strlen(where) >= sizeof(buf))
+		return -EINVAL;
+	strcpy(buf, where);
+
+	*mask = 0xffff;
+	*value = -1;
+	p = strchr(buf, '=');
+	if (p) {
+		*p++ = '\0';
+		arg = strtoul(p, &end, 16);
+		if (end == p || *end || arg > 0xffff)
+			return -EINVAL;
+		*value = arg;
+	}
+	p = strchr(buf, '&');
+	if (p) {
+		*p++ = '\0';
+		arg = strtoul(p, &end, 16);
+		if (end == p || *end || !arg || arg > 0xffff)
+			return -EINVAL;
+		*mask = arg;
+	}
+	if (*value >= 0 && (*value & ~*mask))
+		return -EINVAL;
+
+	return cpcap_parse_offset(buf);
+}
+
+/*
+ * Runs the query on each of a comma separated list of capture files.
+ */
+static int cpcap_query_run(const char *files,
+			   const struct cpcap_query_args *args)
+{
+	struct cpcap_query_stats st;
+	char *list, *name, *save;
+	unsigned short mask;
+	int offset, value, error = 0;
+
+	if (!args->where) {
+		fprintf(stderr, "--query needs --where\n");
+		return -EINVAL;
+	}
+	offset = cpcap_query_parse(args->where, &mask, &value);
+	if (offset < 0) {
+		fprintf(stderr, "invalid --where: %s\n", args->where);
+		return -EINVAL;
+	}
+
+	list = strdup(files);
+	if (!list)
+		return -ENOMEM;
+
+	for (name = strtok_r(list, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		error = cpcap_query_file(stdout, name, args, offset, mask,
+					 value, &st);
+		if (error)
+			break;
+
+		fflush(stdout);
+		fprintf(stderr, "%.3f GB in %.3f s: %.2f GB/s, %llu blocks, "
+			"%llu skipped, %llu constant, %llu decoded (%.3f GB), "
+			"%i threads\n", st.size / 1e9, st.elapsed / 1e9,
+			st.size / (double)st.elapsed, st.blocks, st.skipped,
+			st.constant, st.decoded, st.bytes / 1e9, st.threads);
+	}
+
+	free(list);
+
+	return error;
+}
+
+/*
+ * Coulomb counter power accounting for --power, the same way as
+ * drivers/power/supply/cpcap-battery.c does it. Every
+ * CPCAP_CC_PERIOD_MS the counter adds the battery current to the
+ * accumulator in CCA1/CCA2 and counts the sample in CCS1/CCS2. The
+ * charge between two readings is
+ *
+ *	-(accumulator delta - sample delta * offset) * lsb uAms
+ *
+ * with the offset from CCM, and the mean current is the charge divided
+ * by sample delta * CPCAP_CC_PERIOD_MS ms. Positive is discharging as
+ * in the driver. Only the deltas are used so both counters may wrap,
+ * and a sample count that goes backwards is a counter reset. Reading
+ * faster than the counter only gives stale readings, and reading
+ * slower loses nothing but the resolution of min and max.
+ *
+ * The currents of a summary interval go into two log bucketed
+ * histograms, one for discharging and one for charging, so the memory
+ * use does not depend on the interval and the percentiles are within
+ * 25%.
+ */
+#define CPCAP_CC_LSB		95374	/* uAms per LSB, cc_lsb in the driver */
+#define CPCAP_CC_PERIOD_MS	250
+#define CPCAP_CC_SAMPLE_MASK	0xffffff	/* CCS1 and CCS2 bits 7..0 */
+
+enum {
+	CPCAP_CC_CCS1,
+	CPCAP_CC_CCS2,
+	CPCAP_CC_CCA1,
+	CPCAP_CC_CCA2,
+	CPCAP_CC_CCM,
+	CPCAP_CC_NREGS,
+};
+
+static const unsigned short cpcap_cc_offsets[CPCAP_CC_NREGS] = {
+	0x0a0c, 0x0a10, 0x0a14, 0x0a18, 0x0a1c,
+};
+
+struct cpcap_power_win {
+	unsigned long long start;	/* ns */
+	unsigned long long samples;	/* Counter samples */
+	long long charge;		/* uAms */
+	long long min, max;		/* uA */
+	struct cpcap_hist hist[2];	/* Discharging and charging uA */
+};
+
+struct cpcap_power {
+	FILE *out;
+	long long lsb;			/* uAms per LSB */
+	int offset;			/* Used instead of CCM if set */
+	int have_offset;
+	unsigned long long interval;	/* Summary interval in ns */
+	unsigned long long t_first, t;	/* ns */
+	unsigned int sample;		/* Previous reading */
+	int acc;
+	int have_prev;
+	unsigned long long readings;
+	unsigned long long stale;
+	unsigned long long resets;
+	unsigned long long errors;
+	unsigned long long retries;	/* Extra reads of torn counters */
+	unsigned long long summaries;
+	unsigned long long samples;	/* Counter samples since start */
+	long long charge;		/* uAms since start */
+	struct cpcap_power_win win;
+};
+
+struct cpcap_power_args {
+	unsigned long long period_us;	/* 0 for CPCAP_CC_PERIOD_MS */
+	unsigned long long interval_s;
+	unsigned long long count;	/* Summaries, 0 for no limit */
+	long long lsb;
+	int offset;
+	int have_offset;
+	const char *replay;		/* Capture file */
+};
+
+/* Returns the p percentile of the currents of the window in uA */
+static long long cpcap_power_percentile(const struct cpcap_power_win *w,
+					double p)
+{
+	const struct cpcap_hist *dis = &w->hist[0], *chg = &w->hist[1];
+	double rank = (dis->count + chg->count) * p / 100;
+
+	/* The charging currents are the lowest, largest first */
+	if (rank < chg->count || !dis->count)
+		return -(long long)cpcap_hist_percentile(chg,
+						100 - 100 * rank / chg->count);
+
+	return cpcap_hist_percentile(dis, 100 * (rank - chg->count) /
+				     dis->count);
+}
+
+static double cpcap_uams_to_mah(long long uams)
+{
+	return uams / 3600000000.0;
+}
+
+static void cpcap_power_summary(struct cpcap_power *pw,
+				unsigned long long t)
+{
+	struct cpcap_power_win *w = &pw->win;
+	unsigned long long n = w->hist[0].count + w->hist[1].count;
+
+	if (!pw->summaries)
+		fprintf(pw->out, "%-14s %6s %9s %9s %9s %9s %9s %9s %9s %10s\n",
+			"time", "n", "mean mA", "min mA", "max mA", "p50 mA",
+			"p90 mA", "p99 mA", "mAh", "total mAh");
+
+	fprintf(pw->out, "%14.6f %6llu %9.2f %9.2f %9.2f %9.2f %9.2f "
+		"%9.2f %9.4f %10.4f\n", t / 1e9, n,
+		n ? (double)w->charge / (w->samples * CPCAP_CC_PERIOD_MS) /
+		1000 : 0, n ? w->min / 1000.0 : 0, n ? w->max / 1000.0 : 0,
+		n ? cpcap_power_percentile(w, 50) / 1000.0 : 0,
+		n ? cpcap_power_percentile(w, 90) / 1000.0 : 0,
+		n ? cpcap_power_percentile(w, 99) / 1000.0 : 0,
+		cpcap_uams_to_mah(w->charge), cpcap_uams_to_mah(pw->charge));
+	fflush(pw->out);
+	pw->summaries++;
+
+	memset(w, 0, sizeof(*w));
+	w->start = t;
+}
+
+/*
+ * Feeds a reading of the cpcap_cc_offsets registers at t ns into the
+ * accounting, and writes a summary when the interval is over.
+ */
+static void cpcap_power_update(struct cpcap_power *pw, unsigned long long t,
+			       const unsigned short *vals)
+{
+	struct cpcap_power_win *w = &pw->win;
+	unsigned int sample, delta;
+	long long charge, ua;
+	int acc, offset;
+
+	sample = (vals[CPCAP_CC_CCS2] & 0xff) << 16 | vals[CPCAP_CC_CCS1];
+	acc = (unsigned int)vals[CPCAP_CC_CCA2] << 16 | vals[CPCAP_CC_CCA1];
+	offset = (int)((unsigned int)vals[CPCAP_CC_CCM] << 22) >> 22;
+	if (pw->have_offset)
+		offset = pw->offset;
+	pw->readings++;
+	pw->t = t;
+
+	if (!pw->have_prev) {
+		pw->sample = sample;
+		pw->acc = acc;
+		pw->have_prev = 1;
+		pw->t_first = t;
+		w->start = t;
+		return;
+	}
+
+	delta = (sample - pw->sample) & CPCAP_CC_SAMPLE_MASK;
+	if (!delta) {
+		pw->stale++;
+	} else if (delta > CPCAP_CC_SAMPLE_MASK / 2) {
+		pw->resets++;
+	} else {
+		charge = -((int)((unsigned int)acc - pw->acc) -
+			   (long long)delta * offset) * pw->lsb;
+		ua = charge / ((long long)delta * CPCAP_CC_PERIOD_MS);
+
+		if (!w->hist[0].count && !w->hist[1].count)
+			w->min = w->max = ua;
+		if (ua < w->min)
+			w->min = ua;
+		if (ua > w->max)
+			w->max = ua;
+		if (ua < 0)
+			cpcap_hist_add(&w->hist[1], -ua);
+		else
+			cpcap_hist_add(&w->hist[0], ua);
+		w->samples += delta;
+		w->charge += charge;
+		pw->samples += delta;
+		pw->charge += charge;
+	}
+	if (delta) {
+		pw->sample = sample;
+		pw->acc = acc;
+	}
+
+	if (t - w->start >= pw->interval)
+		cpcap_power_summary(pw, t);
+}
+
+static void cpcap_power_done(struct cpcap_power *pw)
+{
+	if (pw->win.hist[0].count || pw->win.hist[1].count)
+		cpcap_power_summary(pw, pw->t);
+
+	fprintf(stderr, "%llu readings in %.3f h, %llu stale, "
+		"%llu counter resets, %llu read errors, %llu re-reads\n",
+		pw->readings, (pw->t - pw->t_first) / 3.6e12, pw->stale,
+		pw->resets, pw->errors, pw->retries);
+	fprintf(stderr, "%.4f mAh in %.3f h of counter samples, "
+		"mean %.2f mA\n", cpcap_uams_to_mah(pw->charge),
+		pw->samples * CPCAP_CC_PERIOD_MS / 3.6e6, pw->samples ?
+		(double)pw->charge / (pw->samples * CPCAP_CC_PERIOD_MS) /
+		1000 : 0);
+}
+
+struct cpcap_power_replay {
+	struct cpcap_power *pw;
+	int index[CPCAP_CC_NREGS];	/* In the capture, -1 if none */
+};
+
+static int cpcap_power_sample(void *data, unsigned long long t,
+			      const unsigned short *vals)
+{
+	struct cpcap_power_replay *r = data;
+	unsigned short cc[CPCAP_CC_NREGS] = { 0 };
+	int i;
+
+	for (i = 0; i < CPCAP_CC_NREGS; i++) {
+		if (r->index[i] >= 0)
+			cc[i] = vals[r->index[i]];
+	}
+	cpcap_power_update(r->pw, t, cc);
+
+	return 0;
+}
+
+/*
+ * Replays a binary capture through the accounting. The capture needs
+ * CCS1, CCS2, CCA1 and CCA2, and CCM unless the offset is given.
+ */
+static int cpcap_power_replay_cap(struct cpcap_power *pw, const char *name,
+				  unsigned long long *samples)
+{
+	struct cpcap_power_replay r = { .pw = pw };
+	struct cpcap_cap_info info;
+	int fd, i, j, error;
+
+	fd = cpcap_cap_open(name, &info);
+	if (fd < 0)
+		return fd;
+
+	for (i = 0; i < CPCAP_CC_NREGS; i++) {
+		r.index[i] = -1;
+		for (j = 0; j < info.nregs; j++) {
+			if (info.offsets[j] == cpcap_cc_offsets[i])
+				r.index[i] = j;
+		}
+		if (r.index[i] < 0 &&
+		    (i != CPCAP_CC_CCM || !pw->have_offset)) {
+			fprintf(stderr, "%s has no 0x%04x\n", name,
+				cpcap_cc_offsets[i]);
+			close(fd);
+			return -EINVAL;
+		}
+	}
+
+	error = cpcap_cap_replay(fd, &info, cpcap_power_sample, &r, samples);
+	close(fd);
+
+	return error;
+}
+
+/*
+ * Parses a line of the --watch text layout, "seconds.microseconds
+ * offset=value...", into t and the values of the coulomb counter
+ * registers. The registers not on the line keep their values. Returns
+ * a bitmap of the coulomb counter registers on the line or -EINVAL.
+ */
+static int cpcap_power_parse_line(const char *p, unsigned long long *t,
+				  unsigned short *vals)
+{
+	unsigned long long sec = 0, usec = 0;
+	unsigned int field[2];
+	int i, j, d, n = 0;
+
+	if (*p < '0' || *p > '9')
+		return -EINVAL;
+	while (*p >= '0' && *p <= '9')
+		sec = sec * 10 + *p++ - '0';
+	if (*p++ != '.')
+		return -EINVAL;
+	for (i = 0; i < 6; i++) {
+		if (*p < '0' || *p > '9')
+			return -EINVAL;
+		usec = usec * 10 + *p++ - '0';
+	}
+	*t = sec * 1000000000ULL + usec * 1000;
+
+	while (*p == ' ') {
+		p++;
+		for (i = 0; i < 2; i++) {
+			field[i] = 0;
+			for (j = 0; j < 4; j++) {
+				d = cpcap_hex_digit(*p++);
+				if (d < 0)
+					return -EINVAL;
+				field[i] = field[i] << 4 | d;
+			}
+			if (!i && *p++ != '=')
+				return -EINVAL;
+		}
+		for (i = 0; i < CPCAP_CC_NREGS; i++) {
+			if (field[0] == cpcap_cc_offsets[i]) {
+				vals[i] = field[1];
+				n |= 1 << i;
+			}
+		}
+	}
+
+	return *p == '\n' || !*p ? n : -EINVAL;
+}
+
+/*
+ * Replays a --watch text capture through the accounting, starting at
+ * the first line that has all the registers.
+ */
+static int cpcap_power_replay_text(struct cpcap_power *pw, FILE *fp,
+				   unsigned long long *samples)
+{
+	unsigned short vals[CPCAP_CC_NREGS] = { 0 };
+	unsigned long long t, lineno = 0;
+	int n, seen = 0, need;
+	size_t size = 0;
+	char *line = NULL;
+
+	need = (1 << CPCAP_CC_NREGS) - 1;
+	if (pw->have_offset)
+		need &= ~(1 << CPCAP_CC_CCM);
+	*samples = 0;
+	while (getline(&line, &size, fp) > 0) {
+		lineno++;
+		n = cpcap_power_parse_line(line, &t, vals);
+		if (n < 0) {
+			fprintf(stderr, "invalid sample on line %llu\n",
+				lineno);
+			free(line);
+			return -EINVAL;
+		}
+		seen |= n;
+		if (!n || (seen & need) != need)
+			continue;
+		cpcap_power_update(pw, t, vals);
+		(*samples)++;
+	}
+	free(line);
+
+	return ferror(fp) ? -EIO : 0;
+}
+
+static int cpcap_power_replay(struct cpcap_power *pw, const char *name)
+{
+	unsigned long long samples, start, elapsed;
+	char magic[4];
+	FILE *fp;
+	int error;
+
+	fp = fopen(name, "r");
+	if (!fp) {
+		error = -errno;
+		fprintf(stderr, "Could not open %s: %i\n", name, error);
+		return error;
+	}
+
+	start = cpcap_nsecs();
+	if (fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+	    !memcmp(magic, CPCAP_CAP_MAGIC, sizeof(magic))) {
+		fclose(fp);
+		error = cpcap_power_replay_cap(pw, name, &samples);
+	} else {
+		rewind(fp);
+		error = cpcap_power_replay_text(pw, fp, &samples);
+		fclose(fp);
+	}
+	elapsed = cpcap_nsecs() - start;
+	if (error)
+		return error;
+
+	cpcap_power_done(pw);
+	fprintf(stderr, "replayed %llu samples in %.3f s, %.1f Msamples/s\n",
+		samples, elapsed / 1e9, samples * 1e3 / (elapsed + 1));
+
+	return 0;
+}
+
+/*
+ * Reads the coulomb counter registers with one cpcap_readv(), and
+ * CCS and CCA again if they may be torn by a carry between their
+ * registers.
+ */
+static int cpcap_power_read(struct cpcap_dev *dev, struct cpcap_power *pw,
+			    unsigned short *vals)
+{
+	int error;
+
+	error = cpcap_readv(dev, cpcap_cc_offsets, vals, CPCAP_CC_NREGS);
+	if (error < 0)
+		return error;
+
+	error = cpcap_read_group(dev, CPCAP_GROUP_CCS, &vals[CPCAP_CC_CCS1],
+				 1);
+	if (error < 0)
+		return error;
+	pw->retries += error;
+
+	error = cpcap_read_group(dev, CPCAP_GROUP_CCA, &vals[CPCAP_CC_CCA1],
+				 1);
+	if (error < 0)
+		return error;
+	pw->retries += error;
+
+	return 0;
+}
+
+static int cpcap_power_run(struct cpcap_dev *dev,
+			   const struct cpcap_power_args *args)
+{
+	unsigned short vals[CPCAP_CC_NREGS];
+	unsigned long long period;
+	struct timespec deadline, now;
+	struct cpcap_power *pw;
+	int error = 0;
+
+	if (!args->interval_s || args->lsb <= 0) {
+		fprintf(stderr, "invalid interval or lsb\n");
+		return -EINVAL;
+	}
+
+	pw = calloc(1, sizeof(*pw));
+	if (!pw)
+		return -ENOMEM;
+
+	pw->out = stdout;
+	pw->lsb = args->lsb;
+	pw->offset = args->offset;
+	pw->have_offset = args->have_offset;
+	pw->interval = args->interval_s * 1000000000ULL;
+
+	if (args->replay) {
+		error = cpcap_power_replay(pw, args->replay);
+		goto free;
+	}
+
+	period = args->period_us ? args->period_us * 1000 :
+		CPCAP_CC_PERIOD_MS * 1000000ULL;
+
+	signal(SIGINT, cpcap_stop_handler);
+	signal(SIGTERM, cpcap_stop_handler);
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	while (!cpcap_stop) {
+		if (cpcap_power_read(dev, pw, vals) < 0)
+			pw->errors++;
+		else
+			cpcap_power_update(pw, cpcap_nsecs(), vals);
+		if (args->count && pw->summaries >= args->count)
+			break;
+
+		/* After a suspend, continue from now instead of catching up */
+		cpcap_ts_add(&deadline, period);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (cpcap_ts_ns(&deadline) < cpcap_ts_ns(&now))
+			deadline = now;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+				NULL);
+	}
+
+	cpcap_power_done(pw);
+	if (pw->errors)
+		error = -EIO;
+
+free:
+	free(pw);
+
+	return error;
+}
+
+/*
+ * Burst ADC conversions for --adc, done like the immediate conversions
+ * of drivers/iio/adc/cpcap-adc.c. A conversion does all eight channels
+ * of the bank selected with AD_SEL1 in ADCC1 into ADCD0-7. Setting ASC
+ * in ADCC2 starts it, and ASC clears when it is done. ADTRIG_DIS is
+ * kept set so the kernel driver does not get the done interrupt.
+ *
+ * The results are read with one cpcap_readv(), and the next conversion
+ * is started before they are scaled and written out, so the formatting
+ * overlaps the conversion. With channels in both banks, the banks
+ * alternate.
+ *
+ * CHG_ISENSE and BATTI are calibrated at start from ADCAL1 and ADCAL2
+ * like the driver does, unless CAL_FACTOR_ENABLE is set and the ADC
+ * applies it. The scaling is the driver's bank_conversion table
+ * without the phasing, and the die temperature AD3 is left raw.
+ */
+#define CPCAP_ADC_CHANNELS	16
+#define CPCAP_ADC_CHG_ISENSE	5
+#define CPCAP_ADC_BATTI		6
+#define CPCAP_ADC_TIMEOUT_NS	50000000
+#define CPCAP_ADC_CAL_RETRIES	5
+#define CPCAP_ADC_CAL_LOW	494
+#define CPCAP_ADC_CAL_HIGH	530
+#define CPCAP_ADC_CAL_DIFF	3
+#define CPCAP_ADC_OUT_LEN	65536
+#define CPCAP_ADC_LINE_MAX	(24 + 8 * 24)
+
+#define CPCAP_ADCC1_DEFAULTS	(CPCAP_BIT_ADEN_AUTO_CLR | \
+				 CPCAP_BIT_ADC_CLK_SEL0 | CPCAP_BIT_RAND1)
+
+struct cpcap_adc_chan {
+	const char *name;
+	const char *unit;
+	int align_offset;
+	int conv_offset;
+	int multiplier;
+	int divider;
+};
+
+static const struct cpcap_adc_chan cpcap_adc_chans[CPCAP_ADC_CHANNELS] = {
+	{ "battdetb",	"",	0,	0,	1,	1 },
+	{ "battp",	"mV",	0,	2400,	2300,	1023 },
+	{ "vbus",	"mV",	0,	0,	10000,	1023 },
+	{ "ad3",	"",	0,	0,	1,	1 },
+	{ "bplus",	"mV",	0,	2400,	2300,	1023 },
+	{ "chg_isense",	"mA",	-512,	2,	5000,	1023 },
+	{ "batti",	"mA",	-512,	2,	5000,	1023 },
+	{ "usb_id",	"",	0,	0,	1,	1 },
+	{ "ad8",	"",	0,	0,	1,	1 },
+	{ "ad9",	"",	0,	0,	1,	1 },
+	{ "licell",	"mV",	0,	0,	3400,	1023 },
+	{ "hv_battp",	"",	0,	0,	1,	1 },
+	{ "tsx1",	"",	0,	0,	1,	1 },
+	{ "tsx2",	"",	0,	0,	1,	1 },
+	{ "tsy1",	"",	0,	0,	1,	1 },
+	{ "tsy2",	"",	0,	0,	1,	1 },
+};
+
+static const unsigned short cpcap_adcd_offsets[8] = {
+	0x0c08, 0x0c0c, 0x0c10, 0x0c14, 0x0c18, 0x0c1c, 0x0c20, 0x0c24,
+};
+
+struct cpcap_adc_stat {
+	unsigned long long count;
+	long long min, max;
+	double sum;
+};
+
+struct cpcap_adc {
+	struct cpcap_dev *dev;
+	unsigned int chans;		/* Bitmap of channels */
+	int cal_offset[CPCAP_ADC_CHANNELS];
+	unsigned long long count;
+	unsigned long long conversions;
+	unsigned long long polls;	/* ADCC2 reads waiting for ASC */
+	struct cpcap_adc_stat stats[CPCAP_ADC_CHANNELS];
+	char *out;
+	size_t out_len;
+};
+
+static int cpcap_adc_parse(struct cpcap_adc *a, const char *list)
+{
+	char buf[256], *token, *save, *end;
+	int i, n;
+
+	snprintf(buf, sizeof(buf), "%s", list);
+	for (token = strtok_r(buf, ",", &save); token;
+	     token = strtok_r(NULL, ",", &save)) {
+		if (!strcmp(token, "all")) {
+			a->chans |= 0xffff;
+			continue;
+		}
+		if (!strcmp(token, "bank0") || !strcmp(token, "bank1")) {
+			a->chans |= 0xff << (token[4] - '0') * 8;
+			continue;
+		}
+
+		n = strtol(token, &end, 0);
+		if (end == token || *end) {
+			for (n = 0; n < CPCAP_ADC_CHANNELS; n++) {
+				if (!strcmp(token, cpcap_adc_chans[n].name))
+					break;
+			}
+		}
+		if (n < 0 || n >= CPCAP_ADC_CHANNELS) {
+			fprintf(stderr, "invalid ADC channel: %s, one of",
+				token);
+			for (i = 0; i < CPCAP_ADC_CHANNELS; i++)
+				fprintf(stderr, " %s", cpcap_adc_chans[i].name);
+			fprintf(stderr, "\n");
+			return -EINVAL;
+		}
+		a->chans |= 1 << n;
+	}
+
+	return a->chans ? 0 : -EINVAL;
+}
+
+/*
+ * Starts a conversion of bank, or a calibration conversion of channel
+ * cal if it is not negative.
+ */
+static int cpcap_adc_start(struct cpcap_adc *a, int bank, int cal)
+{
+	unsigned short adcc1 = CPCAP_ADCC1_DEFAULTS;
+	int error;
+
+	if (cal >= 0)
+		adcc1 |= CPCAP_BIT_CAL_MODE | CPCAP_BIT_RAND0 |
+			((cal << 4) & CPCAP_BIT_ADA_MASK);
+	else if (bank)
+		adcc1 |= CPCAP_BIT_AD_SEL1;
+
+	error = cpcap_write_index(a->dev, CPCAP_REG_ADCC1, adcc1, 0xffff);
+	if (error)
+		return error;
+
+	return cpcap_write_index(a->dev, CPCAP_REG_ADCC2,
+				 CPCAP_BIT_ASC | CPCAP_BIT_ADTRIG_DIS,
+				 CPCAP_BIT_ADTRIG_ONESHOT | CPCAP_BIT_ASC |
+				 CPCAP_BIT_ADTRIG_DIS |
+				 CPCAP_BIT_ATOX_PS_FACTOR |
+				 CPCAP_BIT_ADC_PS_FACTOR1 |
+				 CPCAP_BIT_ADC_PS_FACTOR0);
+}
+
+/* Starts another conversion of the same bank */
+static int cpcap_adc_trigger(struct cpcap_adc *a)
+{
+	return cpcap_write_index(a->dev, CPCAP_REG_ADCC2, CPCAP_BIT_ASC,
+				 CPCAP_BIT_ASC);
+}
+
+/* Waits for ASC to clear */
+static int cpcap_adc_wait(struct cpcap_adc *a)
+{
+	unsigned long long start = cpcap_nsecs();
+	unsigned short adcc2;
+	int error;
+
+	for (;;) {
+		error = cpcap_read_index(a->dev, CPCAP_REG_ADCC2, &adcc2);
+		if (error)
+			return error;
+		a->polls++;
+		if (!(adcc2 & CPCAP_BIT_ASC))
+			return 0;
+		if (cpcap_nsecs() - start > CPCAP_ADC_TIMEOUT_NS)
+			return -ETIMEDOUT;
+	}
+}
+
+static int cpcap_adc_calibrate_one(struct cpcap_adc *a, int chan, int index)
+{
+	struct timespec ts = { 0, 5000000 };
+	unsigned short cal[2];
+	int i, retry, error;
+
+	for (retry = 0; retry < CPCAP_ADC_CAL_RETRIES; retry++) {
+		for (i = 0; i < 2; i++) {
+			error = cpcap_adc_start(a, 0, chan);
+			if (!error)
+				error = cpcap_adc_wait(a);
+			if (error)
+				return error;
+			cpcap_cache_invalidate(a->dev, index);
+			error = cpcap_read_index(a->dev, index, &cal[i]);
+			if (error)
+				return error;
+		}
+
+		if (cal[1] >= CPCAP_ADC_CAL_LOW && cal[1] <= CPCAP_ADC_CAL_HIGH &&
+		    abs(cal[0] - cal[1]) <= CPCAP_ADC_CAL_DIFF) {
+			a->cal_offset[chan] = 512 - cal[1];
+			return 0;
+		}
+		nanosleep(&ts, NULL);
+	}
+
+	fprintf(stderr, "%s not calibrated, ADCAL %u and %u\n",
+		cpcap_adc_chans[chan].name, cal[0], cal[1]);
+
+	return 0;
+}
+
+static int cpcap_adc_calibrate(struct cpcap_adc *a)
+{
+	unsigned short adcc2;
+	int error;
+
+	if (!(a->chans & (1 << CPCAP_ADC_CHG_ISENSE | 1 << CPCAP_ADC_BATTI)))
+		return 0;
+
+	error = cpcap_read_index(a->dev, CPCAP_REG_ADCC2, &adcc2);
+	if (error || (adcc2 & CPCAP_BIT_CAL_FACTOR_ENABLE))
+		return error;
+
+	error = cpcap_adc_calibrate_one(a, CPCAP_ADC_CHG_ISENSE,
+					CPCAP_REG_ADCAL1);
+	if (error)
+		return error;
+
+	return cpcap_adc_calibrate_one(a, CPCAP_ADC_BATTI, CPCAP_REG_ADCAL2);
+}
+
+static long long cpcap_adc_scale(const struct cpcap_adc *a, int chan,
+				 unsigned short raw)
+{
+	const struct cpcap_adc_chan *c = &cpcap_adc_chans[chan];
+	long long val = raw & 0x3ff;
+
+	val += a->cal_offset[chan] + c->align_offset;
+
+	return val * c->multiplier / c->divider + c->conv_offset;
+}
+
+/* Scales, counts and formats the results of a conversion of bank */
+static void cpcap_adc_emit(struct cpcap_adc *a, unsigned long long t,
+			   int bank, const unsigned short *vals)
+{
+	struct cpcap_adc_stat *st;
+	int i, chan, len;
+	long long val;
+	char *p;
+
+	if (a->out_len + CPCAP_ADC_LINE_MAX > CPCAP_ADC_OUT_LEN) {
+		if (cpcap_write_buf(STDOUT_FILENO, a->out, a->out_len) < 0)
+			fprintf(stderr, "could not write samples\n");
+		a->out_len = 0;
+	}
+
+	p = a->out + a->out_len;
+	p = cpcap_fmt_time(p, t);
+	for (i = 0; i < 8; i++) {
+		chan = bank * 8 + i;
+		if (!(a->chans & (1 << chan)))
+			continue;
+
+		val = cpcap_adc_scale(a, chan, vals[i]);
+		st = &a->stats[chan];
+		if (!st->count || val < st->min)
+			st->min = val;
+		if (!st->count || val > st->max)
+			st->max = val;
+		st->sum += val;
+		st->count++;
+
+		*p++ = ' ';
+		len = strlen(cpcap_adc_chans[chan].name);
+		memcpy(p, cpcap_adc_chans[chan].name, len);
+		p += len;
+		*p++ = '=';
+		if (val < 0) {
+			*p++ = '-';
+			val = -val;
+		}
+		p = cpcap_fmt_dec(p, val, 1);
+	}
+	*p++ = '\n';
+	a->out_len = p - a->out;
+}
+
+static int cpcap_adc_run(struct cpcap_dev *dev, const char *list,
+			 unsigned long long count)
+{
+	unsigned short vals[8];
+	unsigned long long start, t, n;
+	double elapsed;
+	struct cpcap_adc *a;
+	int i, bank, next, banks, error;
+
+	a = calloc(1, sizeof(*a));
+	if (!a)
+		return -ENOMEM;
+	a->dev = dev;
+
+	error = cpcap_adc_parse(a, list);
+	if (error)
+		goto free;
+
+	a->out = malloc(CPCAP_ADC_OUT_LEN);
+	if (!a->out) {
+		error = -ENOMEM;
+		goto free;
+	}
+
+	error = cpcap_adc_calibrate(a);
+	if (error) {
+		fprintf(stderr, "ADC calibration failed: %i\n", error);
+		goto free;
+	}
+	a->polls = 0;
+
+	banks = (a->chans & 0xff ? 1 : 0) | (a->chans & 0xff00 ? 2 : 0);
+	bank = banks & 1 ? 0 : 1;
+
+	signal(SIGINT, cpcap_stop_handler);
+	signal(SIGTERM, cpcap_stop_handler);
+
+	start = cpcap_nsecs();
+	error = cpcap_adc_start(a, bank, -1);
+	for (n = 0; !error; n++) {
+		error = cpcap_adc_wait(a);
+		if (!error)
+			error = cpcap_readv(dev, cpcap_adcd_offsets, vals, 8);
+		if (error)
+			break;
+		t = cpcap_nsecs();
+		a->conversions++;
+
+		/* Start the next conversion before formatting this one */
+		next = banks == 3 ? !bank : bank;
+		if (!cpcap_stop && (!count || n + 1 < count)) {
+			if (next != bank)
+				error = cpcap_adc_start(a, next, -1);
+			else
+				error = cpcap_adc_trigger(a);
+		} else {
+			cpcap_stop = 1;
+		}
+
+		cpcap_adc_emit(a, t, bank, vals);
+		bank = next;
+		if (cpcap_stop)
+			break;
+	}
+	elapsed = (cpcap_nsecs() - start) / 1e9;
+
+	if (cpcap_write_buf(STDOUT_FILENO, a->out, a->out_len) < 0)
+		fprintf(stderr, "could not write samples\n");
+	if (error == -ETIMEDOUT)
+		fprintf(stderr, "ADC conversion timed out\n");
+	else if (error)
+		fprintf(stderr, "ADC access failed: %i\n", error);
+
+	fprintf(stderr, "%llu conversions in %.3f s: %.1f conversions/s, "
+		"%.1f ADCC2 polls each\n", a->conversions, elapsed,
+		a->conversions / elapsed,
+		a->conversions ? (double)a->polls / a->conversions : 0);
+	for (i = 0; i < CPCAP_ADC_CHANNELS; i++) {
+		if (!a->stats[i].count)
+			continue;
+		fprintf(stderr, "%-10s min %lli mean %.1f max %lli%s%s",
+			cpcap_adc_chans[i].name, a->stats[i].min,
+			a->stats[i].sum / a->stats[i].count, a->stats[i].max,
+			*cpcap_adc_chans[i].unit ? " " : "",
+			cpcap_adc_chans[i].unit);
+		if (a->cal_offset[i])
+			fprintf(stderr, " (calibration %+i)",
+				a->cal_offset[i]);
+		fprintf(stderr, "\n");
+	}
+
+free:
+	free(a->out);
+	free(a);
+
+	return error;
+}
+
+/*
+ * Sequence files for --play, for bring-up that needs writes with
+ * precise delays in between. One step per line, everything after # is
+ * ignored:
+ *
+ *	offset=value		write, and the other cpcap_parse_write()
+ *	offset&=mask		forms, an update that changes no bits is
+ *				a no-op
+ *	wait time		wait, time is us, or with a us, ms or s suffix
+ *	poll offset mask [value] [time]
+ *				read until (register & mask) == value,
+ *				value defaults to mask, the timeout needs a
+ *				suffix and defaults to 100ms
+ *	assert offset mask value
+ *				fail unless (register & mask) == value
+ *
+ * The steps are parsed before playing, and each step runs at its
+ * deadline from the start of the sequence, the sum of the waits
+ * before it, with clock_nanosleep(TIMER_ABSTIME). So a slow poll or
+ * a late wakeup does not shift the steps after it. Playing stops at the
+ * first step that fails.
+ */
+#define CPCAP_SEQ_POLL_TIMEOUT_NS	100000000
+#define CPCAP_SEQ_POLL_NS		20000
+#define CPCAP_SEQ_TEXT_LEN		48
+
+enum {
+	CPCAP_SEQ_WRITE,
+	CPCAP_SEQ_WAIT,
+	CPCAP_SEQ_POLL,
+	CPCAP_SEQ_ASSERT,
+	CPCAP_SEQ_NOP,
+};
+
+struct cpcap_seq_step {
+	int type;
+	int line;
+	int index;
+	unsigned short val;
+	unsigned short mask;
+	unsigned short read;		/* Last value read by poll or assert */
+	unsigned long long at;		/* Deadline from start in ns */
+	unsigned long long timeout;	/* ns */
+	unsigned long long start;	/* Actual times from start in ns */
+	unsigned long long end;
+	unsigned int polls;
+	int error;
+	char text[CPCAP_SEQ_TEXT_LEN];
+};
+
+struct cpcap_seq {
+	struct cpcap_seq_step *steps;
+	int nsteps;
+	int done;			/* Steps played */
+};
+
+/*
+ * Parses a time in us, or with a us, ms or s suffix, to ns. Returns 1
+ * if there was a suffix, 0 if not, or negative error.
+ */
+static int cpcap_seq_parse_time(const char *str, unsigned long long *ns)
+{
+	unsigned long long scale = 1000;
+	double val;
+	char *end;
+
+	val = strtod(str, &end);
+	if (end == str || val < 0)
+		return -EINVAL;
+	if (!strcmp(end, "ms"))
+		scale = 1000000;
+	else if (!strcmp(end, "s"))
+		scale = 1000000000;
+	else if (*end && strcmp(end, "us"))
+		return -EINVAL;
+	*ns = val * scale;
+
+	return *end != '\0';
+}
+
+static int cpcap_seq_parse_hex(const char *str, int max)
+{
+	char *end;
+	long val;
+
+	if (!str)
+		return -EINVAL;
+	val = strtol(str, &end, 16);
+	if (end == str || *end || val < 0 || val > max)
+		return -EINVAL;
+
+	return val;
+}
+
+static int cpcap_seq_parse_step(struct cpcap_seq_step *s, char **argv,
+				int argc, unsigned long long *at)
+{
+	int i, len = 0, offset, val, update;
+	unsigned long long timeout;
+	char buf[64], *value;
+
+	for (i = 0; i < argc && len < sizeof(s->text); i++)
+		len += snprintf(s->text + len, sizeof(s->text) - len, "%s%s",
+				i ? " " : "", argv[i]);
+
+	if (!strcmp(argv[0], "wait")) {
+		if (argc != 2 || cpcap_seq_parse_time(argv[1], &s->timeout) < 0)
+			return -EINVAL;
+		s->type = CPCAP_SEQ_WAIT;
+		*at += s->timeout;
+		s->at = *at;
+		return 0;
+	}
+
+	s->at = *at;
+
+	if (!strcmp(argv[0], "poll") || !strcmp(argv[0], "assert")) {
+		s->type = argv[0][0] == 'p' ? CPCAP_SEQ_POLL : CPCAP_SEQ_ASSERT;
+		s->timeout = CPCAP_SEQ_POLL_TIMEOUT_NS;
+		if (s->type == CPCAP_SEQ_POLL && argc > 3 &&
+		    cpcap_seq_parse_time(argv[argc - 1], &timeout) > 0) {
+			s->timeout = timeout;
+			argc--;
+		}
+		if (argc < 3 || argc > 4 ||
+		    (s->type == CPCAP_SEQ_ASSERT && argc != 4))
+			return -EINVAL;
+
+		offset = cpcap_parse_offset(argv[1]);
+		val = cpcap_seq_parse_hex(argv[2], 0xffff);
+		if (offset < 0 || val < 0)
+			return -EINVAL;
+		s->mask = val;
+		s->val = val;
+		if (argc == 4) {
+			val = cpcap_seq_parse_hex(argv[3], 0xffff);
+			if (val < 0 || (val & ~s->mask))
+				return -EINVAL;
+			s->val = val;
+		}
+		s->index = cpcap_offset_to_index(offset);
+
+		return s->index < 0 ? -EINVAL : 0;
+	}
+
+	if (argc != 1 || strlen(argv[0]) >= sizeof(buf))
+		return -EINVAL;
+	strcpy(buf, argv[0]);
+	value = strchr(buf, '=');
+	if (!value)
+		return -EINVAL;
+
+	offset = cpcap_parse_write(buf, value + 1, &val, &s->mask, &update);
+	if (offset < 0)
+		return offset;
+	s->index = cpcap_offset_to_index(offset);
+	if (s->index < 0)
+		return -EINVAL;
+
+	/* A plain write uses rbw_mask as cpcap_write_reg() does */
+	s->type = update && !s->mask ? CPCAP_SEQ_NOP : CPCAP_SEQ_WRITE;
+	if (!s->mask)
+		s->mask = cpcap_register_info_tbl[s->index].rbw_mask;
+	s->val = val;
+
+	return 0;
+}
+
+static int cpcap_seq_load(struct cpcap_seq *q, const char *name)
+{
+	char *line = NULL, *p, *token, *argv[6];
+	unsigned long long at = 0;
+	struct cpcap_seq_step *steps;
+	int argc, lineno = 0, size = 0, error = 0;
+	size_t len = 0;
+	FILE *f;
+
+	f = fopen(name, "r");
+	if (!f) {
+		error = -errno;
+		fprintf(stderr, "Could not open %s: %i\n", name, error);
+		return error;
+	}
+
+	while (getline(&line, &len, f) > 0) {
+		lineno++;
+		p = strchr(line, '#');
+		if (p)
+			*p = '\0';
+
+		argc = 0;
+		p = line;
+		while ((token = strsep(&p, " \t\r\n"))) {
+			if (!*token)
+				continue;
+			if (argc == 6)
+				break;
+			argv[argc++] = token;
+		}
+		if (!argc)
+			continue;
+
+		if (q->nsteps == size) {
+			size = size ? size * 2 : 64;
+			steps = realloc(q->steps, size * sizeof(*steps));
+			if (!steps) {
+				error = -ENOMEM;
+				break;
+			}
+			q->steps = steps;
+		}
+
+		memset(&q->steps[q->nsteps], 0, sizeof(*steps));
+		q->steps[q->nsteps].line = lineno;
+		if (argc == 6 || cpcap_seq_parse_step(&q->steps[q->nsteps],
+						      argv, argc, &at)) {
+			fprintf(stderr, "%s:%i: invalid step\n", name, lineno);
+			error = -EINVAL;
+			break;
+		}
+		q->nsteps++;
+	}
+	free(line);
+	fclose(f);
+
+	if (error)
+		return error;
+
+	return q->nsteps ? 0 : -EINVAL;
+}
+
+static int cpcap_seq_read(struct cpcap_dev *dev, struct cpcap_seq_step *s)
+{
+	cpcap_cache_invalidate(dev, s->index);
+
+	return cpcap_read_index(dev, s->index, &s->read);
+}
+
+static int cpcap_seq_step(struct cpcap_dev *dev, struct cpcap_seq_step *s,
+			  unsigned long long t0)
+{
+	struct timespec ts = { 0, CPCAP_SEQ_POLL_NS };
+	int error;
+
+	switch (s->type) {
+	case CPCAP_SEQ_WRITE:
+		return cpcap_write_index(dev, s->index, s->val, s->mask);
+	case CPCAP_SEQ_POLL:
+		for (;;) {
+			error = cpcap_seq_read(dev, s);
+			s->polls++;
+			if (error || (s->read & s->mask) == s->val)
+				return error;
+			if (cpcap_nsecs() - t0 - s->start > s->timeout)
+				return -ETIMEDOUT;
+			nanosleep(&ts, NULL);
+		}
+	case CPCAP_SEQ_ASSERT:
+		error = cpcap_seq_read(dev, s);
+		if (error)
+			return error;
+		return (s->read & s->mask) == s->val ? 0 : -EIO;
+	default:
+		return 0;
+	}
+}
+
+static void cpcap_seq_play(struct cpcap_dev *dev, struct cpcap_seq *q)
+{
+	struct cpcap_seq_step *s;
+	struct timespec deadline;
+	unsigned long long t0;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	t0 = cpcap_ts_ns(&deadline);
+
+	for (q->done = 0; q->done < q->nsteps && !cpcap_stop; q->done++) {
+		s = &q->steps[q->done];
+		deadline.tv_sec = (t0 + s->at) / 1000000000ULL;
+		deadline.tv_nsec = (t0 + s->at) % 1000000000ULL;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				       &deadline, NULL) == EINTR && !cpcap_stop)
+			;
+		if (cpcap_stop)
+			break;
+
+		s->start = cpcap_nsecs() - t0;
+		s->error = cpcap_seq_step(dev, s, t0);
+		s->end = cpcap_nsecs() - t0;
+		if (s->error) {
+			q->done++;
+			break;
+		}
+	}
+}
+
+static void cpcap_seq_report(const struct cpcap_seq *q, int dry_run)
+{
+	const struct cpcap_seq_step *s;
+	unsigned long long late, max_late = 0;
+	double sum_late = 0;
+	int i;
+
+	if (dry_run) {
+		printf("%5s %12s  %s\n", "line", "sched ms", "step");
+		for (i = 0; i < q->nsteps; i++)
+			printf("%5i %12.3f  %s\n", q->steps[i].line,
+			       q->steps[i].at / 1e6, q->steps[i].text);
+		return;
+	}
+
+	printf("%5s %12s %12s %9s %9s  %-8s %s\n", "line", "sched ms",
+	       "actual ms", "late us", "took us", "status", "step");
+	for (i = 0; i < q->done; i++) {
+		s = &q->steps[i];
+		late = s->start > s->at ? s->start - s->at : 0;
+		if (late > max_late)
+			max_late = late;
+		sum_late += late;
+
+		printf("%5i %12.3f %12.3f %9.1f %9.1f  ", s->line, s->at / 1e6,
+		       s->start / 1e6, late / 1e3, (s->end - s->start) / 1e3);
+		if (s->error == -ETIMEDOUT)
+			printf("%-8s", "timeout");
+		else if (s->error)
+			printf("%-8i", s->error);
+		else
+			printf("%-8s", "ok");
+		printf(" %s", s->text);
+		if (s->type == CPCAP_SEQ_POLL)
+			printf(" (read %04x, %u polls)", s->read, s->polls);
+		else if (s->type == CPCAP_SEQ_ASSERT)
+			printf(" (read %04x)", s->read);
+		printf("\n");
+	}
+
+	fflush(stdout);
+	fprintf(stderr, "%i of %i steps played, late mean %.1f us, "
+		"max %.1f us\n", q->done, q->nsteps,
+		q->done ? sum_late / q->done / 1e3 : 0, max_late / 1e3);
+	if (q->done && q->steps[q->done - 1].error)
+		fprintf(stderr, "line %i failed: %i\n",
+			q->steps[q->done - 1].line,
+			q->steps[q->done - 1].error);
+}
+
+/*
+ * Plays a sequence file with SCHED_FIFO at priority and the memory
+ * locked, and reports the scheduled and actual time of each step after.
+ * Runs on without either if not permitted.
+ */
+static int cpcap_seq_run(struct cpcap_dev *dev, const char *name,
+			 int priority, int dry_run)
+{
+	struct sched_param sp = { .sched_priority = priority };
+	struct cpcap_seq q = { 0 };
+	int error, rt = 0;
+
+	error = cpcap_seq_load(&q, name);
+	if (error)
+		goto free;
+
+	if (dry_run) {
+		cpcap_seq_report(&q, 1);
+		goto free;
+	}
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+		fprintf(stderr, "mlockall failed: %i\n", -errno);
+	if (sched_setscheduler(0, SCHED_FIFO, &sp))
+		fprintf(stderr, "SCHED_FIFO failed: %i\n", -errno);
+	else
+		rt = 1;
+	prctl(PR_SET_TIMERSLACK, 1);
+
+	signal(SIGINT, cpcap_stop_handler);
+	signal(SIGTERM, cpcap_stop_handler);
+
+	cpcap_seq_play(dev, &q);
+
+	if (rt) {
+		sp.sched_priority = 0;
+		sched_setscheduler(0, SCHED_OTHER, &sp);
+	}
+	munlockall();
+
+	cpcap_seq_report(&q, 0);
+	if (q.done < q.nsteps || (q.done && q.steps[q.done - 1].error))
+		error = q.done && q.steps[q.done - 1].error ?
+			q.steps[q.done - 1].error : -EINTR;
+
+free:
+	free(q.steps);
+
+	return error;
+}
+
+/*
+ * Host side collector for many --serve instances at once, for example
+ * adb forwarded ports of a rack of devices. All endpoints are driven
+ * from one epoll loop with non-blocking sockets. Every period a round
+ * of requests goes to all connected endpoints: a dump, or with --watch
+ * a read of each register. A round is written out when every endpoint
+ * replied or at the next round, one line per endpoint with the round
+ * time, so the stream is time-aligned and keyed by endpoint.
+ *
+ * An endpoint gets a new request only when it answered the last one,
+ * so a slow one misses rounds instead of queueing them. Its late
+ * replies are written when they come, with the time of their round.
+ * Endpoints that are down or drop the
+ * connection are retried every CPCAP_COLLECT_RETRY_NS.
+ */
+#define CPCAP_COLLECT_IN_LEN		8192
+#define CPCAP_COLLECT_RETRY_NS		1000000000ULL
+#define CPCAP_COLLECT_EVENTS		64
+#define CPCAP_COLLECT_LINE_MAX		(96 + CPCAP_NUM_REG_CPCAP * 10)
+
+enum {
+	CPCAP_EP_DOWN,
+	CPCAP_EP_CONNECTING,
+	CPCAP_EP_UP,
+};
+
+struct cpcap_endpoint {
+	char name[64];
+	struct sockaddr_storage ss;
+	socklen_t len;
+	int family;
+	int fd;
+	int state;
+	unsigned long long retry_at;
+	unsigned int round;		/* Of the outstanding request */
+	int pending;			/* Replies still to come */
+	int have;			/* Has the values for round */
+	unsigned long long sent;
+	unsigned short nvals;
+	unsigned short offsets[CPCAP_NUM_REG_CPCAP];
+	unsigned short vals[CPCAP_NUM_REG_CPCAP];
+	size_t in_len;
+	unsigned char in[CPCAP_COLLECT_IN_LEN];
+	/* Statistics */
+	unsigned long long rounds;
+	unsigned long long missed;
+	unsigned long long late;
+	unsigned long long errors;
+	unsigned long long connects;
+	unsigned long long bytes;
+	unsigned long long lat_sum;
+	unsigned long long lat_max;
+};
+
+struct cpcap_collector {
+	struct cpcap_endpoint *eps;
+	int neps;
+	int size;
+	int epfd;
+	int tfd;
+	struct cpcap_watch *w;		/* Registers with --watch, or NULL */
+	unsigned long long period;
+	unsigned long long count;
+	unsigned int round;		/* Next round to send */
+	unsigned int emitted;		/* Rounds written out */
+	unsigned long long t0;
+	int outstanding;		/* Endpoints the round waits for */
+	char *line;
+};
+
+static int cpcap_collect_add(struct cpcap_collector *col, const char *addr)
+{
+	struct cpcap_endpoint *ep;
+
+	if (col->neps == col->size) {
+		ep = realloc(col->eps, (col->size ? col->size * 2 : 16) *
+			     sizeof(*ep));
+		if (!ep)
+			return -ENOMEM;
+		col->eps = ep;
+		col->size = col->size ? col->size * 2 : 16;
+	}
+
+	ep = &col->eps[col->neps];
+	memset(ep, 0, sizeof(*ep));
+	snprintf(ep->name, sizeof(ep->name), "%s", addr);
+	ep->fd = -1;
+	ep->family = cpcap_sockaddr(addr, &ep->ss, &ep->len);
+	if (ep->family < 0) {
+		fprintf(stderr, "invalid address: %s\n", addr);
+		return -EINVAL;
+	}
+	col->neps++;
+
+	return 0;
+}
+
+/* Endpoints are a comma separated list, or @file with one per line */
+static int cpcap_collect_parse(struct cpcap_collector *col, const char *list)
+{
+	char *buf = NULL, *token, *save, *p;
+	size_t len = 0;
+	FILE *f;
+	int error = 0;
+
+	if (list[0] != '@') {
+		p = strdup(list);
+		if (!p)
+			return -ENOMEM;
+		for (token = strtok_r(p, ",", &save); token && !error;
+		     token = strtok_r(NULL, ",", &save))
+			error = cpcap_collect_add(col, token);
+		free(p);
+
+		return error ? error : col->neps ? 0 : -EINVAL;
+	}
+
+	f = fopen(list + 1, "r");
+	if (!f) {
+		error = -errno;
+		fprintf(stderr, "Could not open %s: %i\n", list + 1, error);
+		return error;
+	}
+	while (!error && getline(&buf, &len, f) > 0) {
+		p = strchr(buf, '#');
+		if (p)
+			*p = '\0';
+		token = strtok_r(buf, " \t\r\n", &save);
+		if (token)
+			error = cpcap_collect_add(col, token);
+	}
+	free(buf);
+	fclose(f);
+
+	return error ? error : col->neps ? 0 : -EINVAL;
+}
+
+static void cpcap_collect_down(struct cpcap_collector *col,
+			       struct cpcap_endpoint *ep)
+{
+	if (ep->fd >= 0) {
+		epoll_ctl(col->epfd, EPOLL_CTL_DEL, ep->fd, NULL);
+		close(ep->fd);
+	}
+	if (ep->pending && ep->round >= col->emitted)
+		col->outstanding--;
+	ep->fd = -1;
+	ep->state = CPCAP_EP_DOWN;
+	ep->pending = 0;
+	ep->in_len = 0;
+	ep->retry_at = cpcap_nsecs() + CPCAP_COLLECT_RETRY_NS;
+}
+
+static void cpcap_collect_connect(struct cpcap_collector *col,
+				  struct cpcap_endpoint *ep)
+{
+	struct epoll_event ev = { .data.ptr = ep };
+	int one = 1;
+
+	ep->fd = socket(ep->family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (ep->fd < 0) {
+		cpcap_collect_down(col, ep);
+		return;
+	}
+	if (ep->family == AF_INET)
+		setsockopt(ep->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	ep->connects++;
+	if (connect(ep->fd, (struct sockaddr *)&ep->ss, ep->len) < 0) {
+		if (errno != EINPROGRESS) {
+			cpcap_collect_down(col, ep);
+			return;
+		}
+		ep->state = CPCAP_EP_CONNECTING;
+		ev.events = EPOLLOUT;
+	} else {
+		ep->state = CPCAP_EP_UP;
+		ev.events = EPOLLIN;
+	}
+
+	if (epoll_ctl(col->epfd, EPOLL_CTL_ADD, ep->fd, &ev) < 0)
+		cpcap_collect_down(col, ep);
+}
+
+static void cpcap_collect_request(struct cpcap_collector *col,
+				  struct cpcap_endpoint *ep)
+{
+	unsigned char out[CPCAP_MSG_LEN * CPCAP_WATCH_MAX_REGS];
+	struct cpcap_msg m = { .tag = col->round };
+	int i, n = 1;
+
+	if (col->w) {
+		m.op = CPCAP_OP_READ;
+		n = col->w->nregs;
+		for (i = 0; i < n; i++) {
+			m.offset = col->w->offsets[i];
+			cpcap_msg_pack(out + i * CPCAP_MSG_LEN, &m);
+		}
+	} else {
+		m.op = CPCAP_OP_DUMP;
+		cpcap_msg_pack(out, &m);
+	}
+
+	if (write(ep->fd, out, n * CPCAP_MSG_LEN) != n * CPCAP_MSG_LEN) {
+		ep->errors++;
+		cpcap_collect_down(col, ep);
+		return;
+	}
+
+	ep->round = col->round;
+	ep->pending = n;
+	ep->have = 0;
+	ep->nvals = 0;
+	ep->sent = cpcap_nsecs();
+	col->outstanding++;
+}
+
+static void cpcap_collect_line(struct cpcap_collector *col,
+			       const struct cpcap_endpoint *ep)
+{
+	char *p;
+	int i, len;
+
+	p = cpcap_fmt_time(col->line, col->t0 + ep->round * col->period);
+	*p++ = ' ';
+	len = strlen(ep->name);
+	memcpy(p, ep->name, len);
+	p += len;
+	for (i = 0; i < ep->nvals; i++) {
+		*p++ = ' ';
+		p = cpcap_fmt_hex16(p, ep->offsets[i]);
+		*p++ = '=';
+		p = cpcap_fmt_hex16(p, ep->vals[i]);
+	}
+	*p++ = '\n';
+	fwrite(col->line, 1, p - col->line, stdout);
+}
+
+/* Writes out a round, one line for each endpoint that has the values */
+static void cpcap_collect_emit(struct cpcap_collector *col,
+			       unsigned int round)
+{
+	struct cpcap_endpoint *ep;
+	int i;
+
+	for (i = 0; i < col->neps; i++) {
+		ep = &col->eps[i];
+		if (!ep->have || ep->round != round) {
+			ep->missed++;
+			continue;
+		}
+		ep->have = 0;
+		ep->rounds++;
+		cpcap_collect_line(col, ep);
+	}
+	col->emitted = round + 1;
+	col->outstanding = 0;
+}
+
+/* Handles the complete replies in the input buffer */
+static void cpcap_collect_replies(struct cpcap_collector *col,
+				  struct cpcap_endpoint *ep)
+{
+	unsigned long long lat;
+	struct cpcap_msg m;
+	size_t pos = 0, need;
+	int i;
+
+	while (ep->in_len - pos >= CPCAP_MSG_LEN) {
+		cpcap_msg_unpack(&m, ep->in + pos);
+		need = CPCAP_MSG_LEN;
+		if (m.op == CPCAP_OP_DUMP)
+			need += m.count * 4;
+		if (ep->in_len - pos < need)
+			break;
+
+		if (!ep->pending || m.tag != (unsigned short)ep->round) {
+			pos += need;
+			continue;
+		}
+
+		if (m.status) {
+			ep->errors++;
+		} else if (m.op == CPCAP_OP_DUMP) {
+			for (i = 0; i < m.count && i < CPCAP_NUM_REG_CPCAP; i++) {
+				ep->offsets[i] = cpcap_get16(ep->in + pos +
+					CPCAP_MSG_LEN + i * 4);
+				ep->vals[i] = cpcap_get16(ep->in + pos +
+					CPCAP_MSG_LEN + i * 4 + 2);
+			}
+			ep->nvals = i;
+		} else if (ep->nvals < CPCAP_WATCH_MAX_REGS) {
+			ep->offsets[ep->nvals] = m.offset;
+			ep->vals[ep->nvals++] = m.value;
+		}
+		pos += need;
+
+		if (--ep->pending)
+			continue;
+
+		lat = cpcap_nsecs() - ep->sent;
+		ep->lat_sum += lat;
+		if (lat > ep->lat_max)
+			ep->lat_max = lat;
+
+		if (ep->round < col->emitted) {
+			ep->late++;
+			if (ep->nvals)
+				cpcap_collect_line(col, ep);
+			continue;
+		}
+		ep->have = ep->nvals > 0;
+		if (--col->outstanding == 0)
+			cpcap_collect_emit(col, ep->round);
+	}
+
+	memmove(ep->in, ep->in + pos, ep->in_len - pos);
+	ep->in_len -= pos;
+}
+
+static void cpcap_collect_event(struct cpcap_collector *col,
+				struct cpcap_endpoint *ep, unsigned int events)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = ep };
+	socklen_t len = sizeof(int);
+	int error = 0;
+	ssize_t n;
+
+	if (ep->state == CPCAP_EP_CONNECTING) {
+		getsockopt(ep->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+		if (error || epoll_ctl(col->epfd, EPOLL_CTL_MOD, ep->fd,
+				       &ev) < 0) {
+			cpcap_collect_down(col, ep);
+			return;
+		}
+		ep->state = CPCAP_EP_UP;
+		return;
+	}
+
+	for (;;) {
+		n = read(ep->fd, ep->in + ep->in_len,
+			 sizeof(ep->in) - ep->in_len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			break;
+		if (n <= 0) {
+			cpcap_collect_down(col, ep);
+			return;
+		}
+		ep->bytes += n;
+		ep->in_len += n;
+		cpcap_collect_replies(col, ep);
+	}
+}
+
+/*
+ * Closes the previous round if still open and sends the next one. If
+ * the timer expired more than once, the rounds in between are skipped
+ * to keep the round times aligned.
+ */
+static void cpcap_collect_round(struct cpcap_collector *col,
+				unsigned long long ticks)
+{
+	unsigned long long now = cpcap_nsecs();
+	struct cpcap_endpoint *ep;
+	int i;
+
+	if (col->round && col->emitted < col->round)
+		cpcap_collect_emit(col, col->round - 1);
+	col->round += ticks - 1;
+	col->emitted = col->round;
+	if (col->count && col->round >= col->count) {
+		cpcap_stop = 1;
+		return;
+	}
+
+	for (i = 0; i < col->neps; i++) {
+		ep = &col->eps[i];
+		if (ep->state == CPCAP_EP_DOWN && now >= ep->retry_at)
+			cpcap_collect_connect(col, ep);
+		if (ep->state == CPCAP_EP_UP && !ep->pending)
+			cpcap_collect_request(col, ep);
+	}
+	col->round++;
+}
+
+static void cpcap_collect_report(const struct cpcap_collector *col,
+				 double elapsed)
+{
+	const struct cpcap_endpoint *ep;
+	unsigned long long rounds = 0, bytes = 0;
+	int i, up = 0;
+
+	fprintf(stderr, "%-24s %5s %8s %7s %7s %6s %5s %9s %9s %9s %9s\n",
+		"endpoint", "state", "rounds", "missed", "late", "errors",
+		"conn", "rounds/s", "KB/s", "mean ms", "max ms");
+	for (i = 0; i < col->neps; i++) {
+		ep = &col->eps[i];
+		up += ep->state == CPCAP_EP_UP;
+		rounds += ep->rounds;
+		bytes += ep->bytes;
+		fprintf(stderr, "%-24s %5s %8llu %7llu %7llu %6llu %5llu "
+			"%9.1f %9.1f %9.3f %9.3f\n", ep->name,
+			ep->state == CPCAP_EP_UP ? "up" : "down", ep->rounds,
+			ep->missed, ep->late, ep->errors, ep->connects,
+			ep->rounds / elapsed, ep->bytes / elapsed / 1024,
+			ep->rounds + ep->late ? ep->lat_sum / 1e6 /
+			(ep->rounds + ep->late) : 0, ep->lat_max / 1e6);
+	}
+	fprintf(stderr, "%i of %i endpoints up, %u rounds in %.3f s, "
+		"%.1f samples/s, %.1f KB/s\n", up, col->neps, col->emitted,
+		elapsed, rounds / elapsed, bytes / elapsed / 1024);
+}
+
+static int cpcap_collect(const char *list, const struct cpcap_watch_args *args)
+{
+	struct epoll_event events[CPCAP_COLLECT_EVENTS];
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct cpcap_collector col = { .epfd = -1, .tfd = -1 };
+	struct itimerspec its = { { 0 } };
+	unsigned long long start, ticks;
+	int i, n, error;
+
+	error = cpcap_collect_parse(&col, list);
+	if (error)
+		goto free;
+
+	if (args->regs) {
+		col.w = calloc(1, sizeof(*col.w));
+		if (!col.w) {
+			error = -ENOMEM;
+			goto free;
+		}
+		error = cpcap_watch_parse_regs(col.w, args->regs);
+		if (error)
+			goto free;
+		if (col.w->multirate) {
+			fprintf(stderr, "--collect has one rate for all\n");
+			error = -EINVAL;
+			goto free;
+		}
+	}
+
+	col.line = malloc(CPCAP_COLLECT_LINE_MAX);
+	col.period = args->period_us * 1000;
+	col.count = args->count;
+	if (!col.w && !col.count)
+		col.count = 1;
+	if (!col.line || !col.period) {
+		error = col.line ? -EINVAL : -ENOMEM;
+		goto free;
+	}
+
+	col.epfd = epoll_create1(0);
+	col.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (col.epfd < 0 || col.tfd < 0) {
+		error = -errno;
+		goto free;
+	}
+	if (epoll_ctl(col.epfd, EPOLL_CTL_ADD, col.tfd, &ev) < 0) {
+		error = -errno;
+		goto free;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, cpcap_stop_handler);
+	signal(SIGTERM, cpcap_stop_handler);
+
+	for (i = 0; i < col.neps; i++)
+		cpcap_collect_connect(&col, &col.eps[i]);
+
+	/* The first round starts a period later to let the connects finish */
+	start = cpcap_nsecs();
+	col.t0 = start + col.period;
+	its.it_value.tv_sec = col.t0 / 1000000000ULL;
+	its.it_value.tv_nsec = col.t0 % 1000000000ULL;
+	its.it_interval.tv_sec = col.period / 1000000000ULL;
+	its.it_interval.tv_nsec = col.period % 1000000000ULL;
+	timerfd_settime(col.tfd, TFD_TIMER_ABSTIME, &its, NULL);
+
+	while (!cpcap_stop) {
+		n = epoll_wait(col.epfd, events, CPCAP_COLLECT_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			error = -errno;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr)
+				cpcap_collect_event(&col, events[i].data.ptr,
+						    events[i].events);
+			else if (read(col.tfd, &ticks, sizeof(ticks)) > 0)
+				cpcap_collect_round(&col, ticks);
+		}
+
+		/* Done early if the last round is complete */
+		if (col.count && col.emitted >= col.count)
+			break;
+	}
+	fflush(stdout);
+
+	cpcap_collect_report(&col, (cpcap_nsecs() - start) / 1e9);
+
+free:
+	for (i = 0; i < col.neps; i++) {
+		if (col.eps[i].fd >= 0)
+			close(col.eps[i].fd);
+	}
+	if (col.tfd >= 0)
+		close(col.tfd);
+	if (col.epfd >= 0)
+		close(col.epfd);
+	free(col.line);
+	free(col.w);
+	free(col.eps);
+
+	return error;
+}
+
+/*
+ * Interrupt event monitor for --irq. INT1-4 latch the interrupts until
+ * a 1 is written to the bit, INTM1-4 mask them and INTS1-4 have the
+ * current level of the sources. The twelve registers are read with one
+ * cpcap_readv(), and each unmasked INT bit that was clear in the
+ * previous read is an event, so a bit that stays latched is reported
+ * once. With ack set, the reported bits are cleared so they can latch
+ * again.
+ *
+ * The poll period halves down to CPCAP_IRQ_BUSY_NS on every read with
+ * events, and doubles back up to the idle period on every read
+ * without. The detection latency of an event is at most the time
+ * since the previous read, which is what is reported.
+ */
+#define CPCAP_IRQ_REGS		4
+#define CPCAP_IRQ_BUSY_NS	1000000ULL
+#define CPCAP_IRQ_IDLE_NS	100000000ULL
+
+/* Names as in the Motorola cpcap driver, NULL for unused bits */
+static const char * const cpcap_irq_names[CPCAP_IRQ_REGS * 16] = {
+	"hsclk", "primac", "secmac", "lowbpl",
+	"sec2pri", "lowbph", "eol", "ts",
+	"adcdone", "hs", "mb2", "vbusov",
+	"rvrs_chrg", "chrg_det", "idfloat", "idgnd",
+	"se1", "sessend", "sessvld", "vbusvld",
+	"chrg_curr1", "chrg_curr2", "rvrs_mode", "on",
+	"on2", "clk", "1hz", "ptt",
+	"se0conn", "chrg_se1b", "uart_echo_overrun", "extmemhd",
+	"warm", "sysrstr", "softrst", "diepwrdwn",
+	"dietemph", "pc", "oflowsw", "toda",
+	"stopwatch", "mtrig", "spare", "cc_cal",
+	"uc_priromr", "uc_priramw", "uc_priramr", "uc_useroff",
+	"uc_primacro_4", "uc_primacro_5", "uc_primacro_6", "uc_primacro_7",
+	"uc_primacro_8", "uc_primacro_9", "uc_primacro_10", "uc_primacro_11",
+	"uc_primacro_12", "uc_primacro_13",
+};
+
+/* INT1-4, INTM1-4 and INTS1-4 */
+static const unsigned short cpcap_irq_offsets[CPCAP_IRQ_REGS * 3] = {
+	0x0000, 0x0004, 0x0008, 0x000c,
+	0x0010, 0x0014, 0x0018, 0x001c,
+	0x0020, 0x0024, 0x0028, 0x002c,
+};
+
+struct cpcap_irq_mon {
+	struct cpcap_dev *dev;
+	FILE *out;			/* Events, or NULL to only count */
+	int ack;
+	int all_bits;			/* Masked interrupts too */
+	unsigned long long count;	/* Events to stop after, 0 for none */
+	unsigned long long idle;	/* Slowest period in ns */
+	unsigned short prev[CPCAP_IRQ_REGS];
+	unsigned long long events;
+	unsigned long long polls;
+	unsigned long long acks;
+	unsigned long long errors;
+	unsigned long long lat_sum;
+	unsigned long long lat_max;
+	unsigned long long counts[CPCAP_IRQ_REGS * 16];
+};
+
+/* Reports and optionally acks the new events of a read */
+static int cpcap_irq_events(struct cpcap_irq_mon *m, unsigned long long t,
+			    unsigned long long lat, const unsigned short *vals)
+{
+	unsigned short pending, fresh;
+	int i, bit, n = 0;
+
+	for (i = 0; i < CPCAP_IRQ_REGS; i++) {
+		pending = vals[i] & register_care_tbl[CPCAP_REG_INT1 + i];
+		if (!m->all_bits)
+			pending &= ~vals[CPCAP_IRQ_REGS + i];
+		fresh = pending & ~m->prev[i];
+		m->prev[i] = pending;
+		if (!fresh)
+			continue;
+
+		for (bit = 0; bit < 16; bit++) {
+			if (!(fresh & (1 << bit)))
+				continue;
+			if (m->out)
+				fprintf(m->out, "%.6f %-18s int%i:%-2i "
+					"sense %i%s latency <= %.1f us\n",
+					t / 1e9,
+					cpcap_irq_names[i * 16 + bit] ?
+					cpcap_irq_names[i * 16 + bit] : "-",
+					i + 1, bit,
+					!!(vals[2 * CPCAP_IRQ_REGS + i] &
+					   (1 << bit)),
+					vals[CPCAP_IRQ_REGS + i] & (1 << bit) ?
+					" masked" : "", lat / 1e3);
+			m->counts[i * 16 + bit]++;
+			n++;
+		}
+
+		/*
+		 * Full word write, a masked write would be a read modify
+		 * write on regmap and clear every latched bit
+		 */
+		if (m->ack) {
+			if (cpcap_write_index(m->dev, CPCAP_REG_INT1 + i,
+					      fresh, 0xffff) < 0) {
+				m->errors++;
+				continue;
+			}
+			m->prev[i] &= ~fresh;
+			m->acks++;
+		}
+	}
+
+	if (n) {
+		if (m->out)
+			fflush(m->out);
+		m->events += n;
+		m->lat_sum += lat * n;
+		if (lat > m->lat_max)
+			m->lat_max = lat;
+	}
+
+	return n;
+}
+
+/* Takes the bits already latched in a read as seen, not as events */
+static void cpcap_irq_latched(struct cpcap_irq_mon *m,
+			      const unsigned short *vals)
+{
+	int i;
+
+	for (i = 0; i < CPCAP_IRQ_REGS; i++) {
+		m->prev[i] = vals[i] & register_care_tbl[CPCAP_REG_INT1 + i];
+		if (!m->all_bits)
+			m->prev[i] &= ~vals[CPCAP_IRQ_REGS + i];
+	}
+}
+
+static int cpcap_irq_run(struct cpcap_dev *dev, unsigned long long idle,
+			 unsigned long long count, int ack, int all_bits)
+{
+	unsigned short vals[CPCAP_IRQ_REGS * 3];
+	unsigned long long period, start, last, now;
+	struct cpcap_irq_mon *m;
+	struct timespec deadline;
+	double elapsed;
+	int i;
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return -ENOMEM;
+	m->dev = dev;
+	m->out = stdout;
+	m->ack = ack;
+	m->all_bits = all_bits;
+	m->count = count;
+	m->idle = idle < CPCAP_IRQ_BUSY_NS ? CPCAP_IRQ_BUSY_NS : idle;
+
+	signal(SIGINT, cpcap_stop_handler);
+	signal(SIGTERM, cpcap_stop_handler);
+	prctl(PR_SET_TIMERSLACK, 1);
+
+	/* The bits already latched are not events */
+	for (i = 0; i < CPCAP_IRQ_REGS; i++)
+		cpcap_cache_invalidate(dev, CPCAP_REG_INT1 + i);
+	if (cpcap_readv(dev, cpcap_irq_offsets, vals,
+			CPCAP_IRQ_REGS * 3) < 0) {
+		fprintf(stderr, "could not read INT1-4\n");
+		free(m);
+		return -EIO;
+	}
+	cpcap_irq_latched(m, vals);
+
+	period = m->idle;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	start = last = cpcap_ts_ns(&deadline);
+	while (!cpcap_stop && (!count || m->events < count)) {
+		cpcap_ts_add(&deadline, period);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+				NULL);
+
+		if (cpcap_readv(dev, cpcap_irq_offsets, vals,
+				CPCAP_IRQ_REGS * 3) < 0) {
+			m->errors++;
+			continue;
+		}
+		now = cpcap_nsecs();
+		m->polls++;
+
+		if (cpcap_irq_events(m, now, now - last, vals)) {
+			period = period / 2 > CPCAP_IRQ_BUSY_NS ?
+				period / 2 : CPCAP_IRQ_BUSY_NS;
+		} else if (period < m->idle) {
+			period = period * 2 < m->idle ? period * 2 : m->idle;
+		}
+		last = now;
+
+		/* Continue from now after a suspend or a slow read */
+		if (cpcap_ts_ns(&deadline) + period < now) {
+			deadline.tv_sec = now / 1000000000ULL;
+			deadline.tv_nsec = now % 1000000000ULL;
+		}
+	}
+	elapsed = (cpcap_nsecs() - start) / 1e9;
+
+	fprintf(stderr, "%llu events in %.3f s: %.2f events/s, %llu polls, "
+		"%.1f polls/s\n", m->events, elapsed, m->events / elapsed,
+		m->polls, m->polls / elapsed);
+	if (m->events)
+		fprintf(stderr, "detection latency <= mean %.1f us, "
+			"max %.1f us\n", m->lat_sum / 1e3 / m->events,
+			m->lat_max / 1e3);
+	for (i = 0; i < CPCAP_IRQ_REGS * 16; i++) {
+		if (m->counts[i])
+			fprintf(stderr, "%-18s int%i:%-2i %llu\n",
+				cpcap_irq_names[i] ? cpcap_irq_names[i] : "-",
+				i / 16 + 1, i % 16, m->counts[i]);
+	}
+	if (m->acks || m->errors)
+		fprintf(stderr, "%llu acks, %llu errors\n", m->acks,
+			m->errors);
+
+	i = m->errors ? -EIO : 0;
+	free(m);
+
+	return i;
+}
+
+static const char * const cpcap_stats_op_names[CPCAP_STATS_OPS] = {
+	"read", "write",
 };
 
+/*
+ * Metrics exporter for --export. A sampler thread owns the device: it
+ * reads each metric at its own rate, renders all the metrics in the
+ * Prometheus text format into the back buffer, and swaps it with the
+ * front buffer. The main thread answers HTTP GET requests for
+ * /metrics by copying the front buffer under the lock, so a scrape
+ * never touches the bus and costs a copy however many scrapers there
+ * are.
+ *
+ * The metrics are listed like --watch registers: register offsets or
+ * names, the sw, tod, ccs and cca groups, "regulators" for the enable
+ * state of the registers from S1C1 to VUSBINT2C that have a MODE
+ * field, and "interrupts" for the INT1-4 events counted like --irq
+ * does without acking. Each can have its own rate with @hz. The
+ * register access times and errors come from cpcap_stats.
+ */
+#define CPCAP_EXPORT_MAX_METRICS	64
+#define CPCAP_EXPORT_MAX_CLIENTS	64
+#define CPCAP_EXPORT_LEN		65536
+#define CPCAP_EXPORT_IN_LEN		2048
+#define CPCAP_EXPORT_HDR_LEN		256
+#define CPCAP_EXPORT_PERIOD_NS		1000000000ULL
+#define CPCAP_EXPORT_DEFAULT		"regulators,interrupts@10,tod,ccs,cca"
+#define CPCAP_EXPORT_REGULATORS		\
+	(CPCAP_REG_VUSBINT2C - CPCAP_REG_S1C1 + 1)
+
 enum {
-	CPCAP_IOCTL_NUM_TEST__START,
-	CPCAP_IOCTL_NUM_TEST_READ_REG,
-	CPCAP_IOCTL_NUM_TEST_WRITE_REG,
-	CPCAP_IOCTL_NUM_TEST__END,
+	CPCAP_EXPORT_REG,
+	CPCAP_EXPORT_GROUP,
+	CPCAP_EXPORT_REGULATORS_SET,
+	CPCAP_EXPORT_INTERRUPTS,
+};
+
+struct cpcap_export_metric {
+	int type;
+	int arg;			/* Register index or group */
+	unsigned long long period;	/* ns */
+	unsigned long long deadline;	/* ns */
+	unsigned long long reads;
+	unsigned short vals[CPCAP_GROUP_REGS];
+};
+
+struct cpcap_export {
+	struct cpcap_dev *dev;
+	const struct cpcap_stats *stats;
+	struct cpcap_export_metric metrics[CPCAP_EXPORT_MAX_METRICS];
+	int nmetrics;
+	unsigned long long errors;	/* Failed metric reads */
+
+	/* Regulators with a MODE field, see cpcap_export_init() */
+	unsigned short reg_offsets[CPCAP_EXPORT_REGULATORS];
+	unsigned short reg_vals[CPCAP_EXPORT_REGULATORS];
+	const struct cpcap_field *reg_mode[CPCAP_EXPORT_REGULATORS];
+	int reg_index[CPCAP_EXPORT_REGULATORS];
+	int nregulators;
+
+	struct cpcap_irq_mon irq;
+
+	/* Double buffer, front is only changed with lock held */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *buf[2];
+	size_t len[2];
+	int front;
+	int stop;
+	atomic_ullong scrapes;
+};
+
+struct cpcap_export_client {
+	int fd;
+	size_t in_len;
+	size_t out_pos;
+	size_t out_len;
+	char in[CPCAP_EXPORT_IN_LEN];
+	char out[CPCAP_EXPORT_HDR_LEN + CPCAP_EXPORT_LEN];
+};
+
+static int cpcap_export_parse(struct cpcap_export *e, const char *list,
+			      unsigned long long period)
+{
+	struct cpcap_export_metric *m;
+	char buf[512], *p, *token, *rate, *end;
+	int offset;
+	double hz;
+
+	if (strlen(list) >= sizeof(buf))
+		return -EINVAL;
+	strcpy(buf, list);
+
+	p = buf;
+	while ((token = strsep(&p, ","))) {
+		if (!*token)
+			continue;
+		if (e->nmetrics >= CPCAP_EXPORT_MAX_METRICS) {
+			fprintf(stderr, "too many metrics, max %i\n",
+				CPCAP_EXPORT_MAX_METRICS);
+			return -EINVAL;
+		}
+		m = &e->metrics[e->nmetrics];
+		m->period = period;
+
+		rate = strchr(token, '@');
+		if (rate) {
+			*rate++ = '\0';
+			hz = strtod(rate, &end);
+			if (end == rate || *end || hz <= 0 || hz > 1e6) {
+				fprintf(stderr, "invalid rate: %s\n", rate);
+				return -EINVAL;
+			}
+			m->period = 1e9 / hz;
+		}
+
+		if (!strcasecmp(token, "regulators")) {
+			m->type = CPCAP_EXPORT_REGULATORS_SET;
+		} else if (!strcasecmp(token, "interrupts")) {
+			m->type = CPCAP_EXPORT_INTERRUPTS;
+		} else if ((m->arg = cpcap_parse_group(token)) >= 0) {
+			m->type = CPCAP_EXPORT_GROUP;
+		} else {
+			offset = cpcap_parse_offset(token);
+			m->arg = offset < 0 ? offset :
+				cpcap_offset_to_index(offset);
+			if (m->arg < 0) {
+				fprintf(stderr, "invalid metric: %s\n", token);
+				return -EINVAL;
+			}
+			m->type = CPCAP_EXPORT_REG;
+		}
+		e->nmetrics++;
+	}
+
+	return e->nmetrics ? 0 : -EINVAL;
+}
+
+static const struct cpcap_field *cpcap_export_mode(int index)
+{
+	const struct cpcap_fields *f = cpcap_reg_db[index].fields;
+	int i;
+
+	for (i = 0; i < f->n; i++) {
+		if (!strcmp(f->field[i].name, "MODE"))
+			return &f->field[i];
+	}
+
+	return NULL;
+}
+
+static void cpcap_export_init(struct cpcap_export *e)
+{
+	int index, n = 0;
+
+	for (index = CPCAP_REG_S1C1; index <= CPCAP_REG_VUSBINT2C; index++) {
+		e->reg_mode[n] = cpcap_export_mode(index);
+		if (!e->reg_mode[n])
+			continue;
+		e->reg_index[n] = index;
+		e->reg_offsets[n] = cpcap_reg_db[index].offset;
+		n++;
+	}
+	e->nregulators = n;
+
+	e->irq.dev = e->dev;
+}
+
+/*
+ * Reads the metrics that are due at t, the registers with a single
+ * cpcap_readv(). Returns the number of metrics read.
+ */
+static int cpcap_export_read(struct cpcap_export *e, unsigned long long t)
+{
+	unsigned short offsets[CPCAP_EXPORT_MAX_METRICS];
+	unsigned short vals[CPCAP_EXPORT_MAX_METRICS];
+	unsigned short irq[CPCAP_IRQ_REGS * 3];
+	struct cpcap_export_metric *m, *regs[CPCAP_EXPORT_MAX_METRICS];
+	int i, n = 0, nregs = 0, error;
+
+	for (i = 0; i < e->nmetrics; i++) {
+		m = &e->metrics[i];
+		if (m->deadline > t)
+			continue;
+
+		m->deadline += m->period;
+		if (m->deadline <= t)
+			m->deadline = t + m->period;
+		n++;
+
+		switch (m->type) {
+		case CPCAP_EXPORT_REG:
+			offsets[nregs] = cpcap_reg_db[m->arg].offset;
+			regs[nregs++] = m;
+			continue;
+		case CPCAP_EXPORT_GROUP:
+			error = cpcap_read_group(e->dev, m->arg, m->vals, 0);
+			break;
+		case CPCAP_EXPORT_REGULATORS_SET:
+			error = cpcap_readv(e->dev, e->reg_offsets,
+					    e->reg_vals, e->nregulators);
+			break;
+		default:
+			error = cpcap_readv(e->dev, cpcap_irq_offsets, irq,
+					    CPCAP_IRQ_REGS * 3);
+			if (error < 0)
+				break;
+			if (m->reads)
+				cpcap_irq_events(&e->irq, t, 0, irq);
+			else
+				cpcap_irq_latched(&e->irq, irq);
+			break;
+		}
+
+		if (error < 0)
+			e->errors++;
+		else
+			m->reads++;
+	}
+
+	if (nregs) {
+		error = cpcap_readv(e->dev, offsets, vals, nregs);
+		for (i = 0; i < nregs; i++) {
+			if (error < 0) {
+				e->errors++;
+				continue;
+			}
+			regs[i]->vals[0] = vals[i];
+			regs[i]->reads++;
+		}
+	}
+
+	return n;
+}
+
+struct cpcap_export_text {
+	char *buf;
+	size_t len;
 };
 
-#define CPCAP_IOCTL_TEST_READ_REG \
-	_IOWR(0, CPCAP_IOCTL_NUM_TEST_READ_REG, struct cpcap_regacc*)
-#define CPCAP_IOCTL_TEST_WRITE_REG \
-	_IOWR(0, CPCAP_IOCTL_NUM_TEST_WRITE_REG, struct cpcap_regacc*)
+static void cpcap_export_printf(struct cpcap_export_text *text,
+				const char *fmt, ...)
+{
+	size_t left = CPCAP_EXPORT_LEN - text->len;
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(text->buf + text->len, left, fmt, ap);
+	va_end(ap);
+
+	/* A truncated line is dropped */
+	if (n > 0 && n < left)
+		text->len += n;
+}
+
+static void cpcap_export_family(struct cpcap_export_text *text,
+				const char *name, const char *type,
+				const char *help)
+{
+	cpcap_export_printf(text, "# HELP %s %s\n# TYPE %s %s\n", name, help,
+			    name, type);
+}
+
+static void cpcap_export_render_regs(struct cpcap_export *e,
+				     struct cpcap_export_text *text)
+{
+	const struct cpcap_export_metric *m;
+	const struct cpcap_field *mode;
+	unsigned short val;
+	int i, first = 1;
+
+	for (i = 0; i < e->nmetrics; i++) {
+		m = &e->metrics[i];
+		if (m->type != CPCAP_EXPORT_REG || !m->reads)
+			continue;
+		if (first)
+			cpcap_export_family(text, "cpcap_register", "gauge",
+					    "Register value.");
+		first = 0;
+		cpcap_export_printf(text, "cpcap_register{name=\"%s\","
+				    "offset=\"0x%04x\"} %u\n",
+				    cpcap_reg_db[m->arg].name,
+				    cpcap_reg_db[m->arg].offset, m->vals[0]);
+	}
+
+	first = 1;
+	for (i = 0; i < e->nmetrics; i++) {
+		m = &e->metrics[i];
+		if (m->type != CPCAP_EXPORT_GROUP || !m->reads)
+			continue;
+		if (first)
+			cpcap_export_family(text, "cpcap_counter", "gauge",
+					    "Counter that spans registers.");
+		first = 0;
+		cpcap_export_printf(text, "cpcap_counter{name=\"%s\"} %lli\n",
+				    cpcap_group_tbl[m->arg].name,
+				    cpcap_group_value(m->arg, m->vals));
+	}
+
+	for (i = 0; i < e->nmetrics; i++) {
+		m = &e->metrics[i];
+		if (m->type == CPCAP_EXPORT_REGULATORS_SET && m->reads)
+			break;
+	}
+	if (i == e->nmetrics)
+		return;
+
+	cpcap_export_family(text, "cpcap_regulator_enabled", "gauge",
+			    "1 if any regulator MODE bit is set.");
+	for (i = 0; i < e->nregulators; i++) {
+		mode = e->reg_mode[i];
+		val = e->reg_vals[i] & mode->mask &
+			register_care_tbl[e->reg_index[i]];
+		cpcap_export_printf(text, "cpcap_regulator_enabled{name=\"%s\"}"
+				    " %i\n", cpcap_reg_db[e->reg_index[i]].name,
+				    !!val);
+	}
+	cpcap_export_family(text, "cpcap_regulator_mode", "gauge",
+			    "Regulator MODE field.");
+	for (i = 0; i < e->nregulators; i++) {
+		mode = e->reg_mode[i];
+		cpcap_export_printf(text, "cpcap_regulator_mode{name=\"%s\"} "
+				    "%u\n", cpcap_reg_db[e->reg_index[i]].name,
+				    (e->reg_vals[i] & mode->mask) >>
+				    mode->shift);
+	}
+}
+
+static void cpcap_export_render_irq(struct cpcap_export *e,
+				    struct cpcap_export_text *text)
+{
+	int i;
+
+	for (i = 0; i < e->nmetrics; i++) {
+		if (e->metrics[i].type == CPCAP_EXPORT_INTERRUPTS &&
+		    e->metrics[i].reads)
+			break;
+	}
+	if (i == e->nmetrics)
+		return;
+
+	cpcap_export_family(text, "cpcap_interrupts_total", "counter",
+			    "Interrupts seen latched in INT1-4.");
+	for (i = 0; i < CPCAP_IRQ_REGS * 16; i++) {
+		if (!cpcap_irq_names[i])
+			continue;
+		cpcap_export_printf(text, "cpcap_interrupts_total{name=\"%s\","
+				    "int=\"%i\",bit=\"%i\"} %llu\n",
+				    cpcap_irq_names[i], i / 16 + 1, i % 16,
+				    e->irq.counts[i]);
+	}
+}
+
+static void cpcap_export_render_stats(struct cpcap_export *e,
+				      struct cpcap_export_text *text)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99 };
+	const struct cpcap_stats *stats = e->stats;
+	const struct cpcap_hist *h;
+	int block, op, i;
+
+	cpcap_export_family(text, "cpcap_access_seconds", "summary",
+			    "Register access time per block.");
+	for (block = 0; block < CPCAP_NUM_BLOCKS; block++) {
+		for (op = 0; op < CPCAP_STATS_OPS; op++) {
+			h = &stats->hist[block][op];
+			if (!h->count)
+				continue;
+			for (i = 0; i < 3; i++)
+				cpcap_export_printf(text, "cpcap_access_seconds"
+					"{block=\"%s\",op=\"%s\","
+					"quantile=\"%g\"} %.9f\n",
+					cpcap_block_name(block),
+					cpcap_stats_op_names[op], quantiles[i],
+					cpcap_hist_percentile(h, 100 *
+							quantiles[i]) / 1e9);
+			cpcap_export_printf(text, "cpcap_access_seconds_sum"
+					    "{block=\"%s\",op=\"%s\"} %.9f\n",
+					    cpcap_block_name(block),
+					    cpcap_stats_op_names[op],
+					    h->sum / 1e9);
+			cpcap_export_printf(text, "cpcap_access_seconds_count"
+					    "{block=\"%s\",op=\"%s\"} %llu\n",
+					    cpcap_block_name(block),
+					    cpcap_stats_op_names[op], h->count);
+		}
+	}
+
+	cpcap_export_family(text, "cpcap_access_errors_total", "counter",
+			    "Failed register accesses per block.");
+	for (block = 0; block < CPCAP_NUM_BLOCKS; block++)
+		cpcap_export_printf(text, "cpcap_access_errors_total"
+				    "{block=\"%s\"} %u\n",
+				    cpcap_block_name(block),
+				    stats->block_errors[block]);
+
+	cpcap_export_family(text, "cpcap_group_rereads_total", "counter",
+			    "Extra reads of counters near a carry.");
+	for (i = 0; i < CPCAP_NUM_GROUPS; i++)
+		cpcap_export_printf(text, "cpcap_group_rereads_total"
+				    "{name=\"%s\"} %llu\n",
+				    cpcap_group_tbl[i].name,
+				    stats->group_retries[i]);
+
+	cpcap_export_family(text, "cpcap_export_errors_total", "counter",
+			    "Failed metric reads.");
+	cpcap_export_printf(text, "cpcap_export_errors_total %llu\n",
+			    e->errors);
+	cpcap_export_family(text, "cpcap_export_scrapes_total", "counter",
+			    "Scrapes served.");
+	cpcap_export_printf(text, "cpcap_export_scrapes_total %llu\n",
+			    atomic_load(&e->scrapes));
+}
+
+/* Renders the metrics into the back buffer and makes it the front */
+static void cpcap_export_render(struct cpcap_export *e)
+{
+	struct cpcap_export_text text;
+
+	text.buf = e->buf[!e->front];
+	text.len = 0;
+	cpcap_export_render_regs(e, &text);
+	cpcap_export_render_irq(e, &text);
+	cpcap_export_render_stats(e, &text);
+
+	pthread_mutex_lock(&e->lock);
+	e->len[!e->front] = text.len;
+	e->front = !e->front;
+	pthread_mutex_unlock(&e->lock);
+}
+
+static void *cpcap_export_sampler(void *data)
+{
+	struct cpcap_export *e = data;
+	unsigned long long due;
+	struct timespec ts;
+	int i;
+
+	pthread_mutex_lock(&e->lock);
+	while (!e->stop) {
+		due = e->metrics[0].deadline;
+		for (i = 1; i < e->nmetrics; i++) {
+			if (e->metrics[i].deadline < due)
+				due = e->metrics[i].deadline;
+		}
+		ts.tv_sec = due / 1000000000ULL;
+		ts.tv_nsec = due % 1000000000ULL;
+		pthread_cond_timedwait(&e->cond, &e->lock, &ts);
+		if (e->stop)
+			break;
+
+		pthread_mutex_unlock(&e->lock);
+		if (cpcap_export_read(e, cpcap_nsecs()))
+			cpcap_export_render(e);
+		pthread_mutex_lock(&e->lock);
+	}
+	pthread_mutex_unlock(&e->lock);
+
+	return NULL;
+}
+
+/*
+ * Answers a complete request: the front buffer for GET /metrics or /,
+ * an error status for anything else.
+ */
+static void cpcap_export_reply(struct cpcap_export *e,
+			       struct cpcap_export_client *c)
+{
+	const char *status = "200 OK";
+	size_t len = 0;
+	int hdr;
+
+	if (strncmp(c->in, "GET ", 4))
+		status = "405 Method Not Allowed";
+	else if (strncmp(c->in + 4, "/metrics ", 9) &&
+		 strncmp(c->in + 4, "/ ", 2))
+		status = "404 Not Found";
+
+	pthread_mutex_lock(&e->lock);
+	if (*status == '2')
+		len = e->len[e->front];
+	hdr = snprintf(c->out, CPCAP_EXPORT_HDR_LEN, "HTTP/1.1 %s\r\n"
+		       "Content-Type: text/plain; version=0.0.4\r\n"
+		       "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+		       status, len);
+	memcpy(c->out + hdr, e->buf[e->front], len);
+	pthread_mutex_unlock(&e->lock);
+
+	if (len)
+		atomic_fetch_add(&e->scrapes, 1);
+	c->out_len = hdr + len;
+}
+
+/* Returns negative error or 1 when the client is done */
+static int cpcap_export_client(struct cpcap_export *e,
+			       struct cpcap_export_client *c, short revents)
+{
+	ssize_t n;
+
+	if (!c->out_len && (revents & (POLLIN | POLLHUP | POLLERR))) {
+		n = read(c->fd, c->in + c->in_len,
+			 sizeof(c->in) - c->in_len - 1);
+		if (n == 0)
+			return -ECONNRESET;
+		if (n < 0)
+			return errno == EAGAIN || errno == EINTR ? 0 : -errno;
+		c->in_len += n;
+		c->in[c->in_len] = '\0';
+
+		if (!strstr(c->in, "\r\n\r\n") && !strstr(c->in, "\n\n")) {
+			if (c->in_len == sizeof(c->in) - 1)
+				return -EMSGSIZE;
+			return 0;
+		}
+		cpcap_export_reply(e, c);
+	}
+
+	while (c->out_pos < c->out_len) {
+		n = write(c->fd, c->out + c->out_pos, c->out_len - c->out_pos);
+		if (n < 0) {
+			if (errno == EAGAIN)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		c->out_pos += n;
+	}
+
+	return c->out_len ? 1 : 0;
+}
+
+static int cpcap_export_serve(struct cpcap_export *e, const char *addr)
+{
+	struct cpcap_export_client *clients[CPCAP_EXPORT_MAX_CLIENTS] = { 0 };
+	struct pollfd pfd[CPCAP_EXPORT_MAX_CLIENTS + 1];
+	struct cpcap_export_client *c;
+	struct sockaddr_storage ss;
+	int family, lfd, cfd, i, n, error, one = 1;
+	socklen_t len;
+
+	family = cpcap_sockaddr(addr, &ss, &len);
+	if (family < 0) {
+		fprintf(stderr, "invalid address: %s\n", addr);
+		return family;
+	}
+
+	lfd = socket(family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (lfd < 0)
+		return -errno;
+
+	if (family == AF_UNIX)
+		unlink(((struct sockaddr_un *)&ss)->sun_path);
+	else
+		setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(lfd, (struct sockaddr *)&ss, len) < 0 ||
+	    listen(lfd, 64) < 0) {
+		error = -errno;
+		fprintf(stderr, "could not listen on %s: %i\n", addr, error);
+		close(lfd);
+		return error;
+	}
+
+	fprintf(stderr, "exporting on %s\n", addr);
+
+	while (!cpcap_stop) {
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < CPCAP_EXPORT_MAX_CLIENTS; i++) {
+			c = clients[i];
+			pfd[i + 1].fd = c ? c->fd : -1;
+			pfd[i + 1].events = c && c->out_len ? POLLOUT : POLLIN;
+		}
+
+		n = poll(pfd, CPCAP_EXPORT_MAX_CLIENTS + 1, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			cfd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK);
+			for (i = 0; cfd >= 0 && i < CPCAP_EXPORT_MAX_CLIENTS;
+			     i++) {
+				if (clients[i])
+					continue;
+				clients[i] = malloc(sizeof(*c));
+				if (!clients[i])
+					break;
+				clients[i]->fd = cfd;
+				clients[i]->in_len = 0;
+				clients[i]->out_pos = 0;
+				clients[i]->out_len = 0;
+				cfd = -1;
+			}
+			if (cfd >= 0)
+				close(cfd);
+		}
+
+		for (i = 0; i < CPCAP_EXPORT_MAX_CLIENTS; i++) {
+			c = clients[i];
+			if (!c || !pfd[i + 1].revents)
+				continue;
+			if (cpcap_export_client(e, c, pfd[i + 1].revents)) {
+				close(c->fd);
+				free(c);
+				clients[i] = NULL;
+			}
+		}
+	}
+
+	for (i = 0; i < CPCAP_EXPORT_MAX_CLIENTS; i++) {
+		if (clients[i]) {
+			close(clients[i]->fd);
+			free(clients[i]);
+		}
+	}
+	close(lfd);
+	if (family == AF_UNIX)
+		unlink(((struct sockaddr_un *)&ss)->sun_path);
+
+	return 0;
+}
 
 /*
- * Note that Motorola mapphone Linux kernel uses a register index
- * for reg instead of regmap address offset.
+ * Runs the exporter until interrupted. The first reading of all the
+ * metrics is done before serving, so there is always something to
+ * scrape. stats must be enabled on dev.
  */
-struct cpcap_regacc {
-	unsigned short reg;
-	unsigned short value;
-	unsigned short mask;
-};
-
-static int cpcap_init_regwrite(struct cpcap_regacc *reg, int offset)
+static int cpcap_export_run(struct cpcap_dev *dev, const char *addr,
+			    const char *list, unsigned long long period,
+			    const struct cpcap_stats *stats)
 {
-	int i;
+	pthread_condattr_t attr;
+	struct cpcap_export *e;
+	pthread_t thread;
+	int i, error;
 
-	reg->reg = 0;
-	reg->value = 0;
-	reg->mask = 0;
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return -ENOMEM;
+	e->dev = dev;
+	e->stats = stats;
+	e->buf[0] = malloc(CPCAP_EXPORT_LEN);
+	e->buf[1] = malloc(CPCAP_EXPORT_LEN);
+	if (!e->buf[0] || !e->buf[1]) {
+		error = -ENOMEM;
+		goto free;
+	}
 
-	for (i = 0; i < CPCAP_NUM_REG_CPCAP; i++) {
-		if ((register_info_tbl[i].address * 4) == offset) {
-			reg->mask = register_info_tbl[i].rbw_mask;
-			reg->reg = i;
-			return i;
-		}
+	error = cpcap_export_parse(e, list ? list : CPCAP_EXPORT_DEFAULT,
+				   period);
+	if (error)
+		goto free;
+	cpcap_export_init(e);
+
+	cpcap_export_read(e, cpcap_nsecs());
+	cpcap_export_render(e);
+
+	pthread_mutex_init(&e->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&e->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, cpcap_stop_handler);
+	signal(SIGTERM, cpcap_stop_handler);
+
+	error = pthread_create(&thread, NULL, cpcap_export_sampler, e);
+	if (error) {
+		error = -error;
+		goto destroy;
 	}
 
-	return -EINVAL;
+	error = cpcap_export_serve(e, addr);
+
+	pthread_mutex_lock(&e->lock);
+	e->stop = 1;
+	pthread_cond_signal(&e->cond);
+	pthread_mutex_unlock(&e->lock);
+	pthread_join(thread, NULL);
+
+	fprintf(stderr, "%llu scrapes, %llu metric read errors\n",
+		atomic_load(&e->scrapes), e->errors);
+	for (i = 0; i < e->nmetrics; i++) {
+		if (!e->metrics[i].reads)
+			error = error ? error : -EIO;
+	}
+
+destroy:
+	pthread_cond_destroy(&e->cond);
+	pthread_mutex_destroy(&e->lock);
+free:
+	free(e->buf[0]);
+	free(e->buf[1]);
+	free(e);
+
+	return error;
+}
+
+static unsigned int cpcap_bench_rand(unsigned int *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+
+	return *state;
 }
 
 /*
- * Produces output similar to mainline kernel debugfs for
- * cat /sys/kernel/debug/regmap/spi1.0/registers.
- *
- * Note that some values are not read by the ioctl with the
- * Android kernel and those are always shown as 0000.
+ * Writes a synthetic capture of coulomb counter, ADC and interrupt
+ * sense registers at 100 Hz with and without compression, and reports
+ * the size per sample and the decode throughput to CSV.
  */
-static int cpcap_dump_all(int fd)
+static int cpcap_bench_capture(unsigned long long samples)
 {
-	struct cpcap_regacc reg;
-	int index, i, error = 0;
+	static const unsigned short offsets[] = {
+		0x0a0c, 0x0a10, 0x0a14, 0x0a18,		/* CCS1..CCA2 */
+		0x0c08, 0x0c0c, 0x0c10,			/* ADCD0..ADCD2 */
+		0x0020, 0x0024,				/* INTS1..INTS2 */
+	};
+	unsigned short vals[sizeof(offsets) / sizeof(offsets[0])] = { 0 };
+	int nregs = sizeof(offsets) / sizeof(offsets[0]);
+	unsigned long long i, t, start, elapsed, count;
+	struct cpcap_query_args qargs = { 0 };
+	struct cpcap_query_stats qstats;
+	struct cpcap_capture *c;
+	struct cpcap_power *pw;
+	char name[256], line[CPCAP_DECODE_LINE_MAX];
+	unsigned int seed, acc;
+	const char *dir;
+	int fd, compress, error = 0;
 
-	for (i = 0; i <= CPCAP_REG_MAX_OFFSET; i += 4) {
-		index = cpcap_init_regwrite(&reg, i);
+	dir = getenv("TMPDIR");
+	snprintf(name, sizeof(name), "%s/cpcaprw-bench.cap", dir ? dir : "/tmp");
 
-		/* Just print 0000 for unlisted registers */
-		if (index < 0) {
-			printf("%04x: 0000\n", i);
-			continue;
+	c = malloc(sizeof(*c));
+	pw = malloc(sizeof(*pw));
+	if (!c || !pw) {
+		free(c);
+		free(pw);
+		return -ENOMEM;
+	}
+
+	for (compress = 0; compress <= 1 && !error; compress++) {
+		fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			error = -errno;
+			break;
+		}
+
+		seed = 1;
+		acc = 0;
+		t = 0;
+		start = cpcap_nsecs();
+		error = cpcap_capture_start(c, fd, offsets, nregs,
+					    10000000, compress);
+		for (i = 0; i < samples && !error; i++) {
+			t += 10000000 + cpcap_bench_rand(&seed) % 100000;
+			acc += cpcap_bench_rand(&seed) % 64;
+			vals[0] = i;
+			vals[1] = i >> 16;
+			vals[2] = acc;
+			vals[3] = acc >> 16;
+			vals[4] = 0x200 + cpcap_bench_rand(&seed) % 8;
+			vals[5] = 0x180 + cpcap_bench_rand(&seed) % 4;
+			if (!(cpcap_bench_rand(&seed) % 16))
+				vals[6] = 0x300 + cpcap_bench_rand(&seed) % 4;
+			if (!(i % 1000))
+				vals[7] ^= 0x0010;
+			error = cpcap_capture_add(c, t, vals);
 		}
+		if (!error)
+			error = cpcap_capture_flush(c);
+		elapsed = cpcap_nsecs() - start;
+		close(fd);
+		if (error)
+			break;
 
-		reg.value = 0;
+		printf("capture %s: %llu samples, %.2f bytes/sample "
+		       "(text %i), encode %.1f Msamples/s\n",
+		       compress ? "compressed" : "raw", samples,
+		       (double)c->bytes / samples,
+		       (int)(cpcap_fmt_sample(line, offsets, nregs, t, vals,
+					      NULL) - line),
+		       samples * 1e3 / elapsed);
 
-		error = ioctl(fd, CPCAP_IOCTL_TEST_READ_REG, &reg);
-		if (error < 0) {
-			fprintf(stderr, "read ioctl failed: %i\n", error);
+		fd = open("/dev/null", O_WRONLY);
+		start = cpcap_nsecs();
+		error = cpcap_decode(name, fd, CPCAP_DECODE_CSV, &count);
+		elapsed = cpcap_nsecs() - start;
+		close(fd);
+		if (error)
+			break;
+
+		printf("decode %s to csv: %.1f MB/s capture, "
+		       "%.1f Msamples/s\n", compress ? "compressed" : "raw",
+		       c->bytes * 1e3 / elapsed, count * 1e3 / elapsed);
+
+		memset(pw, 0, sizeof(*pw));
+		pw->out = fopen("/dev/null", "w");
+		if (!pw->out) {
+			error = -errno;
 			break;
 		}
-		printf("%04x: %04x\n", i, reg.value);
+		pw->lsb = CPCAP_CC_LSB;
+		pw->have_offset = 1;
+		pw->interval = 60000000000ULL;
+		start = cpcap_nsecs();
+		error = cpcap_power_replay_cap(pw, name, &count);
+		elapsed = cpcap_nsecs() - start;
+		fclose(pw->out);
+		if (error)
+			break;
+
+		printf("replay %s to --power: %.1f Msamples/s\n",
+		       compress ? "compressed" : "raw", count * 1e3 / elapsed);
+
+		error = cpcap_query_file(NULL, name, &qargs, 0x0020, 0x0010,
+					 0x0010, &qstats);
+		if (error)
+			break;
+
+		printf("query %s INTS1: %.2f GB/s, %.1f Msamples/s, "
+		       "%i threads\n", compress ? "compressed" : "raw",
+		       qstats.size / (double)qstats.elapsed,
+		       qstats.samples * 1e3 / qstats.elapsed, qstats.threads);
 	}
 
+	unlink(name);
+	free(pw);
+	free(c);
+
 	return error;
 }
 
 /*
- * See drivers/mfd/cpcap-regacc.c in Motorola mapphone Linux kernel tree
- * for details of the ioctl handling.
+ * Reads a register by running "cpcaprw --backend backend offset" and
+ * parsing its output, the way scripts that shell out do it.
  */
-static int cpcap_read(int fd, int reg_offset, int *val)
+static int cpcap_exec_read(const char *backend, const char *offset,
+			   unsigned short *val)
 {
-	struct cpcap_regacc reg;
-	int index, error;
+	char buf[128], *p;
+	int fds[2], status, len = 0, n;
+	pid_t pid;
 
-	index = cpcap_init_regwrite(&reg, reg_offset);
-	if (index < 0)
-		return index;
+	if (pipe(fds) < 0)
+		return -errno;
 
-	reg.value = 0;
+	pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -errno;
+	}
+	if (!pid) {
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		execl("/proc/self/exe", "cpcaprw", "--backend", backend,
+		      offset, (char *)NULL);
+		_exit(127);
+	}
 
-	error = ioctl(fd, CPCAP_IOCTL_TEST_READ_REG, &reg);
-	if (error < 0) {
-		fprintf(stderr, "read ioctl failed: %i\n", error);
+	close(fds[1]);
+	while (len < sizeof(buf) - 1 &&
+	       (n = read(fds[0], buf + len, sizeof(buf) - 1 - len)) > 0)
+		len += n;
+	buf[len] = '\0';
+	close(fds[0]);
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status))
+		return -EIO;
+
+	p = strchr(buf, '=');
+	if (!p)
+		return -EIO;
+	*val = strtol(p + 1, NULL, 16);
+
+	return 0;
+}
+
+#define CPCAP_BENCH_EXEC_REGS	8
+
+/*
+ * Compares reading registers by running cpcaprw for each read against
+ * cpcap_readv() in the same process, both with the sim backend.
+ */
+static int cpcap_bench_exec(int reads)
+{
+	static const unsigned short offsets[CPCAP_BENCH_EXEC_REGS] = {
+		0x0a0c, 0x0a10, 0x0a14, 0x0a18, 0x0e04, 0x0e08, 0x0e0c, 0x0e10,
+	};
+	unsigned short vals[CPCAP_BENCH_EXEC_REGS];
+	unsigned long long start, exec, single, batch;
+	struct cpcap_dev *dev;
+	char offset[8];
+	int i, error, batches;
 
+	error = cpcap_open(&dev, "sim", NULL);
+	if (error)
 		return error;
+
+	start = cpcap_nsecs();
+	for (i = 0; i < reads; i++) {
+		snprintf(offset, sizeof(offset), "0x%04x",
+			 offsets[i % CPCAP_BENCH_EXEC_REGS]);
+		error = cpcap_exec_read("sim", offset, &vals[0]);
+		if (error) {
+			fprintf(stderr, "exec read failed: %i\n", error);
+			goto close;
+		}
+	}
+	exec = cpcap_nsecs() - start;
+
+	start = cpcap_nsecs();
+	for (i = 0; i < reads; i++) {
+		error = cpcap_readv(dev, &offsets[i % CPCAP_BENCH_EXEC_REGS],
+				    vals, 1);
+		if (error)
+			goto close;
+	}
+	single = cpcap_nsecs() - start;
+
+	batches = (reads + CPCAP_BENCH_EXEC_REGS - 1) / CPCAP_BENCH_EXEC_REGS;
+	start = cpcap_nsecs();
+	for (i = 0; i < batches; i++) {
+		error = cpcap_readv(dev, offsets, vals, CPCAP_BENCH_EXEC_REGS);
+		if (error)
+			goto close;
+	}
+	batch = cpcap_nsecs() - start;
+
+	printf("exec per read:     %.1f us/read\n", exec / 1e3 / reads);
+	printf("in-process read:   %.3f us/read\n", single / 1e3 / reads);
+	printf("in-process readv:  %.3f us/read, %i registers per call\n",
+	       batch / 1e3 / (batches * CPCAP_BENCH_EXEC_REGS),
+	       CPCAP_BENCH_EXEC_REGS);
+	printf("speedup: %.0fx\n", (double)exec / (single ? single : 1));
+
+close:
+	cpcap_close(dev);
+
+	return error;
+}
+
+/*
+ * Prints the percentiles for each block and op that was used, and the
+ * registers with errors.
+ */
+static void cpcap_stats_print(const struct cpcap_stats *stats, FILE *fp)
+{
+	const struct cpcap_hist *h;
+	int block, op, i;
+
+	fprintf(fp, "%-10s %-5s %10s %7s %9s %9s %9s %9s\n", "block", "op",
+		"count", "errors", "p50 us", "p90 us", "p99 us", "max us");
+
+	for (block = 0; block < CPCAP_NUM_BLOCKS; block++) {
+		for (op = 0; op < CPCAP_STATS_OPS; op++) {
+			h = &stats->hist[block][op];
+			if (!h->count)
+				continue;
+			fprintf(fp, "%-10s %-5s %10llu %7u %9.2f %9.2f "
+				"%9.2f %9.2f\n", cpcap_block_name(block),
+				cpcap_stats_op_names[op], h->count,
+				stats->block_errors[block],
+				cpcap_hist_percentile(h, 50) / 1e3,
+				cpcap_hist_percentile(h, 90) / 1e3,
+				cpcap_hist_percentile(h, 99) / 1e3,
+				h->max / 1e3);
+		}
+	}
+
+	for (i = 0; i < CPCAP_NUM_REG_CPCAP; i++) {
+		if (stats->reg_errors[i])
+			fprintf(fp, "CPCAP register%i 0x%04x: %u errors\n", i,
+				cpcap_register_info_tbl[i].address * 4,
+				stats->reg_errors[i]);
+	}
+
+	for (i = 0; i < CPCAP_NUM_GROUPS; i++) {
+		if (stats->group_reads[i])
+			fprintf(fp, "CPCAP group %s: %llu reads, "
+				"%llu re-reads\n", cpcap_group_tbl[i].name,
+				stats->group_reads[i], stats->group_retries[i]);
+	}
+}
+
+/*
+ * Same as cpcap_stats_print() as JSON, with times in nanoseconds.
+ */
+static void cpcap_stats_json(const struct cpcap_stats *stats, FILE *fp)
+{
+	const struct cpcap_hist *h;
+	int block, op, i, first = 1;
+
+	fprintf(fp, "{\"blocks\": [");
+	for (block = 0; block < CPCAP_NUM_BLOCKS; block++) {
+		fprintf(fp, "%s\n  {\"name\": \"%s\", \"errors\": %u",
+			block ? "," : "", cpcap_block_name(block),
+			stats->block_errors[block]);
+		for (op = 0; op < CPCAP_STATS_OPS; op++) {
+			h = &stats->hist[block][op];
+			fprintf(fp, ", \"%s\": {\"count\": %llu, "
+				"\"mean_ns\": %llu, \"p50_ns\": %llu, "
+				"\"p90_ns\": %llu, \"p99_ns\": %llu, "
+				"\"max_ns\": %llu}",
+				cpcap_stats_op_names[op], h->count,
+				h->count ? h->sum / h->count : 0,
+				cpcap_hist_percentile(h, 50),
+				cpcap_hist_percentile(h, 90),
+				cpcap_hist_percentile(h, 99), h->max);
+		}
+		fprintf(fp, "}");
+	}
+
+	fprintf(fp, "\n],\n\"register_errors\": [");
+	for (i = 0; i < CPCAP_NUM_REG_CPCAP; i++) {
+		if (!stats->reg_errors[i])
+			continue;
+		fprintf(fp, "%s\n  {\"index\": %i, \"offset\": %i, "
+			"\"errors\": %u}", first ? "" : ",", i,
+			cpcap_register_info_tbl[i].address * 4,
+			stats->reg_errors[i]);
+		first = 0;
 	}
 
-	printf("CPCAP register%i 0x%04x=0x%04x\n",
-	       index, reg_offset, reg.value);
+	fprintf(fp, "\n],\n\"groups\": [");
+	for (i = 0; i < CPCAP_NUM_GROUPS; i++) {
+		fprintf(fp, "%s\n  {\"name\": \"%s\", \"reads\": %llu, "
+			"\"retries\": %llu}", i ? "," : "",
+			cpcap_group_tbl[i].name, stats->group_reads[i],
+			stats->group_retries[i]);
+	}
+	fprintf(fp, "\n]}\n");
+}
+
+static int cpcap_stats_report(const struct cpcap_stats *stats,
+			      const char *json)
+{
+	FILE *fp;
+	int error;
+
+	fflush(stdout);
+	if (!json) {
+		cpcap_stats_print(stats, stderr);
+		return 0;
+	}
+
+	if (!strcmp(json, "-")) {
+		cpcap_stats_json(stats, stdout);
+		return 0;
+	}
 
-	*val = reg.value;
+	fp = fopen(json, "w");
+	if (!fp) {
+		error = -errno;
+		fprintf(stderr, "Could not open %s: %i\n", json, error);
+		return error;
+	}
+	cpcap_stats_json(stats, fp);
+	fclose(fp);
 
 	return 0;
 }
 
-static int cpcap_write(int fd, int value, int reg_offset)
+#define CPCAP_BENCH_STATS_READS	10000000
+
+/*
+ * Measures the cost of the statistics with the sim backend where the
+ * read itself costs next to nothing.
+ */
+static int cpcap_bench_stats(void)
 {
-	struct cpcap_regacc reg;
-	int index, error, tmp;
+	static struct cpcap_stats stats;
+	unsigned long long start, off, on;
+	struct cpcap_dev *dev;
+	unsigned short val;
+	int i, error;
 
-	index = cpcap_init_regwrite(&reg, reg_offset);
-	if (index < 0)
-		return index;
+	error = cpcap_open(&dev, "sim", NULL);
+	if (error)
+		return error;
 
-	reg.value = value;
+	start = cpcap_nsecs();
+	for (i = 0; i < CPCAP_BENCH_STATS_READS; i++)
+		cpcap_read_index(dev, i % CPCAP_NUM_REG_CPCAP, &val);
+	off = cpcap_nsecs() - start;
 
-	/* For write to work, see README for chcon usage */
-	error = ioctl(fd, CPCAP_IOCTL_TEST_WRITE_REG, &reg);
-	if (error < 0) {
-		fprintf(stderr, "write ioctl failed: %i\n", error);
+	cpcap_stats_enable(dev, &stats);
+	start = cpcap_nsecs();
+	for (i = 0; i < CPCAP_BENCH_STATS_READS; i++)
+		cpcap_read_index(dev, i % CPCAP_NUM_REG_CPCAP, &val);
+	on = cpcap_nsecs() - start;
+	cpcap_stats_enable(dev, NULL);
+
+	printf("stats disabled: %.2f ns/read\n",
+	       (double)off / CPCAP_BENCH_STATS_READS);
+	printf("stats enabled:  %.2f ns/read\n",
+	       (double)on / CPCAP_BENCH_STATS_READS);
+
+	cpcap_close(dev);
+
+	return 0;
+}
+
+#define CPCAP_BENCH_GROUP_READS	20000
 
+/*
+ * Compares reading each group with a plain cpcap_readv() to
+ * cpcap_read_group(), and gives the share of readings that are read
+ * again and the mean cost of a read when the low register could have
+ * any value: the readv plus the re-reads, found by going through all
+ * the low register values with the upper registers as read. Only
+ * reads, so it can run on a device.
+ */
+static int cpcap_bench_groups(const char *backend)
+{
+	unsigned short vals[CPCAP_GROUP_REGS];
+	unsigned long long start, plain, grouped, sweep, retries;
+	const struct cpcap_group *g;
+	struct cpcap_dev *dev;
+	int group, i, n, error;
+
+	error = cpcap_open(&dev, backend, NULL);
+	if (error) {
+		fprintf(stderr, "could not open %s: %i\n", backend, error);
 		return error;
 	}
 
-	error = cpcap_read(fd, reg_offset, &tmp);
+	printf("%-5s %4s %10s %10s %10s %10s\n", "group", "regs",
+	       "readv ns", "group ns", "re-read %", "mean ns");
+
+	for (group = 0; group < CPCAP_NUM_GROUPS; group++) {
+		g = &cpcap_group_tbl[group];
+		error = 0;
+
+		start = cpcap_nsecs();
+		for (i = 0; i < CPCAP_BENCH_GROUP_READS && !error; i++)
+			error = cpcap_readv(dev, g->offsets, vals, g->n);
+		plain = cpcap_nsecs() - start;
+
+		start = cpcap_nsecs();
+		for (i = 0; i < CPCAP_BENCH_GROUP_READS && error >= 0; i++)
+			error = cpcap_read_group(dev, group, vals, 0);
+		grouped = cpcap_nsecs() - start;
+		if (error < 0)
+			break;
+
+		retries = 0;
+		n = g->masks[0] + 1;
+		start = cpcap_nsecs();
+		for (i = 0; i < n; i++) {
+			vals[0] = i;
+			error = cpcap_read_group(dev, group, vals, 1);
+			if (error < 0)
+				break;
+			retries += error;
+		}
+		sweep = cpcap_nsecs() - start;
+		if (error < 0)
+			break;
+
+		printf("%-5s %4i %10.1f %10.1f %10.2f %10.1f\n", g->name,
+		       g->n, (double)plain / CPCAP_BENCH_GROUP_READS,
+		       (double)grouped / CPCAP_BENCH_GROUP_READS,
+		       100.0 * retries / n, (double)plain /
+		       CPCAP_BENCH_GROUP_READS + (double)sweep / n);
+	}
+
+	if (error < 0)
+		fprintf(stderr, "read failed: %i\n", error);
+	cpcap_close(dev);
+
+	return error < 0 ? error : 0;
+}
+
+#define CPCAP_SUITE_READS	20000
+#define CPCAP_SUITE_DUMPS	200
+#define CPCAP_SUITE_WATCH	1000
+
+static const unsigned short cpcap_suite_offsets[] = {
+	0x0a0c, 0x0a10, 0x0a14, 0x0a18, 0x0c08, 0x0e04, 0x100c, 0x1010,
+};
+
+#define CPCAP_SUITE_NOFFSETS \
+	(sizeof(cpcap_suite_offsets) / sizeof(cpcap_suite_offsets[0]))
+#define CPCAP_SUITE_NBATCH	5
+
+/*
+ * Formats the batch ops from the current register values so that the
+ * set, clear and field writes leave the hardware as it was.
+ */
+static int cpcap_suite_batch(struct cpcap_dev *dev,
+			     char ops[CPCAP_SUITE_NBATCH][32])
+{
+	unsigned short usbc2, redc;
+	int error;
+
+	error = cpcap_read_reg(dev, 0x0e04, &usbc2);
+	if (error < 0)
+		return error;
+	error = cpcap_read_reg(dev, 0x100c, &redc);
 	if (error < 0)
 		return error;
 
+	snprintf(ops[0], sizeof(ops[0]), "0x0a14");
+	snprintf(ops[1], sizeof(ops[1]), "0x0a18");
+	snprintf(ops[2], sizeof(ops[2]), "0x0e04|=%04x", usbc2);
+	snprintf(ops[3], sizeof(ops[3]), "0x0e04&=ffff");
+	snprintf(ops[4], sizeof(ops[4]), "0x100c:3-0=%x", redc & 0xf);
+
 	return 0;
 }
 
+static void cpcap_suite_result(const char *name, unsigned long long ops,
+			       unsigned long long ns, int *first)
+{
+	printf("%s\n    {\"name\": \"%s\", \"ops\": %llu, \"ns_per_op\": %.1f, "
+	       "\"ops_per_s\": %.1f}", *first ? "" : ",", name, ops,
+	       (double)ns / ops, ops * 1e9 / (ns ? ns : 1));
+	*first = 0;
+}
+
+/*
+ * Runs the read, write, dump, batch and watch workloads and prints the
+ * results as JSON. Writes, including the batch set, clear and field
+ * ops, only write back the value just read. Meant for the sim backend
+ * or the ioctl backend with libcpcapsim.so preloaded, see make bench.
+ */
+static int cpcap_bench_suite(const char *backend)
+{
+	unsigned long long start, elapsed;
+	char ops[CPCAP_SUITE_NBATCH][32];
+	struct cpcap_batch batch;
+	struct cpcap_watch *w;
+	struct cpcap_dev *dev;
+	unsigned short val;
+	int i, error, out, null, first = 1;
+
+	error = cpcap_open(&dev, backend, NULL);
+	if (error) {
+		fprintf(stderr, "Could not open %s backend: %i\n", backend,
+			error);
+		return error;
+	}
+
+	w = calloc(1, sizeof(*w));
+	null = open("/dev/null", O_WRONLY);
+	out = dup(STDOUT_FILENO);
+	if (!w || null < 0 || out < 0) {
+		error = -ENOMEM;
+		goto close;
+	}
+
+	printf("{\"backend\": \"%s\", \"results\": [", backend);
+
+	start = cpcap_nsecs();
+	for (i = 0; i < CPCAP_SUITE_READS; i++) {
+		error = cpcap_read_reg(dev, cpcap_suite_offsets[i %
+				       CPCAP_SUITE_NOFFSETS], &val);
+		if (error < 0)
+			goto close;
+	}
+	cpcap_suite_result("read", i, cpcap_nsecs() - start, &first);
+
+	error = cpcap_read_reg(dev, cpcap_suite_offsets[0], &val);
+	if (error < 0)
+		goto close;
+	start = cpcap_nsecs();
+	for (i = 0; i < CPCAP_SUITE_READS; i++) {
+		error = cpcap_write_reg(dev, cpcap_suite_offsets[0], val,
+					0xffff);
+		if (error < 0)
+			goto close;
+	}
+	cpcap_suite_result("write", i, cpcap_nsecs() - start, &first);
+
+	/* The dump and batch output goes to /dev/null */
+	error = 0;
+	fflush(stdout);
+	dup2(null, STDOUT_FILENO);
+
+	start = cpcap_nsecs();
+	for (i = 0; i < CPCAP_SUITE_DUMPS && !error; i++)
+		error = cpcap_dump_all(dev, 0, 0);
+	elapsed = cpcap_nsecs() - start;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.dev = dev;
+	if (!error)
+		error = cpcap_suite_batch(dev, ops);
+	start = cpcap_nsecs();
+	for (i = 0; i < CPCAP_SUITE_READS && !error; i++)
+		cpcap_batch_op(&batch, ops[i % CPCAP_SUITE_NBATCH]);
+
+	fflush(stdout);
+	dup2(out, STDOUT_FILENO);
+	cpcap_suite_result("dump", CPCAP_SUITE_DUMPS, elapsed, &first);
+	cpcap_suite_result("batch", batch.ops, cpcap_nsecs() - start, &first);
+	if (error || batch.error) {
+		error = error ? error : batch.error;
+		goto close;
+	}
+
+	w->dev = dev;
+	w->period = 1000000;
+	w->count = CPCAP_SUITE_WATCH;
+	w->out_fd = null;
+	error = cpcap_watch_parse_regs(w, "0x0a0c,0x0a10,0x0a14,0x0a18");
+	if (!error)
+		error = cpcap_watch(w);
+
+	printf("\n  ],\n  \"watch\": {\"samples\": %llu, \"rate_hz\": %.1f, "
+	       "\"requested_hz\": %.1f, \"jitter_mean_us\": %.1f, "
+	       "\"jitter_max_us\": %.1f, \"missed\": %llu}\n}\n",
+	       w->samples, w->rate, 1e9 / w->period, w->jitter_mean / 1e3,
+	       w->jitter_max / 1e3, w->missed);
+
+close:
+	if (error)
+		fprintf(stderr, "benchmark failed: %i\n", error);
+	if (out >= 0)
+		close(out);
+	if (null >= 0)
+		close(null);
+	free(w);
+	cpcap_close(dev);
+
+	return error;
+}
+
+static int cpcap_bench(const char *name, const char *arg)
+{
+	if (!strcmp(name, "lookup"))
+		return cpcap_bench_lookup();
+
+	if (!strcmp(name, "capture"))
+		return cpcap_bench_capture(arg ? strtoull(arg, NULL, 10) :
+					   1000000);
+
+	if (!strcmp(name, "suite"))
+		return cpcap_bench_suite(arg ? arg : "sim");
+
+	if (!strcmp(name, "stats"))
+		return cpcap_bench_stats();
+
+	if (!strcmp(name, "groups"))
+		return cpcap_bench_groups(arg ? arg : "sim");
+
+	if (!strcmp(name, "exec"))
+		return cpcap_bench_exec(arg ? atoi(arg) : 1000);
+
+	fprintf(stderr, "unknown benchmark: %s\n", name);
+
+	return -EINVAL;
+}
+
+static void cpcap_usage(const char *name)
+{
+	printf("usage: %s [options] [-f file|-] [--all|offset[=value]]...\n"
+	       "       %s [options] --serve unix:path|[tcp:][host:]port\n"
+	       "       %s [options] --export unix:path|[tcp:][host:]port\n"
+	       "              [--watch metric[@hz][,metric...]] "
+	       "[--period us]\n"
+	       "       %s [options] --watch offset[,offset...] [--period us] "
+	       "[--count n]\n"
+	       "              [--changes-only] [--adaptive] "
+	       "[--capture file [--compress]]\n"
+	       "              [--trigger expr]... [--pre n] [--post n] "
+	       "[--holdoff ms]\n"
+	       "       %s [options] --power [--period us] [--interval s] "
+	       "[--count n]\n"
+	       "              [--cc-lsb uAms] [--cc-offset n]\n"
+	       "       %s --power-replay file [--interval s] [--cc-lsb uAms] "
+	       "[--cc-offset n]\n"
+	       "       %s [options] --adc channel[,channel...] [--count n]\n"
+	       "       %s [options] --irq [--ack] [--all-bits] [--period us] "
+	       "[--count n]\n"
+	       "       %s [options] --play file [--priority n] [--dry-run]\n"
+	       "       %s [options] --snapshot file\n"
+	       "       %s [options] --diff file [--all-bits]\n"
+	       "       %s [options] --restore file [--dry-run]\n"
+	       "       %s --decode file [--format csv|debugfs|text]\n"
+	       "       %s --query file[,file...] --where offset[&mask][=value] "
+	       "[--from s] [--to s]\n"
+	       "              [--threads n]\n"
+	       "       %s --collect address[,address...]|@file "
+	       "[--watch offset[,offset...]]\n"
+	       "              [--period us] [--count n]\n"
+	       "       %s --loadgen address [--requests n] [--depth n] "
+	       "[--dump]\n"
+	       "       %s --bench lookup|capture [samples]|exec [reads]|stats\n"
+	       "       %s --bench suite|groups [backend]\n",
+	       name, name, name, name, name, name, name, name, name, name,
+	       name, name, name, name, name, name, name, name);
+	printf("\noptions:\n"
+	       "  --backend ioctl|regmap|sim  register access, default ioctl\n"
+	       "  --device path               device or regmap debugfs file\n"
+	       "  --sim                       same as --backend sim\n"
+	       "  --sparse                    only list real registers for "
+	       "--all\n"
+	       "  --verify                    read back and check writes\n"
+	       "  --fields                    decode register fields\n"
+	       "  --cache                     cache registers that do not "
+	       "change often\n"
+	       "  --stats                     print register access times "
+	       "per block at exit\n"
+	       "  --stats-json file|-         same as JSON to a file\n");
+	printf("\nThe --watch period is in microseconds, default 10000. "
+	       "Use offset@hz for\nregisters with their own rate.\n");
+	printf("Note that offsets are not contiguous. Registers can also be "
+	       "given by name,\nlike VERSC1 or CPCAP_REG_S1C1.\n");
+	printf("The counters that span registers are read whole as sw, tod, "
+	       "ccs or cca.\n");
+	printf("Writes are offset=value, offset&=mask, offset|=bits or "
+	       "offset:hi-lo=value.\n");
+	printf("With more than one operation, or with -f, the status and time "
+	       "of each\noperation and a summary are printed to stderr.\n");
+}
+
 int main(int argc, char *argv[])
 {
-	const char *file_name = "/dev/cpcap";
-	const char delimiters[] = "=";
-	char *running, *token;
-	int offset, val = -1;
-	int error, fd;
+	const char *serve = NULL, *loadgen = NULL, *decode = NULL;
+	const char *format = NULL, *snapshot = NULL, *diff = NULL;
+	const char *restore = NULL, *stats_json = NULL, *adc = NULL;
+	const char *play = NULL, *collect = NULL, *query = NULL;
+	const char *export = NULL;
+	static struct cpcap_stats stats;
+	static struct cpcap_cache cache;
+	struct cpcap_watch_args watch = {
+		.period_us = 10000, .pre = 100, .post = 100,
+	};
+	struct cpcap_power_args power = {
+		.interval_s = 60, .lsb = CPCAP_CC_LSB,
+	};
+	struct cpcap_query_args qargs = { 0 };
+	const char *backend = "ioctl", *path = NULL;
+	int requests = 100000, depth = 16, op = CPCAP_OP_READ;
+	struct cpcap_batch batch;
+	struct cpcap_dev *dev;
+	int i, error, nargs = 0, script = 0, all_bits = 0;
+	int dry_run = 0, show_stats = 0, use_cache = 0, do_power = 0;
+	int priority = 50, irq = 0, ack = 0, period_set = 0;
+	unsigned long long start;
+	char **args;
 
 	if (argc < 2) {
-		printf("usage: %s [--all|offset[=value]]\n", argv[0]);
-		printf("\nNote that offsets are not contiguous.\n");
+		cpcap_usage(argv[0]);
 		return -EINVAL;
 	}
 
-	fd = open(file_name, O_RDWR);
-	if (fd == -1) {
-		fprintf(stderr, "Could not open %s: %i\n",
-			file_name, fd);
-		error = fd;
-		return fd;
+	if (!strcmp(argv[1], "--bench"))
+		return cpcap_bench(argc > 2 ? argv[2] : "lookup",
+				   argc > 3 ? argv[3] : NULL);
+
+	memset(&batch, 0, sizeof(batch));
+
+	/* Operations and -f scripts in command line order */
+	args = calloc(argc, sizeof(*args));
+	if (!args)
+		return -ENOMEM;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--sparse")) {
+			batch.sparse = 1;
+		} else if (!strcmp(argv[i], "--verify")) {
+			batch.verify = 1;
+		} else if (!strcmp(argv[i], "--fields")) {
+			batch.fields = 1;
+		} else if (!strcmp(argv[i], "--sim")) {
+			backend = "sim";
+		} else if (!strcmp(argv[i], "--dump")) {
+			op = CPCAP_OP_DUMP;
+		} else if (!strcmp(argv[i], "--compress")) {
+			watch.compress = 1;
+		} else if (!strcmp(argv[i], "--changes-only")) {
+			watch.changes_only = 1;
+		} else if (!strcmp(argv[i], "--adaptive")) {
+			watch.adaptive = 1;
+		} else if (!strcmp(argv[i], "--all-bits")) {
+			all_bits = 1;
+		} else if (!strcmp(argv[i], "--dry-run")) {
+			dry_run = 1;
+		} else if (!strcmp(argv[i], "--stats")) {
+			show_stats = 1;
+		} else if (!strcmp(argv[i], "--cache")) {
+			use_cache = 1;
+		} else if (!strcmp(argv[i], "--power")) {
+			do_power = 1;
+		} else if (!strcmp(argv[i], "--irq")) {
+			irq = 1;
+		} else if (!strcmp(argv[i], "--ack")) {
+			ack = 1;
+		} else if (!strcmp(argv[i], "-f") ||
+			   !strcmp(argv[i], "--backend") ||
+			   !strcmp(argv[i], "--device") ||
+			   !strcmp(argv[i], "--serve") ||
+			   !strcmp(argv[i], "--export") ||
+			   !strcmp(argv[i], "--loadgen") ||
+			   !strcmp(argv[i], "--watch") ||
+			   !strcmp(argv[i], "--period") ||
+			   !strcmp(argv[i], "--count") ||
+			   !strcmp(argv[i], "--trigger") ||
+			   !strcmp(argv[i], "--pre") ||
+			   !strcmp(argv[i], "--post") ||
+			   !strcmp(argv[i], "--holdoff") ||
+			   !strcmp(argv[i], "--power-replay") ||
+			   !strcmp(argv[i], "--interval") ||
+			   !strcmp(argv[i], "--cc-lsb") ||
+			   !strcmp(argv[i], "--cc-offset") ||
+			   !strcmp(argv[i], "--adc") ||
+			   !strcmp(argv[i], "--play") ||
+			   !strcmp(argv[i], "--collect") ||
+			   !strcmp(argv[i], "--query") ||
+			   !strcmp(argv[i], "--where") ||
+			   !strcmp(argv[i], "--from") ||
+			   !strcmp(argv[i], "--to") ||
+			   !strcmp(argv[i], "--threads") ||
+			   !strcmp(argv[i], "--priority") ||
+			   !strcmp(argv[i], "--capture") ||
+			   !strcmp(argv[i], "--decode") ||
+			   !strcmp(argv[i], "--format") ||
+			   !strcmp(argv[i], "--snapshot") ||
+			   !strcmp(argv[i], "--diff") ||
+			   !strcmp(argv[i], "--restore") ||
+			   !strcmp(argv[i], "--stats-json") ||
+			   !strcmp(argv[i], "--requests") ||
+			   !strcmp(argv[i], "--depth")) {
+			if (i + 1 >= argc) {
+				cpcap_usage(argv[0]);
+				free(args);
+				return -EINVAL;
+			}
+			if (!strcmp(argv[i], "-f")) {
+				args[nargs++] = argv[i];
+				args[nargs++] = argv[i + 1];
+				script = 1;
+			} else if (!strcmp(argv[i], "--backend")) {
+				backend = argv[i + 1];
+			} else if (!strcmp(argv[i], "--device")) {
+				path = argv[i + 1];
+			} else if (!strcmp(argv[i], "--serve")) {
+				serve = argv[i + 1];
+			} else if (!strcmp(argv[i], "--export")) {
+				export = argv[i + 1];
+			} else if (!strcmp(argv[i], "--loadgen")) {
+				loadgen = argv[i + 1];
+			} else if (!strcmp(argv[i], "--watch")) {
+				watch.regs = argv[i + 1];
+			} else if (!strcmp(argv[i], "--period")) {
+				watch.period_us = strtoull(argv[i + 1], NULL, 10);
+				power.period_us = watch.period_us;
+				period_set = 1;
+			} else if (!strcmp(argv[i], "--count")) {
+				watch.count = strtoull(argv[i + 1], NULL, 10);
+				power.count = watch.count;
+			} else if (!strcmp(argv[i], "--trigger")) {
+				if (watch.ntriggers >= CPCAP_WATCH_MAX_TRIGGERS) {
+					fprintf(stderr, "too many triggers\n");
+					free(args);
+					return -EINVAL;
+				}
+				watch.triggers[watch.ntriggers++] = argv[i + 1];
+			} else if (!strcmp(argv[i], "--pre")) {
+				watch.pre = strtoul(argv[i + 1], NULL, 10);
+			} else if (!strcmp(argv[i], "--post")) {
+				watch.post = strtoul(argv[i + 1], NULL, 10);
+			} else if (!strcmp(argv[i], "--holdoff")) {
+				watch.holdoff_ms = strtoull(argv[i + 1], NULL, 10);
+			} else if (!strcmp(argv[i], "--power-replay")) {
+				power.replay = argv[i + 1];
+			} else if (!strcmp(argv[i], "--interval")) {
+				power.interval_s = strtoull(argv[i + 1], NULL, 10);
+			} else if (!strcmp(argv[i], "--cc-lsb")) {
+				power.lsb = strtoll(argv[i + 1], NULL, 10);
+			} else if (!strcmp(argv[i], "--cc-offset")) {
+				power.offset = strtol(argv[i + 1], NULL, 0);
+				power.have_offset = 1;
+			} else if (!strcmp(argv[i], "--adc")) {
+				adc = argv[i + 1];
+			} else if (!strcmp(argv[i], "--collect")) {
+				collect = argv[i + 1];
+			} else if (!strcmp(argv[i], "--query")) {
+				query = argv[i + 1];
+			} else if (!strcmp(argv[i], "--where")) {
+				qargs.where = argv[i + 1];
+			} else if (!strcmp(argv[i], "--from")) {
+				qargs.from = strtod(argv[i + 1], NULL);
+			} else if (!strcmp(argv[i], "--to")) {
+				qargs.to = strtod(argv[i + 1], NULL);
+			} else if (!strcmp(argv[i], "--threads")) {
+				qargs.threads = atoi(argv[i + 1]);
+			} else if (!strcmp(argv[i], "--play")) {
+				play = argv[i + 1];
+			} else if (!strcmp(argv[i], "--priority")) {
+				priority = atoi(argv[i + 1]);
+			} else if (!strcmp(argv[i], "--capture")) {
+				watch.capture = argv[i + 1];
+			} else if (!strcmp(argv[i], "--decode")) {
+				decode = argv[i + 1];
+			} else if (!strcmp(argv[i], "--format")) {
+				format = argv[i + 1];
+			} else if (!strcmp(argv[i], "--snapshot")) {
+				snapshot = argv[i + 1];
+			} else if (!strcmp(argv[i], "--diff")) {
+				diff = argv[i + 1];
+			} else if (!strcmp(argv[i], "--restore")) {
+				restore = argv[i + 1];
+			} else if (!strcmp(argv[i], "--stats-json")) {
+				stats_json = argv[i + 1];
+				show_stats = 1;
+			} else if (!strcmp(argv[i], "--requests")) {
+				requests = atoi(argv[i + 1]);
+			} else {
+				depth = atoi(argv[i + 1]);
+			}
+			i++;
+		} else {
+			args[nargs++] = argv[i];
+		}
+	}
+	batch.verbose = script || nargs > 1;
+
+	if (loadgen) {
+		error = cpcap_loadgen(loadgen, requests, depth, op);
+		goto free;
+	}
+
+	if (decode) {
+		error = cpcap_decode_run(decode, format);
+		goto free;
+	}
+
+	if (power.replay) {
+		error = cpcap_power_run(NULL, &power);
+		goto free;
+	}
+
+	if (query) {
+		error = cpcap_query_run(query, &qargs);
+		goto free;
+	}
+
+	if (collect) {
+		error = cpcap_collect(collect, &watch);
+		goto free;
+	}
+
+	error = cpcap_open(&dev, backend, path);
+	if (error == -EINVAL) {
+		fprintf(stderr, "unknown backend: %s\n", backend);
+		goto free;
+	}
+	if (error) {
+		fprintf(stderr, "Could not open %s%s: %i\n",
+			path ? path : backend, path ? "" : " backend", error);
+		goto free;
+	}
+	batch.dev = dev;
+
+	if (show_stats || export)
+		cpcap_stats_enable(dev, &stats);
+	if (use_cache) {
+		cpcap_cache_init(&cache);
+		cpcap_cache_enable(dev, &cache);
 	}
 
-	running = malloc(strlen(argv[1] + 1));
-	strncpy(running, argv[1], strlen(argv[1]));
+	if (serve) {
+		error = cpcap_serve(dev, serve);
+		goto close;
+	}
 
-	if (!strncmp("--all", running, 5)) {
-		error = cpcap_dump_all(fd);
+	if (export) {
+		error = cpcap_export_run(dev, export, watch.regs, period_set ?
+					 watch.period_us * 1000 :
+					 CPCAP_EXPORT_PERIOD_NS, &stats);
 		goto close;
 	}
 
-	token = strsep(&running, delimiters);
-	if (token) {
-		offset = strtol(token, NULL, 16);
+	if (watch.regs) {
+		error = cpcap_watch_run(dev, &watch);
+		goto close;
+	}
 
-		token = strsep(&running, delimiters);
-		if (token)
-			val = strtol(token, NULL, 16);
-	} else {
-		offset = strtol(argv[1], NULL, 16);
+	if (do_power) {
+		error = cpcap_power_run(dev, &power);
+		goto close;
 	}
 
+	if (adc) {
+		error = cpcap_adc_run(dev, adc, watch.count);
+		goto close;
+	}
 
-	if (val < 0)
-		error = cpcap_read(fd, offset, &val);
-	else
-		error = cpcap_write(fd, val, offset);
-	if (error)
+	if (play) {
+		error = cpcap_seq_run(dev, play, priority, dry_run);
+		goto close;
+	}
+
+	if (irq) {
+		error = cpcap_irq_run(dev, period_set ? watch.period_us * 1000 :
+				      CPCAP_IRQ_IDLE_NS, watch.count, ack,
+				      all_bits);
+		goto close;
+	}
+
+	if (snapshot) {
+		error = cpcap_snapshot_save(dev, snapshot);
+		goto close;
+	}
+
+	if (diff) {
+		error = cpcap_diff(dev, diff, all_bits);
+		goto close;
+	}
+
+	if (restore) {
+		error = cpcap_restore(dev, restore, dry_run);
 		goto close;
+	}
+
+	start = cpcap_nsecs();
+	for (i = 0; i < nargs; i++) {
+		if (!strcmp(args[i], "-f")) {
+			error = cpcap_batch_file(&batch, args[++i]);
+			if (error && !batch.error)
+				batch.error = error;
+		} else {
+			cpcap_batch_op(&batch, args[i]);
+		}
+	}
+
+	if (batch.verbose) {
+		fflush(stdout);
+		fprintf(stderr, "%i ops, %i failed, %.1f us in ops, "
+			"%.1f us total\n", batch.ops, batch.failed,
+			batch.nsecs / 1000.0,
+			(cpcap_nsecs() - start) / 1000.0);
+	}
+	error = batch.error;
 
 close:
-	free(running);
-	close(fd);
+	if (show_stats)
+		cpcap_stats_report(&stats, stats_json);
+	if (use_cache) {
+		fflush(stdout);
+		fprintf(stderr, "cache: %llu hits, %llu misses\n",
+			cache.hits, cache.misses);
+	}
+	cpcap_close(dev);
+free:
+	free(args);
 
 	return error;
 }
@@ -0,0 +1,697 @@
+/*
+ * libcpcaprw, access CPCAP PMIC registers on Android devices
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef CPCAPRW_H
+#define CPCAPRW_H
+
+#define CPCAP_REG_MAX_OFFSET	0x7d18
+
+/*
+ * Copied from Motorola mapphone Linux kernel include/linux/spi/cpcap.h
+ */
+enum cpcap_reg {
+	CPCAP_REG_START,        /* Start of CPCAP registers. */
+
+	CPCAP_REG_INT1 = CPCAP_REG_START, /* Interrupt 1 */
+	CPCAP_REG_INT2,		/* Interrupt 2 */
+	CPCAP_REG_INT3,		/* Interrupt 3 */
+	CPCAP_REG_INT4,		/* Interrupt 4 */
+	CPCAP_REG_INTM1,	/* Interrupt Mask 1 */
+	CPCAP_REG_INTM2,	/* Interrupt Mask 2 */
+	CPCAP_REG_INTM3,	/* Interrupt Mask 3 */
+	CPCAP_REG_INTM4,	/* Interrupt Mask 4 */
+	CPCAP_REG_INTS1,	/* Interrupt Sense 1 */
+	CPCAP_REG_INTS2,	/* Interrupt Sense 2 */
+	CPCAP_REG_INTS3,	/* Interrupt Sense 3 */
+	CPCAP_REG_INTS4,	/* Interrupt Sense 4 */
+	CPCAP_REG_ASSIGN1,	/* Resource Assignment 1 */
+	CPCAP_REG_ASSIGN2,	/* Resource Assignment 2 */
+	CPCAP_REG_ASSIGN3,	/* Resource Assignment 3 */
+	CPCAP_REG_ASSIGN4,	/* Resource Assignment 4 */
+	CPCAP_REG_ASSIGN5,	/* Resource Assignment 5 */
+	CPCAP_REG_ASSIGN6,	/* Resource Assignment 6 */
+	CPCAP_REG_VERSC1,	/* Version Control 1 */
+	CPCAP_REG_VERSC2,	/* Version Control 2 */
+
+	CPCAP_REG_MI1,		/* Macro Interrupt 1 */
+	CPCAP_REG_MIM1,		/* Macro Interrupt Mask 1 */
+	CPCAP_REG_MI2,		/* Macro Interrupt 2 */
+	CPCAP_REG_MIM2,		/* Macro Interrupt Mask 2 */
+	CPCAP_REG_UCC1,		/* UC Control 1 */
+	CPCAP_REG_UCC2,		/* UC Control 2 */
+	CPCAP_REG_PC1,		/* Power Cut 1 */
+	CPCAP_REG_PC2,		/* Power Cut 2 */
+	CPCAP_REG_BPEOL,	/* BP and EOL */
+	CPCAP_REG_PGC,		/* Power Gate and Control */
+	CPCAP_REG_MT1,		/* Memory Transfer 1 */
+	CPCAP_REG_MT2,		/* Memory Transfer 2 */
+	CPCAP_REG_MT3,		/* Memory Transfer 3 */
+	CPCAP_REG_PF,		/* Print Format */
+
+	CPCAP_REG_SCC,		/* System Clock Control */
+	CPCAP_REG_SW1,		/* Stop Watch 1 */
+	CPCAP_REG_SW2,		/* Stop Watch 2 */
+	CPCAP_REG_UCTM,		/* UC Turbo Mode */
+	CPCAP_REG_TOD1,		/* Time of Day 1 */
+	CPCAP_REG_TOD2,		/* Time of Day 2 */
+	CPCAP_REG_TODA1,	/* Time of Day Alarm 1 */
+	CPCAP_REG_TODA2,	/* Time of Day Alarm 2 */
+	CPCAP_REG_DAY,		/* Day */
+	CPCAP_REG_DAYA,		/* Day Alarm */
+	CPCAP_REG_VAL1,		/* Validity 1 */
+	CPCAP_REG_VAL2,		/* Validity 2 */
+
+	CPCAP_REG_SDVSPLL,	/* Switcher DVS and PLL */
+	CPCAP_REG_SI2CC1,	/* Switcher I2C Control 1 */
+	CPCAP_REG_Si2CC2,	/* Switcher I2C Control 2 */
+	CPCAP_REG_S1C1,	        /* Switcher 1 Control 1 */
+	CPCAP_REG_S1C2,	        /* Switcher 1 Control 2 */
+	CPCAP_REG_S2C1,	        /* Switcher 2 Control 1 */
+	CPCAP_REG_S2C2,	        /* Switcher 2 Control 2 */
+	CPCAP_REG_S3C,	        /* Switcher 3 Control */
+	CPCAP_REG_S4C1,	        /* Switcher 4 Control 1 */
+	CPCAP_REG_S4C2,	        /* Switcher 4 Control 2 */
+	CPCAP_REG_S5C,	        /* Switcher 5 Control */
+	CPCAP_REG_S6C,	        /* Switcher 6 Control */
+	CPCAP_REG_VCAMC,	/* VCAM Control */
+	CPCAP_REG_VCSIC,	/* VCSI Control */
+	CPCAP_REG_VDACC,	/* VDAC Control */
+	CPCAP_REG_VDIGC,	/* VDIG Control */
+	CPCAP_REG_VFUSEC,	/* VFUSE Control */
+	CPCAP_REG_VHVIOC,	/* VHVIO Control */
+	CPCAP_REG_VSDIOC,	/* VSDIO Control */
+	CPCAP_REG_VPLLC,	/* VPLL Control */
+	CPCAP_REG_VRF1C,	/* VRF1 Control */
+	CPCAP_REG_VRF2C,	/* VRF2 Control */
+	CPCAP_REG_VRFREFC,	/* VRFREF Control */
+	CPCAP_REG_VWLAN1C,	/* VWLAN1 Control */
+	CPCAP_REG_VWLAN2C,	/* VWLAN2 Control */
+	CPCAP_REG_VSIMC,	/* VSIM Control */
+	CPCAP_REG_VVIBC,	/* VVIB Control */
+	CPCAP_REG_VUSBC,	/* VUSB Control */
+	CPCAP_REG_VUSBINT1C,	/* VUSBINT1 Control */
+	CPCAP_REG_VUSBINT2C,	/* VUSBINT2 Control */
+	CPCAP_REG_URT,		/* Useroff Regulator Trigger */
+	CPCAP_REG_URM1,		/* Useroff Regulator Mask 1 */
+	CPCAP_REG_URM2,		/* Useroff Regulator Mask 2 */
+
+	CPCAP_REG_VAUDIOC,	/* VAUDIO Control */
+	CPCAP_REG_CC,		/* Codec Control */
+	CPCAP_REG_CDI,		/* Codec Digital Interface */
+	CPCAP_REG_SDAC,		/* Stereo DAC */
+	CPCAP_REG_SDACDI,	/* Stereo DAC Digital Interface */
+	CPCAP_REG_TXI,		/* TX Inputs */
+	CPCAP_REG_TXMP,		/* TX MIC PGA's */
+	CPCAP_REG_RXOA,		/* RX Output Amplifiers */
+	CPCAP_REG_RXVC,		/* RX Volume Control */
+	CPCAP_REG_RXCOA,	/* RX Codec to Output Amps */
+	CPCAP_REG_RXSDOA,	/* RX Stereo DAC to Output Amps */
+	CPCAP_REG_RXEPOA,	/* RX External PGA to Output Amps */
+	CPCAP_REG_RXLL,		/* RX Low Latency */
+	CPCAP_REG_A2LA,		/* A2 Loudspeaker Amplifier */
+	CPCAP_REG_MIPIS1,	/* MIPI Slimbus 1 */
+	CPCAP_REG_MIPIS2,	/* MIPI Slimbus 2 */
+	CPCAP_REG_MIPIS3,	/* MIPI Slimbus 3. */
+	CPCAP_REG_LVAB,		/* LMR Volume and A4 Balanced. */
+
+	CPCAP_REG_CCC1,		/* Coulomb Counter Control 1 */
+	CPCAP_REG_CRM,		/* Charger and Reverse Mode */
+	CPCAP_REG_CCCC2,	/* Coincell and Coulomb Ctr Ctrl 2 */
+	CPCAP_REG_CCS1,		/* Coulomb Counter Sample 1 */
+	CPCAP_REG_CCS2,		/* Coulomb Counter Sample 2 */
+	CPCAP_REG_CCA1,		/* Coulomb Counter Accumulator 1 */
+	CPCAP_REG_CCA2,		/* Coulomb Counter Accumulator 2 */
+	CPCAP_REG_CCM,		/* Coulomb Counter Mode */
+	CPCAP_REG_CCO,		/* Coulomb Counter Offset */
+	CPCAP_REG_CCI,		/* Coulomb Counter Integrator */
+
+	CPCAP_REG_ADCC1,	/* A/D Converter Configuration 1 */
+	CPCAP_REG_ADCC2,	/* A/D Converter Configuration 2 */
+	CPCAP_REG_ADCD0,	/* A/D Converter Data 0 */
+	CPCAP_REG_ADCD1,	/* A/D Converter Data 1 */
+	CPCAP_REG_ADCD2,	/* A/D Converter Data 2 */
+	CPCAP_REG_ADCD3,	/* A/D Converter Data 3 */
+	CPCAP_REG_ADCD4,	/* A/D Converter Data 4 */
+	CPCAP_REG_ADCD5,	/* A/D Converter Data 5 */
+	CPCAP_REG_ADCD6,	/* A/D Converter Data 6 */
+	CPCAP_REG_ADCD7,	/* A/D Converter Data 7 */
+	CPCAP_REG_ADCAL1,	/* A/D Converter Calibration 1 */
+	CPCAP_REG_ADCAL2,	/* A/D Converter Calibration 2 */
+
+	CPCAP_REG_USBC1,	/* USB Control 1 */
+	CPCAP_REG_USBC2,	/* USB Control 2 */
+	CPCAP_REG_USBC3,	/* USB Control 3 */
+	CPCAP_REG_UVIDL,	/* ULPI Vendor ID Low */
+	CPCAP_REG_UVIDH,	/* ULPI Vendor ID High */
+	CPCAP_REG_UPIDL,	/* ULPI Product ID Low */
+	CPCAP_REG_UPIDH,	/* ULPI Product ID High */
+	CPCAP_REG_UFC1,		/* ULPI Function Control 1 */
+	CPCAP_REG_UFC2,		/* ULPI Function Control 2 */
+	CPCAP_REG_UFC3,		/* ULPI Function Control 3 */
+	CPCAP_REG_UIC1,		/* ULPI Interface Control 1 */
+	CPCAP_REG_UIC2,		/* ULPI Interface Control 2 */
+	CPCAP_REG_UIC3,		/* ULPI Interface Control 3 */
+	CPCAP_REG_USBOTG1,	/* USB OTG Control 1 */
+	CPCAP_REG_USBOTG2,	/* USB OTG Control 2 */
+	CPCAP_REG_USBOTG3,	/* USB OTG Control 3 */
+	CPCAP_REG_UIER1,	/* USB Interrupt Enable Rising 1 */
+	CPCAP_REG_UIER2,	/* USB Interrupt Enable Rising 2 */
+	CPCAP_REG_UIER3,	/* USB Interrupt Enable Rising 3 */
+	CPCAP_REG_UIEF1,	/* USB Interrupt Enable Falling 1 */
+	CPCAP_REG_UIEF2,	/* USB Interrupt Enable Falling 1 */
+	CPCAP_REG_UIEF3,	/* USB Interrupt Enable Falling 1 */
+	CPCAP_REG_UIS,		/* USB Interrupt Status */
+	CPCAP_REG_UIL,		/* USB Interrupt Latch */
+	CPCAP_REG_USBD,		/* USB Debug */
+	CPCAP_REG_SCR1,		/* Scratch 1 */
+	CPCAP_REG_SCR2,		/* Scratch 2 */
+	CPCAP_REG_SCR3,		/* Scratch 3 */
+	CPCAP_REG_VMC,		/* Video Mux Control */
+	CPCAP_REG_OWDC,		/* One Wire Device Control */
+	CPCAP_REG_GPIO0,	/* GPIO 0 Control */
+	CPCAP_REG_GPIO1,	/* GPIO 1 Control */
+	CPCAP_REG_GPIO2,	/* GPIO 2 Control */
+	CPCAP_REG_GPIO3,	/* GPIO 3 Control */
+	CPCAP_REG_GPIO4,	/* GPIO 4 Control */
+	CPCAP_REG_GPIO5,	/* GPIO 5 Control */
+	CPCAP_REG_GPIO6,	/* GPIO 6 Control */
+
+	CPCAP_REG_MDLC,		/* Main Display Lighting Control */
+	CPCAP_REG_KLC,		/* Keypad Lighting Control */
+	CPCAP_REG_ADLC,		/* Aux Display Lighting Control */
+	CPCAP_REG_REDC,		/* Red Triode Control */
+	CPCAP_REG_GREENC,	/* Green Triode Control */
+	CPCAP_REG_BLUEC,	/* Blue Triode Control */
+	CPCAP_REG_CFC,		/* Camera Flash Control */
+	CPCAP_REG_ABC,		/* Adaptive Boost Control */
+	CPCAP_REG_BLEDC,	/* Bluetooth LED Control */
+	CPCAP_REG_CLEDC,	/* Camera Privacy LED Control */
+
+	CPCAP_REG_OW1C,		/* One Wire 1 Command */
+	CPCAP_REG_OW1D,		/* One Wire 1 Data */
+	CPCAP_REG_OW1I,		/* One Wire 1 Interrupt */
+	CPCAP_REG_OW1IE,	/* One Wire 1 Interrupt Enable */
+	CPCAP_REG_OW1,		/* One Wire 1 Control */
+	CPCAP_REG_OW2C,		/* One Wire 2 Command */
+	CPCAP_REG_OW2D,		/* One Wire 2 Data */
+	CPCAP_REG_OW2I,		/* One Wire 2 Interrupt */
+	CPCAP_REG_OW2IE,	/* One Wire 2 Interrupt Enable */
+	CPCAP_REG_OW2,		/* One Wire 2 Control */
+	CPCAP_REG_OW3C,		/* One Wire 3 Command */
+	CPCAP_REG_OW3D,		/* One Wire 3 Data */
+	CPCAP_REG_OW3I,		/* One Wire 3 Interrupt */
+	CPCAP_REG_OW3IE,	/* One Wire 3 Interrupt Enable */
+	CPCAP_REG_OW3,		/* One Wire 3 Control */
+	CPCAP_REG_GCAIC,	/* GCAI Clock Control */
+	CPCAP_REG_GCAIM,	/* GCAI GPIO Mode */
+	CPCAP_REG_LGDIR,	/* LMR GCAI GPIO Direction */
+	CPCAP_REG_LGPU,		/* LMR GCAI GPIO Pull-up */
+	CPCAP_REG_LGPIN,	/* LMR GCAI GPIO Pin */
+	CPCAP_REG_LGMASK,	/* LMR GCAI GPIO Mask */
+	CPCAP_REG_LDEB,		/* LMR Debounce Settings */
+	CPCAP_REG_LGDET,	/* LMR GCAI Detach Detect */
+	CPCAP_REG_LMISC,	/* LMR Misc Bits */
+	CPCAP_REG_LMACE,	/* LMR Mace IC Support */
+	CPCAP_REG_TEST,         /* Test */
+	CPCAP_REG_ST_TEST1,     /* ST Test1 */
+	CPCAP_REG_ST_TEST2,     /* ST Test2 */
+	CPCAP_REG_END = CPCAP_REG_ST_TEST2, /* End of CPCAP registers. */
+
+	CPCAP_REG_MAX		/* The largest valid register value. */
+	= CPCAP_REG_END,
+
+	CPCAP_REG_SIZE = CPCAP_REG_MAX + 1,
+	CPCAP_REG_UNUSED = CPCAP_REG_MAX + 2,
+};
+
+#define CPCAP_NUM_REG_CPCAP (CPCAP_REG_END - CPCAP_REG_START + 1)
+#define CONFIG_EMU_UART_DEBUG
+
+#ifdef CONFIG_EMU_UART_DEBUG
+#define CPCAP_VUSBC_CONSTANT	0xFFFF
+#define CPCAP_USBC2_CONSTANT	0x0F07
+#else
+#define CPCAP_VUSBC_CONSTANT	0xFEA2
+#define CPCAP_USBC2_CONSTANT	0x0000
+#endif
+
+/*
+ * Copied from drivers/mfd/cpcap-regacc.c in Motorola mapphone Linux
+ * kernel tree. Kept as a list of name, address, constant_mask and
+ * rbw_mask so the tables below can be generated from it.
+ */
+#define CPCAP_REGISTERS(R)						\
+	R(INT1,           0, 0x0004, 0x0000)				\
+	R(INT2,           1, 0x0000, 0x0000)				\
+	R(INT3,           2, 0x0000, 0x0000)				\
+	R(INT4,           3, 0xFC00, 0x0000)				\
+	R(INTM1,          4, 0x0004, 0xFFFF)				\
+	R(INTM2,          5, 0x0000, 0xFFFF)				\
+	R(INTM3,          6, 0x0000, 0xFFFF)				\
+	R(INTM4,          7, 0xFC00, 0xFFFF)				\
+	R(INTS1,          8, 0xFFFF, 0xFFFF)				\
+	R(INTS2,          9, 0xFFFF, 0xFFFF)				\
+	R(INTS3,         10, 0xFFFF, 0xFFFF)				\
+	R(INTS4,         11, 0xFFFF, 0xFFFF)				\
+	R(ASSIGN1,       12, 0x80F8, 0xFFFF)				\
+	R(ASSIGN2,       13, 0x0000, 0xFFFF)				\
+	R(ASSIGN3,       14, 0x0004, 0xFFFF)				\
+	R(ASSIGN4,       15, 0x0068, 0xFFFF)				\
+	R(ASSIGN5,       16, 0x0000, 0xFFFF)				\
+	R(ASSIGN6,       17, 0xFC00, 0xFFFF)				\
+	R(VERSC1,        18, 0xFFFF, 0xFFFF)				\
+	R(VERSC2,        19, 0xFFFF, 0xFFFF)				\
+	R(MI1,          128, 0x0000, 0x0000)				\
+	R(MIM1,         129, 0x0000, 0xFFFF)				\
+	R(MI2,          130, 0x0000, 0xFFFF)				\
+	R(MIM2,         131, 0xFFFF, 0xFFFF)				\
+	R(UCC1,         132, 0xF000, 0xFFFF)				\
+	R(UCC2,         133, 0xFC00, 0xFFFF)				\
+	R(PC1,          135, 0xFC00, 0xFFFF)				\
+	R(PC2,          136, 0xFC00, 0xFFFF)				\
+	R(BPEOL,        137, 0xFE00, 0xFFFF)				\
+	R(PGC,          138, 0xFE00, 0xFFFF)				\
+	R(MT1,          139, 0x0000, 0x0000)				\
+	R(MT2,          140, 0x0000, 0x0000)				\
+	R(MT3,          141, 0x0000, 0x0000)				\
+	R(PF,           142, 0x0000, 0xFFFF)				\
+	R(SCC,          256, 0xFF00, 0xFFFF)				\
+	R(SW1,          257, 0xFFFF, 0xFFFF)				\
+	R(SW2,          258, 0xFC7F, 0xFFFF)				\
+	R(UCTM,         259, 0xFFFE, 0xFFFF)				\
+	R(TOD1,         260, 0xFF00, 0xFFFF)				\
+	R(TOD2,         261, 0xFE00, 0xFFFF)				\
+	R(TODA1,        262, 0xFF00, 0xFFFF)				\
+	R(TODA2,        263, 0xFE00, 0xFFFF)				\
+	R(DAY,          264, 0x8000, 0xFFFF)				\
+	R(DAYA,         265, 0x8000, 0xFFFF)				\
+	R(VAL1,         266, 0x0000, 0xFFFF)				\
+	R(VAL2,         267, 0x0000, 0xFFFF)				\
+	R(SDVSPLL,      384, 0x2488, 0xFFFF)				\
+	R(SI2CC1,       385, 0x8000, 0xFFFF)				\
+	R(Si2CC2,       386, 0xFF00, 0xFFFF)				\
+	R(S1C1,         387, 0x9080, 0xFFFF)				\
+	R(S1C2,         388, 0x8080, 0xFFFF)				\
+	R(S2C1,         389, 0x9080, 0xFFFF)				\
+	R(S2C2,         390, 0x8080, 0xFFFF)				\
+	R(S3C,          391, 0xFA84, 0xFFFF)				\
+	R(S4C1,         392, 0x9080, 0xFFFF)				\
+	R(S4C2,         393, 0x8080, 0xFFFF)				\
+	R(S5C,          394, 0xFFD7, 0xFFFF)				\
+	R(S6C,          395, 0xFFF4, 0xFFFF)				\
+	R(VCAMC,        396, 0xFF48, 0xFFFF)				\
+	R(VCSIC,        397, 0xFFA8, 0xFFFF)				\
+	R(VDACC,        398, 0xFF48, 0xFFFF)				\
+	R(VDIGC,        399, 0xFF48, 0xFFFF)				\
+	R(VFUSEC,       400, 0xFF50, 0xFFFF)				\
+	R(VHVIOC,       401, 0xFFE8, 0xFFFF)				\
+	R(VSDIOC,       402, 0xFF40, 0xFFFF)				\
+	R(VPLLC,        403, 0xFFA4, 0xFFFF)				\
+	R(VRF1C,        404, 0xFF50, 0xFFFF)				\
+	R(VRF2C,        405, 0xFFD4, 0xFFFF)				\
+	R(VRFREFC,      406, 0xFFD4, 0xFFFF)				\
+	R(VWLAN1C,      407, 0xFFA8, 0xFFFF)				\
+	R(VWLAN2C,      408, 0xFD32, 0xFFFF)				\
+	R(VSIMC,        409, 0xE154, 0xFFFF)				\
+	R(VVIBC,        410, 0xFFF2, 0xFFFF)				\
+	R(VUSBC,        411, CPCAP_VUSBC_CONSTANT, 0xFFFF)		\
+	R(VUSBINT1C,    412, 0xFFD4, 0xFFFF)				\
+	R(VUSBINT2C,    413, 0xFFD4, 0xFFFF)				\
+	R(URT,          414, 0xFFFE, 0xFFFF)				\
+	R(URM1,         415, 0x0000, 0xFFFF)				\
+	R(URM2,         416, 0xFC00, 0xFFFF)				\
+	R(VAUDIOC,      512, 0xFF88, 0xFFFF)				\
+	R(CC,           513, 0x0000, 0xFEDF)				\
+	R(CDI,          514, 0x4000, 0xFFFF)				\
+	R(SDAC,         515, 0xF000, 0xFCFF)				\
+	R(SDACDI,       516, 0xC000, 0xFFFF)				\
+	R(TXI,          517, 0x0000, 0xFFFF)				\
+	R(TXMP,         518, 0xF000, 0xFFFF)				\
+	R(RXOA,         519, 0xF800, 0xFFFF)				\
+	R(RXVC,         520, 0x00C3, 0xFFFF)				\
+	R(RXCOA,        521, 0xF800, 0xFFFF)				\
+	R(RXSDOA,       522, 0xE000, 0xFFFF)				\
+	R(RXEPOA,       523, 0x8000, 0xFFFF)				\
+	R(RXLL,         524, 0x0000, 0xFFFF)				\
+	R(A2LA,         525, 0xFF00, 0xFFFF)				\
+	R(MIPIS1,       526, 0x0000, 0xFFFF)				\
+	R(MIPIS2,       527, 0xFF00, 0xFFFF)				\
+	R(MIPIS3,       528, 0xFFFC, 0xFFFF)				\
+	R(LVAB,         529, 0xFFFC, 0xFFFF)				\
+	R(CCC1,         640, 0xFFF0, 0xFFFF)				\
+	R(CRM,          641, 0xC000, 0xFFFF)				\
+	R(CCCC2,        642, 0xFFC0, 0xFFFF)				\
+	R(CCS1,         643, 0x0000, 0xFFFF)				\
+	R(CCS2,         644, 0xFF00, 0xFFFF)				\
+	R(CCA1,         645, 0x0000, 0xFFFF)				\
+	R(CCA2,         646, 0x0000, 0xFFFF)				\
+	R(CCM,          647, 0xFC00, 0xFFFF)				\
+	R(CCO,          648, 0xFC00, 0xFFFF)				\
+	R(CCI,          649, 0xC000, 0xFFFF)				\
+	R(ADCC1,        768, 0x0000, 0xFFFF)				\
+	R(ADCC2,        769, 0x0080, 0xFFFF)				\
+	R(ADCD0,        770, 0xFFFF, 0xFFFF)				\
+	R(ADCD1,        771, 0xFFFF, 0xFFFF)				\
+	R(ADCD2,        772, 0xFFFF, 0xFFFF)				\
+	R(ADCD3,        773, 0xFFFF, 0xFFFF)				\
+	R(ADCD4,        774, 0xFFFF, 0xFFFF)				\
+	R(ADCD5,        775, 0xFFFF, 0xFFFF)				\
+	R(ADCD6,        776, 0xFFFF, 0xFFFF)				\
+	R(ADCD7,        777, 0xFFFF, 0xFFFF)				\
+	R(ADCAL1,       778, 0xFFFF, 0xFFFF)				\
+	R(ADCAL2,       779, 0xFFFF, 0xFFFF)				\
+	R(USBC1,        896, 0x0000, 0xFFFF)				\
+	R(USBC2,        897, CPCAP_USBC2_CONSTANT, 0xFFFF)		\
+	R(USBC3,        898, 0x8200, 0xFFFF)				\
+	R(UVIDL,        899, 0xFFFF, 0xFFFF)				\
+	R(UVIDH,        900, 0xFFFF, 0xFFFF)				\
+	R(UPIDL,        901, 0xFFFF, 0xFFFF)				\
+	R(UPIDH,        902, 0xFFFF, 0xFFFF)				\
+	R(UFC1,         903, 0xFF80, 0xFFFF)				\
+	R(UFC2,         904, 0xFF80, 0xFFFF)				\
+	R(UFC3,         905, 0xFF80, 0xFFFF)				\
+	R(UIC1,         906, 0xFF64, 0xFFFF)				\
+	R(UIC2,         907, 0xFF64, 0xFFFF)				\
+	R(UIC3,         908, 0xFF64, 0xFFFF)				\
+	R(USBOTG1,      909, 0xFFC0, 0xFFFF)				\
+	R(USBOTG2,      910, 0xFFC0, 0xFFFF)				\
+	R(USBOTG3,      911, 0xFFC0, 0xFFFF)				\
+	R(UIER1,        912, 0xFFE0, 0xFFFF)				\
+	R(UIER2,        913, 0xFFE0, 0xFFFF)				\
+	R(UIER3,        914, 0xFFE0, 0xFFFF)				\
+	R(UIEF1,        915, 0xFFE0, 0xFFFF)				\
+	R(UIEF2,        916, 0xFFE0, 0xFFFF)				\
+	R(UIEF3,        917, 0xFFE0, 0xFFFF)				\
+	R(UIS,          918, 0xFFFF, 0xFFFF)				\
+	R(UIL,          919, 0xFFFF, 0xFFFF)				\
+	R(USBD,         920, 0xFFFF, 0xFFFF)				\
+	R(SCR1,         921, 0xFF00, 0xFFFF)				\
+	R(SCR2,         922, 0xFF00, 0xFFFF)				\
+	R(SCR3,         923, 0xFF00, 0xFFFF)				\
+	R(VMC,          939, 0xFFFE, 0xFFFF)				\
+	R(OWDC,         940, 0xFFFC, 0xFFFF)				\
+	R(GPIO0,        941, 0x0D11, 0x3FFF)				\
+	R(GPIO1,        943, 0x0D11, 0x3FFF)				\
+	R(GPIO2,        945, 0x0D11, 0x3FFF)				\
+	R(GPIO3,        947, 0x0D11, 0x3FFF)				\
+	R(GPIO4,        949, 0x0D11, 0x3FFF)				\
+	R(GPIO5,        951, 0x0C11, 0x3FFF)				\
+	R(GPIO6,        953, 0x0C11, 0x3FFF)				\
+	R(MDLC,        1024, 0x0000, 0xFFFF)				\
+	R(KLC,         1025, 0x8000, 0xFFFF)				\
+	R(ADLC,        1026, 0x8000, 0xFFFF)				\
+	R(REDC,        1027, 0xFC00, 0xFFFF)				\
+	R(GREENC,      1028, 0xFC00, 0xFFFF)				\
+	R(BLUEC,       1029, 0xFC00, 0xFFFF)				\
+	R(CFC,         1030, 0xF000, 0xFFFF)				\
+	R(ABC,         1031, 0xFFC3, 0xFFFF)				\
+	R(BLEDC,       1032, 0xFC00, 0xFFFF)				\
+	R(CLEDC,       1033, 0xFC00, 0xFFFF)				\
+	R(OW1C,        1152, 0xFF00, 0xFFFF)				\
+	R(OW1D,        1153, 0xFF00, 0xFFFF)				\
+	R(OW1I,        1154, 0xFFFF, 0xFFFF)				\
+	R(OW1IE,       1155, 0xFF00, 0xFFFF)				\
+	R(OW1,         1157, 0xFF00, 0xFFFF)				\
+	R(OW2C,        1160, 0xFF00, 0xFFFF)				\
+	R(OW2D,        1161, 0xFF00, 0xFFFF)				\
+	R(OW2I,        1162, 0xFFFF, 0xFFFF)				\
+	R(OW2IE,       1163, 0xFF00, 0xFFFF)				\
+	R(OW2,         1165, 0xFF00, 0xFFFF)				\
+	R(OW3C,        1168, 0xFF00, 0xFFFF)				\
+	R(OW3D,        1169, 0xFF00, 0xFFFF)				\
+	R(OW3I,        1170, 0xFF00, 0xFFFF)				\
+	R(OW3IE,       1171, 0xFF00, 0xFFFF)				\
+	R(OW3,         1173, 0xFF00, 0xFFFF)				\
+	R(GCAIC,       1174, 0xFF00, 0xFFFF)				\
+	R(GCAIM,       1175, 0xFF00, 0xFFFF)				\
+	R(LGDIR,       1176, 0xFFE0, 0xFFFF)				\
+	R(LGPU,        1177, 0xFFE0, 0xFFFF)				\
+	R(LGPIN,       1178, 0xFF00, 0xFFFF)				\
+	R(LGMASK,      1179, 0xFFE0, 0xFFFF)				\
+	R(LDEB,        1180, 0xFF00, 0xFFFF)				\
+	R(LGDET,       1181, 0xFF00, 0xFFFF)				\
+	R(LMISC,       1182, 0xFF07, 0xFFFF)				\
+	R(LMACE,       1183, 0xFFF8, 0xFFFF)				\
+	R(TEST,        7936, 0x0000, 0xFFFF)				\
+	R(ST_TEST1,    8002, 0x0000, 0xFFFF)				\
+	R(ST_TEST2,    8006, 0xFFFC, 0xFFFF)
+
+struct cpcap_register_info {
+	unsigned short address;         /* Address of the register */
+	unsigned short constant_mask;	/* Constant modifiability mask */
+	unsigned short rbw_mask;	/* Read-before-write mask */
+};
+
+extern const struct cpcap_register_info
+cpcap_register_info_tbl[CPCAP_NUM_REG_CPCAP];
+
+/*
+ * Register database generated from CPCAP_REGISTERS, with the bitfields
+ * known from the mainline regulator, USB PHY, charger and ADC drivers.
+ * A field with values names each value of (val & mask) >> shift, a
+ * single bit field without values is a flag.
+ */
+struct cpcap_field {
+	const char *name;
+	unsigned short mask;
+	unsigned char shift;
+	unsigned char nvalues;
+	const char * const *values;	/* NULL entries have no name */
+};
+
+struct cpcap_fields {
+	const struct cpcap_field *field;
+	int n;
+};
+
+struct cpcap_reg_desc {
+	const char *name;		/* As in enum cpcap_reg, like "VERSC1" */
+	unsigned short offset;		/* Regmap style, address * 4 */
+	unsigned short index;
+	unsigned short constant_mask;
+	unsigned short rbw_mask;
+	unsigned char block;		/* See cpcap_block_name() */
+	const struct cpcap_fields *fields;
+};
+
+extern const struct cpcap_reg_desc cpcap_reg_db[CPCAP_NUM_REG_CPCAP];
+
+/*
+ * Returns the index for a register name like "VERSC1" or
+ * "CPCAP_REG_S1C1" in any case, or -EINVAL. Uses a perfect hash
+ * generated at build time by cpcapgen.
+ */
+int cpcap_name_to_index(const char *name);
+
+/* ADCC1 and ADCC2 bits as named in drivers/iio/adc/cpcap-adc.c */
+#define CPCAP_BIT_ADEN_AUTO_CLR		0x8000	/* ADCC1 */
+#define CPCAP_BIT_CAL_MODE		0x4000
+#define CPCAP_BIT_ADC_CLK_SEL1		0x2000
+#define CPCAP_BIT_ADC_CLK_SEL0		0x1000
+#define CPCAP_BIT_ATOX			0x0800
+#define CPCAP_BIT_ATO_MASK		0x0780
+#define CPCAP_BIT_ADA_MASK		0x0070
+#define CPCAP_BIT_AD_SEL1		0x0008
+#define CPCAP_BIT_RAND1			0x0004
+#define CPCAP_BIT_RAND0			0x0002
+#define CPCAP_BIT_ADEN			0x0001
+
+#define CPCAP_BIT_CAL_FACTOR_ENABLE	0x8000	/* ADCC2 */
+#define CPCAP_BIT_BATDETB_EN		0x4000
+#define CPCAP_BIT_ADTRIG_ONESHOT	0x2000
+#define CPCAP_BIT_ASC			0x1000
+#define CPCAP_BIT_ATOX_PS_FACTOR	0x0800
+#define CPCAP_BIT_ADC_PS_FACTOR1	0x0400
+#define CPCAP_BIT_ADC_PS_FACTOR0	0x0200
+#define CPCAP_BIT_AD4_SELECT		0x0100
+#define CPCAP_BIT_ADC_BUSY		0x0080
+#define CPCAP_BIT_THERMBIAS_EN		0x0040
+#define CPCAP_BIT_ADTRIG_DIS		0x0020
+#define CPCAP_BIT_LIADC			0x0010
+
+/* Opaque device handle */
+struct cpcap_dev;
+
+/*
+ * Opens the register access backend "ioctl", "regmap" or "sim" with
+ * path, or the backend default path if path is NULL. Returns 0 with
+ * dev set, or negative error.
+ */
+int cpcap_open(struct cpcap_dev **dev, const char *backend, const char *path);
+void cpcap_close(struct cpcap_dev *dev);
+
+/*
+ * Returns the cpcap_register_info_tbl index for a regmap style register
+ * offset, or -EINVAL if there is no register at that offset.
+ */
+int cpcap_offset_to_index(int offset);
+
+/* Returns the value of a hex digit in either case, or -1 */
+static inline int cpcap_hex_digit(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+
+	return -1;
+}
+
+/*
+ * Register access by offset. Both return the register index, or
+ * negative error. Writes change the bits in mask, or the register
+ * rbw_mask if mask is zero.
+ */
+int cpcap_read_reg(struct cpcap_dev *dev, int reg_offset, unsigned short *val);
+int cpcap_write_reg(struct cpcap_dev *dev, int reg_offset,
+		    unsigned short value, unsigned short mask);
+
+/* Register access by index, return 0 or negative error */
+int cpcap_read_index(struct cpcap_dev *dev, int index, unsigned short *val);
+int cpcap_write_index(struct cpcap_dev *dev, int index, unsigned short value,
+		      unsigned short mask);
+
+/*
+ * Reads the registers at the n offsets into vals. Backends that read
+ * all the registers at once, like regmap, do it with a single read.
+ * Does not allocate memory. Returns 0, or negative error if an offset
+ * is not a register or a read fails.
+ */
+int cpcap_readv(struct cpcap_dev *dev, const unsigned short *offsets,
+		unsigned short *vals, int n);
+
+/*
+ * Reads all the registers into vals in cpcap_register_info_tbl order,
+ * vals must have room for CPCAP_NUM_REG_CPCAP values.
+ */
+int cpcap_snapshot(struct cpcap_dev *dev, unsigned short *vals);
+
+/*
+ * Counters that span several registers. The registers of a group are
+ * listed least significant first, and a group value is the counter
+ * bits of the registers put together.
+ */
+#define CPCAP_GROUP_REGS	3
+
+enum {
+	CPCAP_GROUP_SW,		/* SW1, SW2 */
+	CPCAP_GROUP_TOD,	/* TOD1, TOD2, DAY in seconds */
+	CPCAP_GROUP_CCS,	/* CCS1, CCS2 coulomb counter samples */
+	CPCAP_GROUP_CCA,	/* CCA1, CCA2 coulomb counter accumulator */
+	CPCAP_NUM_GROUPS,
+};
+
+struct cpcap_group {
+	const char *name;		/* Like "tod" */
+	int n;				/* Registers */
+	unsigned short offsets[CPCAP_GROUP_REGS];
+	unsigned short masks[CPCAP_GROUP_REGS];	/* Counter bits */
+	unsigned int window;		/* Carry possible this close to it */
+	unsigned int wrap;		/* Of the lower registers, or 0 */
+	int sign;			/* Two's complement, can count down */
+};
+
+extern const struct cpcap_group cpcap_group_tbl[CPCAP_NUM_GROUPS];
+
+/*
+ * Reads the registers of a group into vals so that no carry between
+ * them tears the value. The group is only read again while the lower
+ * registers are within window of a carry, until the upper registers
+ * read the same twice in a row. With have_vals set, vals already has
+ * a first reading, like from cpcap_readv() or cpcap_snapshot(), and
+ * there are no reads unless it is near a carry. Returns the number of
+ * extra reads, or negative error, -EAGAIN if the value did not settle.
+ */
+int cpcap_read_group(struct cpcap_dev *dev, int group, unsigned short *vals,
+		     int have_vals);
+
+/* Returns the value of a group from the register values of a read */
+long long cpcap_group_value(int group, const unsigned short *vals);
+
+/*
+ * Register access statistics, kept per register block in log bucketed
+ * histograms of CLOCK_MONOTONIC_RAW nanoseconds. The blocks are the
+ * 128 register address ranges, see cpcap_block_name().
+ */
+#define CPCAP_NUM_BLOCKS	11
+#define CPCAP_HIST_BUCKETS	256
+
+enum {
+	CPCAP_STATS_READ,
+	CPCAP_STATS_WRITE,
+	CPCAP_STATS_OPS,
+};
+
+struct cpcap_hist {
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long max;
+	unsigned int buckets[CPCAP_HIST_BUCKETS];
+};
+
+struct cpcap_stats {
+	struct cpcap_hist hist[CPCAP_NUM_BLOCKS][CPCAP_STATS_OPS];
+	unsigned int reg_errors[CPCAP_NUM_REG_CPCAP];
+	unsigned int block_errors[CPCAP_NUM_BLOCKS];
+	unsigned long long group_reads[CPCAP_NUM_GROUPS];
+	unsigned long long group_retries[CPCAP_NUM_GROUPS];
+};
+
+/*
+ * Starts collecting statistics into stats, which is cleared first, or
+ * stops if stats is NULL.
+ */
+void cpcap_stats_enable(struct cpcap_dev *dev, struct cpcap_stats *stats);
+
+/* Returns the block for a register index, and the name for a block */
+int cpcap_block(int index);
+const char *cpcap_block_name(int block);
+
+/*
+ * Adds a value to a histogram, and returns the p percentile of the
+ * values, p is 0 to 100. The histograms can also be used for other
+ * values than nanoseconds.
+ */
+void cpcap_hist_add(struct cpcap_hist *h, unsigned long long val);
+unsigned long long cpcap_hist_percentile(const struct cpcap_hist *h,
+					 double p);
+
+/*
+ * Register value cache, see cpcap_cache_init() for the default policy
+ * of each register. Reads of cached values do not access the device,
+ * and writes update the cached value.
+ */
+enum {
+	CPCAP_CACHE_VOLATILE,	/* Always read */
+	CPCAP_CACHE_TTL,	/* Read again after ttl_ms */
+	CPCAP_CACHE_STATIC,	/* Read once */
+};
+
+struct cpcap_cache {
+	unsigned char policy[CPCAP_NUM_REG_CPCAP];
+	unsigned int ttl_ms[CPCAP_NUM_REG_CPCAP];
+	unsigned short vals[CPCAP_NUM_REG_CPCAP];
+	unsigned long long expires[CPCAP_NUM_REG_CPCAP]; /* ns, 0 if none */
+	unsigned long long hits;
+	unsigned long long misses;
+};
+
+/* Sets the default policies and clears the cache */
+void cpcap_cache_init(struct cpcap_cache *cache);
+int cpcap_cache_set_policy(struct cpcap_cache *cache, int index, int policy,
+			   unsigned int ttl_ms);
+
+/* Starts using cache, or stops if cache is NULL */
+void cpcap_cache_enable(struct cpcap_dev *dev, struct cpcap_cache *cache);
+
+/* Drops the cached value for index, or all values if index is -1 */
+void cpcap_cache_invalidate(struct cpcap_dev *dev, int index);
+
+#endif /* CPCAPRW_H */
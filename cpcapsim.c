@@ -0,0 +1,189 @@
+/*
+ * Simulated /dev/cpcap for testing cpcaprw without a device
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Preload into a dynamically linked program to make open() of
+ * /dev/cpcap return a simulated device that handles the register read
+ * and write ioctls like drivers/mfd/cpcap-regacc.c does: bits in
+ * constant_mask are never changed, and bits outside the write mask are
+ * only preserved if they are in rbw_mask. INT1-4 are write 1 to clear.
+ * Environment variables:
+ *
+ *	CPCAP_SIM_PATH		device path, default /dev/cpcap
+ *	CPCAP_SIM_LATENCY_US	busy wait per ioctl, default 0
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "cpcaprw.h"
+
+/* Same as CPCAP_IOCTL_TEST_READ_REG and WRITE_REG in libcpcaprw.c */
+#define CPCAP_SIM_IOCTL_NR(req)	((req) & 0xff)
+#define CPCAP_SIM_IOCTL_READ	1
+#define CPCAP_SIM_IOCTL_WRITE	2
+
+struct cpcap_regacc {
+	unsigned short reg;
+	unsigned short value;
+	unsigned short mask;
+};
+
+static const struct cpcap_register_info sim_info[CPCAP_NUM_REG_CPCAP] = {
+#define R(name, address, constant_mask, rbw_mask)	\
+	[CPCAP_REG_##name] = { address, constant_mask, rbw_mask },
+	CPCAP_REGISTERS(R)
+#undef R
+};
+
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned short sim_regs[CPCAP_NUM_REG_CPCAP];
+static int sim_fd = -1;
+static unsigned long long sim_latency;	/* ns */
+
+static int (*real_open)(const char *path, int flags, ...);
+static int (*real_ioctl)(int fd, unsigned long req, ...);
+static int (*real_close)(int fd);
+
+static void cpcap_sim_init(void)
+{
+	const char *latency;
+
+	if (real_open)
+		return;
+
+	real_open = dlsym(RTLD_NEXT, "open");
+	real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+	real_close = dlsym(RTLD_NEXT, "close");
+
+	latency = getenv("CPCAP_SIM_LATENCY_US");
+	if (latency)
+		sim_latency = strtoull(latency, NULL, 10) * 1000;
+}
+
+static unsigned long long cpcap_sim_nsecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Busy wait, a sleep would add the timer slack on top */
+static void cpcap_sim_delay(void)
+{
+	unsigned long long end;
+
+	if (!sim_latency)
+		return;
+
+	end = cpcap_sim_nsecs() + sim_latency;
+	while (cpcap_sim_nsecs() < end)
+		;
+}
+
+static int cpcap_sim_ioctl(unsigned long req, struct cpcap_regacc *acc)
+{
+	const struct cpcap_register_info *info;
+	unsigned short keep;
+
+	if (acc->reg >= CPCAP_NUM_REG_CPCAP) {
+		errno = EINVAL;
+		return -1;
+	}
+	info = &sim_info[acc->reg];
+
+	cpcap_sim_delay();
+
+	pthread_mutex_lock(&sim_lock);
+	switch (CPCAP_SIM_IOCTL_NR(req)) {
+	case CPCAP_SIM_IOCTL_READ:
+		acc->value = sim_regs[acc->reg];
+		break;
+	case CPCAP_SIM_IOCTL_WRITE:
+		if (acc->reg >= CPCAP_REG_INT1 && acc->reg <= CPCAP_REG_INT4) {
+			sim_regs[acc->reg] &= ~(acc->value & acc->mask);
+			break;
+		}
+		keep = info->constant_mask | (info->rbw_mask & ~acc->mask);
+		sim_regs[acc->reg] = (sim_regs[acc->reg] & keep) |
+			(acc->value & acc->mask & ~keep);
+		break;
+	default:
+		pthread_mutex_unlock(&sim_lock);
+		errno = ENOTTY;
+		return -1;
+	}
+	pthread_mutex_unlock(&sim_lock);
+
+	return 0;
+}
+
+int open(const char *path, int flags, ...)
+{
+	const char *sim_path;
+	mode_t mode = 0;
+	va_list ap;
+
+	cpcap_sim_init();
+
+	if (flags & O_CREAT) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+
+	sim_path = getenv("CPCAP_SIM_PATH");
+	if (!sim_path)
+		sim_path = "/dev/cpcap";
+	if (strcmp(path, sim_path))
+		return real_open(path, flags, mode);
+
+	/* Any fd will do, the ioctls on it never reach the kernel */
+	sim_fd = real_open("/dev/null", O_RDWR);
+
+	return sim_fd;
+}
+
+int open64(const char *path, int flags, ...)
+	__attribute__((alias("open")));
+
+int ioctl(int fd, unsigned long req, ...)
+{
+	va_list ap;
+	void *arg;
+
+	cpcap_sim_init();
+
+	va_start(ap, req);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (fd < 0 || fd != sim_fd)
+		return real_ioctl(fd, req, arg);
+
+	return cpcap_sim_ioctl(req, arg);
+}
+
+int close(int fd)
+{
+	cpcap_sim_init();
+
+	if (fd >= 0 && fd == sim_fd)
+		sim_fd = -1;
+
+	return real_close(fd);
+}
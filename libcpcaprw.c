@@ -0,0 +1,1346 @@
+/*
+ * libcpcaprw, access CPCAP PMIC registers on Android devices
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <time.h>
+
+#include "cpcaprw.h"
+#include "cpcaphash.h"
+#include "cpcapnames.h"
+
+const struct cpcap_register_info
+cpcap_register_info_tbl[CPCAP_NUM_REG_CPCAP] = {
+#define R(name, address, constant_mask, rbw_mask)	\
+	[CPCAP_REG_##name] = { address, constant_mask, rbw_mask },
+	CPCAP_REGISTERS(R)
+#undef R
+};
+
+/*
+ * Reverse map from register address to cpcap_register_info_tbl index plus
+ * one, zero means there is no register at that address. Generated at
+ * compile time so offset lookups do not need to scan the table.
+ */
+_Static_assert(CPCAP_NUM_REG_CPCAP < 0xff, "register index must fit in u8");
+
+static const unsigned char register_index_tbl[CPCAP_REG_MAX_OFFSET / 4 + 1] = {
+#define R(name, address, constant_mask, rbw_mask)	\
+	[address] = CPCAP_REG_##name + 1,
+	CPCAP_REGISTERS(R)
+#undef R
+};
+
+
+int cpcap_offset_to_index(int offset)
+{
+	int index;
+
+	if (offset < 0 || offset > CPCAP_REG_MAX_OFFSET || (offset & 3))
+		return -EINVAL;
+
+	index = register_index_tbl[offset / 4];
+	if (!index)
+		return -EINVAL;
+
+	return index - 1;
+}
+
+/*
+ * Bitfields of the regulator, USB PHY, charger and ADC registers as in
+ * drivers/regulator/cpcap-regulator.c, drivers/phy/motorola/
+ * phy-cpcap-usb.c, drivers/power/supply/cpcap-charger.c and
+ * drivers/iio/adc/cpcap-adc.c. The regulator MODE fields are the
+ * mode_mask bits of the driver, and V the voltage selector.
+ */
+#define CPCAP_FIELD(name, mask)					\
+	{ name, mask, __builtin_ctz(mask), 0, NULL }
+#define CPCAP_FIELD_VALUES(name, mask, values)			\
+	{ name, mask, __builtin_ctz(mask),				\
+	  sizeof(values) / sizeof(values[0]), values }
+#define CPCAP_FIELDS(fields)					\
+	{ fields, sizeof(fields) / sizeof(fields[0]) }
+
+static const char * const vcam_values[] = {
+	"2.6V", "2.7V", "2.8V", "2.9V",
+};
+static const char * const vcsi_values[] = { "1.2V", "1.8V", };
+static const char * const vdac_values[] = {
+	"1.2V", "1.5V", "1.8V", "2.5V",
+};
+static const char * const vdig_values[] = {
+	"1.2V", "1.35V", "1.5V", "1.875V",
+};
+static const char * const vfuse_values[] = {
+	"1.5V", "1.6V", "1.8V", "1.9V", "2.0V", "2.1V", "2.2V", "2.3V",
+	"2.4V", "2.5V", "2.6V", "2.7V", "3.15V",
+};
+static const char * const vsdio_values[] = {
+	"1.5V", "1.6V", "1.8V", "2.6V", "2.7V", "2.8V", "2.9V", "3.0V",
+};
+static const char * const vpll_values[] = {
+	"1.2V", "1.3V", "1.4V", "1.8V",
+};
+static const char * const vrf1_values[] = { "2.775V", "2.5V", };
+static const char * const vrf2_values[] = { "0V", "2.775V", };
+static const char * const vrfref_values[] = { "1.5V", "2.775V", };
+static const char * const vwlan1_values[] = { "1.8V", "1.9V", };
+static const char * const vwlan2_values[] = {
+	"2.775V", "3.0V", "3.3V", "3.3V",
+};
+static const char * const vsim_values[] = { "1.8V", "2.9V", };
+static const char * const vvib_values[] = {
+	"1.3V", "1.8V", "2.0V", "3.0V",
+};
+static const char * const vusb_values[] = { "3.3V", "3.3V", };
+static const char * const vaudio_values[] = { "0V", "2.775V", };
+
+static const struct cpcap_field swc_fields[] = {
+	CPCAP_FIELD("MODE", 0x6f00),
+	CPCAP_FIELD("V", 0x007f),
+};
+static const struct cpcap_field s3c_fields[] = {
+	CPCAP_FIELD("MODE", 0x578c),
+	CPCAP_FIELD("V", 0x0003),
+};
+static const struct cpcap_field s5c_fields[] = {
+	CPCAP_FIELD("MODE", 0x0028),
+};
+static const struct cpcap_field s6c_fields[] = {
+	CPCAP_FIELD("MODE", 0x0047),
+};
+static const struct cpcap_field vcamc_fields[] = {
+	CPCAP_FIELD("MODE", 0x0087),
+	CPCAP_FIELD_VALUES("V", 0x0030, vcam_values),
+};
+static const struct cpcap_field vcsic_fields[] = {
+	CPCAP_FIELD("MODE", 0x0047),
+	CPCAP_FIELD_VALUES("V", 0x0010, vcsi_values),
+};
+static const struct cpcap_field vdacc_fields[] = {
+	CPCAP_FIELD("MODE", 0x0087),
+	CPCAP_FIELD_VALUES("V", 0x0030, vdac_values),
+};
+static const struct cpcap_field vdigc_fields[] = {
+	CPCAP_FIELD("MODE", 0x0087),
+	CPCAP_FIELD_VALUES("V", 0x0030, vdig_values),
+};
+static const struct cpcap_field vfusec_fields[] = {
+	CPCAP_FIELD("MODE", 0x0080),
+	CPCAP_FIELD_VALUES("V", 0x000f, vfuse_values),
+};
+static const struct cpcap_field vhvioc_fields[] = {
+	CPCAP_FIELD("MODE", 0x0017),
+};
+static const struct cpcap_field vsdioc_fields[] = {
+	CPCAP_FIELD("MODE", 0x0087),
+	CPCAP_FIELD_VALUES("V", 0x0038, vsdio_values),
+};
+static const struct cpcap_field vpllc_fields[] = {
+	CPCAP_FIELD("MODE", 0x0043),
+	CPCAP_FIELD_VALUES("V", 0x0018, vpll_values),
+};
+static const struct cpcap_field vrf1c_fields[] = {
+	CPCAP_FIELD("MODE", 0x00ac),
+	CPCAP_FIELD_VALUES("V", 0x0002, vrf1_values),
+};
+static const struct cpcap_field vrf2c_fields[] = {
+	CPCAP_FIELD("MODE", 0x0023),
+	CPCAP_FIELD_VALUES("V", 0x0008, vrf2_values),
+};
+static const struct cpcap_field vrfrefc_fields[] = {
+	CPCAP_FIELD("MODE", 0x0023),
+	CPCAP_FIELD_VALUES("V", 0x0008, vrfref_values),
+};
+static const struct cpcap_field vwlan1c_fields[] = {
+	CPCAP_FIELD("MODE", 0x0047),
+	CPCAP_FIELD_VALUES("V", 0x0010, vwlan1_values),
+};
+static const struct cpcap_field vwlan2c_fields[] = {
+	CPCAP_FIELD("MODE", 0x020c),
+	CPCAP_FIELD_VALUES("V", 0x00c0, vwlan2_values),
+};
+static const struct cpcap_field vsimc_fields[] = {
+	CPCAP_FIELD("MODE", 0x0023),
+	CPCAP_FIELD_VALUES("V", 0x0008, vsim_values),
+	CPCAP_FIELD("VSIMCARD_MODE", 0x1e80),
+};
+static const struct cpcap_field vvibc_fields[] = {
+	CPCAP_FIELD("MODE", 0x0001),
+	CPCAP_FIELD_VALUES("V", 0x000c, vvib_values),
+};
+static const struct cpcap_field vusbc_fields[] = {
+	CPCAP_FIELD("MODE", 0x011c),
+	CPCAP_FIELD_VALUES("V", 0x0040, vusb_values),
+};
+static const struct cpcap_field vaudioc_fields[] = {
+	CPCAP_FIELD("MODE", 0x0016),
+	CPCAP_FIELD_VALUES("V", 0x0001, vaudio_values),
+};
+
+static const char * const crm_vchrg_values[] = {
+	"3.80V", "4.10V", "4.12V", "4.15V", "4.17V", "4.20V", "4.23V",
+	"4.25V", "4.27V", "4.30V", "4.33V", "4.35V", "4.38V", "4.40V",
+	"4.42V", "4.44V",
+};
+static const char * const crm_ichrg_values[] = {
+	"0mA", "70mA", "177mA", "266mA", "355mA", "443mA", "532mA",
+	"621mA", "709mA", "798mA", "886mA", "975mA", "1064mA", "1152mA",
+	"1596mA", "nolimit",
+};
+
+static const struct cpcap_field crm_fields[] = {
+	CPCAP_FIELD("CHRG_LED_EN", 0x2000),
+	CPCAP_FIELD("RVRSMODE", 0x1000),
+	CPCAP_FIELD("ICHRG_TR", 0x0c00),
+	CPCAP_FIELD("FET_OVRD", 0x0200),
+	CPCAP_FIELD("FET_CTRL", 0x0100),
+	CPCAP_FIELD_VALUES("VCHRG", 0x00f0, crm_vchrg_values),
+	CPCAP_FIELD_VALUES("ICHRG", 0x000f, crm_ichrg_values),
+};
+
+static const struct cpcap_field adcc1_fields[] = {
+	CPCAP_FIELD("ADEN_AUTO_CLR", CPCAP_BIT_ADEN_AUTO_CLR),
+	CPCAP_FIELD("CAL_MODE", CPCAP_BIT_CAL_MODE),
+	CPCAP_FIELD("ADC_CLK_SEL", CPCAP_BIT_ADC_CLK_SEL1 |
+		    CPCAP_BIT_ADC_CLK_SEL0),
+	CPCAP_FIELD("ATOX", CPCAP_BIT_ATOX),
+	CPCAP_FIELD("ATO", CPCAP_BIT_ATO_MASK),
+	CPCAP_FIELD("ADA", CPCAP_BIT_ADA_MASK),
+	CPCAP_FIELD("AD_SEL1", CPCAP_BIT_AD_SEL1),
+	CPCAP_FIELD("RAND", CPCAP_BIT_RAND1 | CPCAP_BIT_RAND0),
+	CPCAP_FIELD("ADEN", CPCAP_BIT_ADEN),
+};
+
+static const struct cpcap_field adcc2_fields[] = {
+	CPCAP_FIELD("CAL_FACTOR_ENABLE", CPCAP_BIT_CAL_FACTOR_ENABLE),
+	CPCAP_FIELD("BATDETB_EN", CPCAP_BIT_BATDETB_EN),
+	CPCAP_FIELD("ADTRIG_ONESHOT", CPCAP_BIT_ADTRIG_ONESHOT),
+	CPCAP_FIELD("ASC", CPCAP_BIT_ASC),
+	CPCAP_FIELD("ATOX_PS_FACTOR", CPCAP_BIT_ATOX_PS_FACTOR),
+	CPCAP_FIELD("ADC_PS_FACTOR", CPCAP_BIT_ADC_PS_FACTOR1 |
+		    CPCAP_BIT_ADC_PS_FACTOR0),
+	CPCAP_FIELD("AD4_SELECT", CPCAP_BIT_AD4_SELECT),
+	CPCAP_FIELD("ADC_BUSY", CPCAP_BIT_ADC_BUSY),
+	CPCAP_FIELD("THERMBIAS_EN", CPCAP_BIT_THERMBIAS_EN),
+	CPCAP_FIELD("ADTRIG_DIS", CPCAP_BIT_ADTRIG_DIS),
+	CPCAP_FIELD("LIADC", CPCAP_BIT_LIADC),
+};
+
+static const struct cpcap_field usbc1_fields[] = {
+	CPCAP_FIELD("IDPULSE", 0x8000),
+	CPCAP_FIELD("ID100KPU", 0x4000),
+	CPCAP_FIELD("IDPUCNTRL", 0x2000),
+	CPCAP_FIELD("IDPU", 0x1000),
+	CPCAP_FIELD("IDPD", 0x0800),
+	CPCAP_FIELD("VBUSCHRGTMR", 0x0780),
+	CPCAP_FIELD("VBUSPU", 0x0040),
+	CPCAP_FIELD("VBUSPD", 0x0020),
+	CPCAP_FIELD("DMPD", 0x0010),
+	CPCAP_FIELD("DPPD", 0x0008),
+	CPCAP_FIELD("DM1K5PU", 0x0004),
+	CPCAP_FIELD("DP1K5PU", 0x0002),
+	CPCAP_FIELD("DP150KPU", 0x0001),
+};
+
+static const struct cpcap_field usbc2_fields[] = {
+	CPCAP_FIELD("ZHSDRV", 0xc000),
+	CPCAP_FIELD("DPLLCLKREQ", 0x2000),
+	CPCAP_FIELD("SE0CONN", 0x1000),
+	CPCAP_FIELD("UARTTXTRI", 0x0800),
+	CPCAP_FIELD("UARTSWAP", 0x0400),
+	CPCAP_FIELD("UARTMUX", 0x0300),
+	CPCAP_FIELD("ULPISTPLOW", 0x0080),
+	CPCAP_FIELD("TXENPOL", 0x0040),
+	CPCAP_FIELD("USBXCVREN", 0x0020),
+	CPCAP_FIELD("USBCNTRL", 0x0010),
+	CPCAP_FIELD("USBSUSPEND", 0x0008),
+	CPCAP_FIELD("EMUMODE", 0x0007),
+};
+
+static const struct cpcap_field usbc3_fields[] = {
+	CPCAP_FIELD("IHSTX", 0x7800),
+	CPCAP_FIELD("IDPU_SPI", 0x0400),
+	CPCAP_FIELD("VBUSSTBY_EN", 0x0100),
+	CPCAP_FIELD("VBUSEN_SPI", 0x0080),
+	CPCAP_FIELD("VBUSPU_SPI", 0x0040),
+	CPCAP_FIELD("VBUSPD_SPI", 0x0020),
+	CPCAP_FIELD("DMPD_SPI", 0x0010),
+	CPCAP_FIELD("DPPD_SPI", 0x0008),
+	CPCAP_FIELD("SUSPEND_SPI", 0x0004),
+	CPCAP_FIELD("PU_SPI", 0x0002),
+	CPCAP_FIELD("ULPI_SPI_SEL", 0x0001),
+};
+
+static const struct cpcap_fields cpcap_fields_tbl[CPCAP_NUM_REG_CPCAP] = {
+	[CPCAP_REG_S1C1] = CPCAP_FIELDS(swc_fields),
+	[CPCAP_REG_S2C1] = CPCAP_FIELDS(swc_fields),
+	[CPCAP_REG_S3C] = CPCAP_FIELDS(s3c_fields),
+	[CPCAP_REG_S4C1] = CPCAP_FIELDS(swc_fields),
+	[CPCAP_REG_S5C] = CPCAP_FIELDS(s5c_fields),
+	[CPCAP_REG_S6C] = CPCAP_FIELDS(s6c_fields),
+	[CPCAP_REG_VCAMC] = CPCAP_FIELDS(vcamc_fields),
+	[CPCAP_REG_VCSIC] = CPCAP_FIELDS(vcsic_fields),
+	[CPCAP_REG_VDACC] = CPCAP_FIELDS(vdacc_fields),
+	[CPCAP_REG_VDIGC] = CPCAP_FIELDS(vdigc_fields),
+	[CPCAP_REG_VFUSEC] = CPCAP_FIELDS(vfusec_fields),
+	[CPCAP_REG_VHVIOC] = CPCAP_FIELDS(vhvioc_fields),
+	[CPCAP_REG_VSDIOC] = CPCAP_FIELDS(vsdioc_fields),
+	[CPCAP_REG_VPLLC] = CPCAP_FIELDS(vpllc_fields),
+	[CPCAP_REG_VRF1C] = CPCAP_FIELDS(vrf1c_fields),
+	[CPCAP_REG_VRF2C] = CPCAP_FIELDS(vrf2c_fields),
+	[CPCAP_REG_VRFREFC] = CPCAP_FIELDS(vrfrefc_fields),
+	[CPCAP_REG_VWLAN1C] = CPCAP_FIELDS(vwlan1c_fields),
+	[CPCAP_REG_VWLAN2C] = CPCAP_FIELDS(vwlan2c_fields),
+	[CPCAP_REG_VSIMC] = CPCAP_FIELDS(vsimc_fields),
+	[CPCAP_REG_VVIBC] = CPCAP_FIELDS(vvibc_fields),
+	[CPCAP_REG_VUSBC] = CPCAP_FIELDS(vusbc_fields),
+	[CPCAP_REG_VAUDIOC] = CPCAP_FIELDS(vaudioc_fields),
+	[CPCAP_REG_CRM] = CPCAP_FIELDS(crm_fields),
+	[CPCAP_REG_ADCC1] = CPCAP_FIELDS(adcc1_fields),
+	[CPCAP_REG_ADCC2] = CPCAP_FIELDS(adcc2_fields),
+	[CPCAP_REG_USBC1] = CPCAP_FIELDS(usbc1_fields),
+	[CPCAP_REG_USBC2] = CPCAP_FIELDS(usbc2_fields),
+	[CPCAP_REG_USBC3] = CPCAP_FIELDS(usbc3_fields),
+};
+
+#define CPCAP_DB_BLOCK(address)						\
+	((address) >> 7 < CPCAP_NUM_BLOCKS ? (address) >> 7 :		\
+	 CPCAP_NUM_BLOCKS - 1)
+
+const struct cpcap_reg_desc cpcap_reg_db[CPCAP_NUM_REG_CPCAP] = {
+#define R(name, address, constant_mask, rbw_mask)			\
+	[CPCAP_REG_##name] = {						\
+		#name, (address) * 4, CPCAP_REG_##name, constant_mask,	\
+		rbw_mask, CPCAP_DB_BLOCK(address),			\
+		&cpcap_fields_tbl[CPCAP_REG_##name],			\
+	},
+	CPCAP_REGISTERS(R)
+#undef R
+};
+
+int cpcap_name_to_index(const char *name)
+{
+	unsigned int bucket, slot;
+	int index;
+
+	if (!strncasecmp(name, "CPCAP_REG_", 10))
+		name += 10;
+
+	bucket = cpcap_name_hash(name, 0) % CPCAP_NAME_BUCKETS;
+	slot = cpcap_name_hash(name, cpcap_name_seed_tbl[bucket]) %
+		CPCAP_NAME_SLOTS;
+	index = cpcap_name_slot_tbl[slot];
+	if (!index || strcasecmp(name, cpcap_reg_db[index - 1].name))
+		return -EINVAL;
+
+	return index - 1;
+}
+
+enum {
+	CPCAP_IOCTL_NUM_TEST__START,
+	CPCAP_IOCTL_NUM_TEST_READ_REG,
+	CPCAP_IOCTL_NUM_TEST_WRITE_REG,
+	CPCAP_IOCTL_NUM_TEST__END,
+};
+
+#define CPCAP_IOCTL_TEST_READ_REG \
+	_IOWR(0, CPCAP_IOCTL_NUM_TEST_READ_REG, struct cpcap_regacc*)
+#define CPCAP_IOCTL_TEST_WRITE_REG \
+	_IOWR(0, CPCAP_IOCTL_NUM_TEST_WRITE_REG, struct cpcap_regacc*)
+
+/*
+ * Note that Motorola mapphone Linux kernel uses a register index
+ * for reg instead of regmap address offset.
+ */
+struct cpcap_regacc {
+	unsigned short reg;
+	unsigned short value;
+	unsigned short mask;
+};
+
+/*
+ * Register access backend. Registers are passed as cpcap_register_info_tbl
+ * index, and snapshot fills in the values of all the registers in
+ * cpcap_register_info_tbl order.
+ */
+struct cpcap_backend {
+	const char *name;
+	const char *default_path;
+	int (*open)(struct cpcap_dev *dev, const char *path);
+	void (*close)(struct cpcap_dev *dev);
+	int (*read)(struct cpcap_dev *dev, int index, unsigned short *val);
+	int (*write)(struct cpcap_dev *dev, int index, unsigned short val,
+		     unsigned short mask);
+	int (*snapshot)(struct cpcap_dev *dev, unsigned short *vals);
+	int bulk;	/* snapshot costs about the same as read */
+};
+
+struct cpcap_dev {
+	const struct cpcap_backend *ops;
+	int fd;
+	struct cpcap_stats *stats;	/* NULL unless enabled */
+	struct cpcap_cache *cache;	/* NULL unless enabled */
+};
+
+static int cpcap_dev_read(struct cpcap_dev *dev, int index,
+			  unsigned short *val);
+
+/*
+ * Motorola mapphone kernel /dev/cpcap ioctl interface. See
+ * drivers/mfd/cpcap-regacc.c in Motorola mapphone Linux kernel tree
+ * for details of the ioctl handling.
+ */
+static int cpcap_ioctl_open(struct cpcap_dev *dev, const char *path)
+{
+	dev->fd = open(path, O_RDWR);
+	if (dev->fd == -1)
+		return -errno;
+
+	return 0;
+}
+
+static void cpcap_ioctl_close(struct cpcap_dev *dev)
+{
+	close(dev->fd);
+}
+
+static int cpcap_ioctl_read(struct cpcap_dev *dev, int index,
+			    unsigned short *val)
+{
+	struct cpcap_regacc reg;
+	int error;
+
+	reg.reg = index;
+	reg.value = 0;
+	reg.mask = cpcap_register_info_tbl[index].rbw_mask;
+
+	error = ioctl(dev->fd, CPCAP_IOCTL_TEST_READ_REG, &reg);
+	if (error < 0)
+		return error;
+
+	*val = reg.value;
+
+	return 0;
+}
+
+static int cpcap_ioctl_write(struct cpcap_dev *dev, int index,
+			     unsigned short val, unsigned short mask)
+{
+	struct cpcap_regacc reg;
+
+	reg.reg = index;
+	reg.value = val;
+	reg.mask = mask;
+
+	/* For write to work, see README for chcon usage */
+	return ioctl(dev->fd, CPCAP_IOCTL_TEST_WRITE_REG, &reg);
+}
+
+static int cpcap_ioctl_snapshot(struct cpcap_dev *dev, unsigned short *vals)
+{
+	int i, error;
+
+	for (i = 0; i < CPCAP_NUM_REG_CPCAP; i++) {
+		error = cpcap_dev_read(dev, i, &vals[i]);
+		if (error < 0)
+			return error;
+	}
+
+	return 0;
+}
+
+static const struct cpcap_backend cpcap_ioctl_backend = {
+	.name = "ioctl",
+	.default_path = "/dev/cpcap",
+	.open = cpcap_ioctl_open,
+	.close = cpcap_ioctl_close,
+	.read = cpcap_ioctl_read,
+	.write = cpcap_ioctl_write,
+	.snapshot = cpcap_ioctl_snapshot,
+};
+
+/*
+ * Mainline kernel regmap debugfs registers file. The whole file is
+ * read with one pread() into regmap_buf and parsed in place, so a
+ * snapshot of all the registers costs one syscall. Writes only work
+ * if the kernel is built with REGMAP_ALLOW_WRITE_DEBUGFS.
+ */
+static char regmap_buf[131072];
+
+static int cpcap_regmap_open(struct cpcap_dev *dev, const char *path)
+{
+	dev->fd = open(path, O_RDWR);
+	if (dev->fd == -1)
+		dev->fd = open(path, O_RDONLY);
+	if (dev->fd == -1)
+		return -errno;
+
+	return 0;
+}
+
+static int cpcap_regmap_load(struct cpcap_dev *dev, size_t *len)
+{
+	ssize_t n;
+
+	*len = 0;
+	do {
+		n = pread(dev->fd, regmap_buf + *len,
+			  sizeof(regmap_buf) - *len, *len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		*len += n;
+	} while (n > 0 && *len < sizeof(regmap_buf));
+
+	return 0;
+}
+
+/*
+ * Parses "offset: value" lines. If vals is set, stores the values of
+ * all the registers in cpcap_register_info_tbl, otherwise just the value
+ * for index.
+ */
+static int cpcap_regmap_parse(size_t len, unsigned short *vals, int index,
+			      unsigned short *val)
+{
+	const char *p = regmap_buf, *end = regmap_buf + len;
+	unsigned int offset, value;
+	int d, i, found = 0;
+
+	while (p < end) {
+		offset = 0;
+		while (p < end && (d = cpcap_hex_digit(*p)) >= 0) {
+			offset = (offset << 4) | d;
+			p++;
+		}
+		if (p >= end || *p != ':')
+			return -EIO;
+		p++;
+		while (p < end && *p == ' ')
+			p++;
+
+		value = 0;
+		while (p < end && (d = cpcap_hex_digit(*p)) >= 0) {
+			value = (value << 4) | d;
+			p++;
+		}
+		while (p < end && *p++ != '\n')
+			;
+
+		i = cpcap_offset_to_index(offset);
+		if (i < 0)
+			continue;
+		if (vals) {
+			vals[i] = value;
+			found++;
+		} else if (i == index) {
+			*val = value;
+			return 0;
+		}
+	}
+
+	return found ? 0 : -ENOENT;
+}
+
+static int cpcap_regmap_read(struct cpcap_dev *dev, int index,
+			     unsigned short *val)
+{
+	size_t len;
+	int error;
+
+	error = cpcap_regmap_load(dev, &len);
+	if (error)
+		return error;
+
+	return cpcap_regmap_parse(len, NULL, index, val);
+}
+
+static int cpcap_regmap_write(struct cpcap_dev *dev, int index,
+			      unsigned short val, unsigned short mask)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned short old, offset;
+	char buf[9];
+	int i, error;
+
+	if (mask != 0xffff) {
+		error = cpcap_regmap_read(dev, index, &old);
+		if (error)
+			return error;
+		val = (old & ~mask) | (val & mask);
+	}
+
+	/* "oooo vvvv" without stdio */
+	offset = cpcap_register_info_tbl[index].address * 4;
+	for (i = 0; i < 4; i++) {
+		buf[i] = hex[(offset >> (12 - i * 4)) & 0xf];
+		buf[5 + i] = hex[(val >> (12 - i * 4)) & 0xf];
+	}
+	buf[4] = ' ';
+	if (pwrite(dev->fd, buf, sizeof(buf), 0) != sizeof(buf))
+		return -errno;
+
+	return 0;
+}
+
+static int cpcap_regmap_snapshot(struct cpcap_dev *dev, unsigned short *vals)
+{
+	size_t len;
+	int error;
+
+	error = cpcap_regmap_load(dev, &len);
+	if (error)
+		return error;
+
+	memset(vals, 0, CPCAP_NUM_REG_CPCAP * sizeof(*vals));
+
+	return cpcap_regmap_parse(len, vals, -1, NULL);
+}
+
+static const struct cpcap_backend cpcap_regmap_backend = {
+	.name = "regmap",
+	.default_path = "/sys/kernel/debug/regmap/spi0.0/registers",
+	.open = cpcap_regmap_open,
+	.close = cpcap_ioctl_close,
+	.read = cpcap_regmap_read,
+	.write = cpcap_regmap_write,
+	.snapshot = cpcap_regmap_snapshot,
+	.bulk = 1,
+};
+
+/*
+ * Simulated device for testing without /dev/cpcap. Writes follow what
+ * cpcap-regacc.c does: bits in constant_mask are never changed, and
+ * bits outside the write mask are only preserved if they are in
+ * rbw_mask.
+ *
+ * INT1-4 are write 1 to clear. The ADC converts as soon as ASC is set
+ * in ADCC2: ADCD0-7 get the values of the bank selected with AD_SEL1,
+ * or in calibration mode ADCAL1 and ADCAL2 get values near 512, and
+ * ASC clears.
+ */
+static unsigned short sim_regs[CPCAP_NUM_REG_CPCAP];
+
+static void cpcap_sim_adc(void)
+{
+	static const unsigned short bank0[8] = {
+		0x100, 0x26e, 0x1ff, 0x200, 0x26e, 0x214, 0x1ec, 0x3fc,
+	};
+	static const unsigned short bank1[8] = {
+		0x080, 0x090, 0x2e0, 0x26e, 0x010, 0x020, 0x030, 0x040,
+	};
+	static unsigned int noise;
+	const unsigned short *bank;
+	int i;
+
+	if (!(sim_regs[CPCAP_REG_ADCC2] & CPCAP_BIT_ASC))
+		return;
+	sim_regs[CPCAP_REG_ADCC2] &= ~CPCAP_BIT_ASC;
+	noise++;
+
+	if (sim_regs[CPCAP_REG_ADCC1] & CPCAP_BIT_CAL_MODE) {
+		sim_regs[CPCAP_REG_ADCAL1] = 508 + noise % 2;
+		sim_regs[CPCAP_REG_ADCAL2] = 515;
+		return;
+	}
+
+	bank = sim_regs[CPCAP_REG_ADCC1] & CPCAP_BIT_AD_SEL1 ? bank1 : bank0;
+	for (i = 0; i < 8; i++)
+		sim_regs[CPCAP_REG_ADCD0 + i] = bank[i] + (noise + i) % 4;
+}
+
+static int cpcap_sim_open(struct cpcap_dev *dev, const char *path)
+{
+	dev->fd = -1;
+
+	return 0;
+}
+
+static void cpcap_sim_close(struct cpcap_dev *dev)
+{
+}
+
+static int cpcap_sim_read(struct cpcap_dev *dev, int index,
+			  unsigned short *val)
+{
+	*val = sim_regs[index];
+
+	return 0;
+}
+
+static int cpcap_sim_write(struct cpcap_dev *dev, int index,
+			   unsigned short val, unsigned short mask)
+{
+	unsigned short keep;
+
+	if (index >= CPCAP_REG_INT1 && index <= CPCAP_REG_INT4) {
+		sim_regs[index] &= ~(val & mask);
+		return 0;
+	}
+
+	keep = cpcap_register_info_tbl[index].constant_mask |
+		(cpcap_register_info_tbl[index].rbw_mask & ~mask);
+	sim_regs[index] = (sim_regs[index] & keep) | (val & mask & ~keep);
+	if (index == CPCAP_REG_ADCC2)
+		cpcap_sim_adc();
+
+	return 0;
+}
+
+static int cpcap_sim_snapshot(struct cpcap_dev *dev, unsigned short *vals)
+{
+	memcpy(vals, sim_regs, sizeof(sim_regs));
+
+	return 0;
+}
+
+static const struct cpcap_backend cpcap_sim_backend = {
+	.name = "sim",
+	.default_path = "",
+	.open = cpcap_sim_open,
+	.close = cpcap_sim_close,
+	.read = cpcap_sim_read,
+	.write = cpcap_sim_write,
+	.snapshot = cpcap_sim_snapshot,
+};
+
+static const struct cpcap_backend *cpcap_backends[] = {
+	&cpcap_ioctl_backend,
+	&cpcap_regmap_backend,
+	&cpcap_sim_backend,
+};
+
+int cpcap_open(struct cpcap_dev **dev, const char *backend, const char *path)
+{
+	const struct cpcap_backend *ops = NULL;
+	int i, error;
+
+	for (i = 0; i < sizeof(cpcap_backends) / sizeof(cpcap_backends[0]); i++) {
+		if (!strcmp(cpcap_backends[i]->name, backend))
+			ops = cpcap_backends[i];
+	}
+	if (!ops)
+		return -EINVAL;
+
+	*dev = malloc(sizeof(**dev));
+	if (!*dev)
+		return -ENOMEM;
+
+	(*dev)->ops = ops;
+	(*dev)->stats = NULL;
+	(*dev)->cache = NULL;
+	if (!path)
+		path = ops->default_path;
+
+	error = ops->open(*dev, path);
+	if (error) {
+		free(*dev);
+		*dev = NULL;
+	}
+
+	return error;
+}
+
+void cpcap_close(struct cpcap_dev *dev)
+{
+	dev->ops->close(dev);
+	free(dev);
+}
+
+/*
+ * Register access statistics. The histogram buckets have four sub
+ * buckets per power of two of nanoseconds, so the percentiles are
+ * within 25%. With stats disabled the only cost is checking
+ * dev->stats.
+ */
+static const char * const cpcap_block_names[CPCAP_NUM_BLOCKS] = {
+	"interrupt", "control", "timer", "switcher", "audio", "coulomb",
+	"adc", "usb", "lighting", "onewire", "test",
+};
+
+int cpcap_block(int index)
+{
+	int block = cpcap_register_info_tbl[index].address >> 7;
+
+	return block < CPCAP_NUM_BLOCKS ? block : CPCAP_NUM_BLOCKS - 1;
+}
+
+const char *cpcap_block_name(int block)
+{
+	return cpcap_block_names[block];
+}
+
+static int cpcap_hist_bucket(unsigned long long ns)
+{
+	int msb;
+
+	if (ns < 4)
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+
+	return (msb - 1) * 4 + ((ns >> (msb - 2)) & 3);
+}
+
+static unsigned long long cpcap_hist_value(int bucket)
+{
+	if (bucket < 4)
+		return bucket;
+
+	return (4ULL + (bucket & 3)) << (bucket / 4 - 1);
+}
+
+void cpcap_hist_add(struct cpcap_hist *h, unsigned long long val)
+{
+	h->count++;
+	h->sum += val;
+	if (val > h->max)
+		h->max = val;
+	h->buckets[cpcap_hist_bucket(val)]++;
+}
+
+unsigned long long cpcap_hist_percentile(const struct cpcap_hist *h,
+					 double p)
+{
+	unsigned long long rank, seen = 0;
+	int i;
+
+	if (!h->count)
+		return 0;
+
+	rank = h->count * p / 100;
+	if (rank >= h->count)
+		rank = h->count - 1;
+
+	for (i = 0; i < CPCAP_HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > rank)
+			break;
+	}
+
+	if (i >= CPCAP_HIST_BUCKETS - 1 || cpcap_hist_value(i + 1) > h->max)
+		return h->max;
+
+	return cpcap_hist_value(i + 1) - 1;
+}
+
+void cpcap_stats_enable(struct cpcap_dev *dev, struct cpcap_stats *stats)
+{
+	if (stats)
+		memset(stats, 0, sizeof(*stats));
+	dev->stats = stats;
+}
+
+static unsigned long long cpcap_raw_nsecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void cpcap_stats_add(struct cpcap_stats *stats, int index, int op,
+			    unsigned long long ns, int error)
+{
+	int block = cpcap_block(index);
+
+	cpcap_hist_add(&stats->hist[block][op], ns);
+
+	if (error < 0) {
+		stats->reg_errors[index]++;
+		stats->block_errors[block]++;
+	}
+}
+
+static int cpcap_timed_read(struct cpcap_dev *dev, int index,
+			    unsigned short *val)
+{
+	unsigned long long start;
+	int error;
+
+	if (!dev->stats)
+		return dev->ops->read(dev, index, val);
+
+	start = cpcap_raw_nsecs();
+	error = dev->ops->read(dev, index, val);
+	cpcap_stats_add(dev->stats, index, CPCAP_STATS_READ,
+			cpcap_raw_nsecs() - start, error);
+
+	return error;
+}
+
+static int cpcap_timed_write(struct cpcap_dev *dev, int index,
+			     unsigned short value, unsigned short mask)
+{
+	unsigned long long start;
+	int error;
+
+	if (!dev->stats)
+		return dev->ops->write(dev, index, value, mask);
+
+	start = cpcap_raw_nsecs();
+	error = dev->ops->write(dev, index, value, mask);
+	cpcap_stats_add(dev->stats, index, CPCAP_STATS_WRITE,
+			cpcap_raw_nsecs() - start, error);
+
+	return error;
+}
+
+/*
+ * Register value cache. The default policies: registers that do not
+ * change while running are read once, status, interrupt, counter and
+ * ADC result registers are always read, and the rest are read again
+ * after CPCAP_CACHE_TTL_MS as the kernel drivers may change them.
+ */
+#define CPCAP_CACHE_TTL_MS	100
+
+static const struct {
+	unsigned char reg;
+	unsigned char policy;
+} cpcap_cache_defaults[] = {
+	{ CPCAP_REG_VERSC1, CPCAP_CACHE_STATIC },
+	{ CPCAP_REG_VERSC2, CPCAP_CACHE_STATIC },
+	{ CPCAP_REG_UVIDL, CPCAP_CACHE_STATIC },
+	{ CPCAP_REG_UVIDH, CPCAP_CACHE_STATIC },
+	{ CPCAP_REG_UPIDL, CPCAP_CACHE_STATIC },
+	{ CPCAP_REG_UPIDH, CPCAP_CACHE_STATIC },
+	{ CPCAP_REG_ADCAL1, CPCAP_CACHE_STATIC },
+	{ CPCAP_REG_ADCAL2, CPCAP_CACHE_STATIC },
+	{ CPCAP_REG_INT1, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_INT2, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_INT3, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_INT4, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_INTS1, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_INTS2, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_INTS3, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_INTS4, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_MI1, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_MI2, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_SW1, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_SW2, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_TOD1, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_TOD2, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_DAY, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_CCC1, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_CRM, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_CCCC2, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_CCS1, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_CCS2, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_CCA1, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_CCA2, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_CCM, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_CCO, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_CCI, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_ADCC1, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_ADCC2, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_ADCD0, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_ADCD1, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_ADCD2, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_ADCD3, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_ADCD4, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_ADCD5, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_ADCD6, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_ADCD7, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_UIS, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_UIL, CPCAP_CACHE_VOLATILE },
+	{ CPCAP_REG_LGPIN, CPCAP_CACHE_VOLATILE },
+};
+
+void cpcap_cache_init(struct cpcap_cache *cache)
+{
+	int i;
+
+	memset(cache, 0, sizeof(*cache));
+	for (i = 0; i < CPCAP_NUM_REG_CPCAP; i++) {
+		cache->policy[i] = CPCAP_CACHE_TTL;
+		cache->ttl_ms[i] = CPCAP_CACHE_TTL_MS;
+	}
+
+	for (i = 0; i < sizeof(cpcap_cache_defaults) /
+		     sizeof(cpcap_cache_defaults[0]); i++)
+		cache->policy[cpcap_cache_defaults[i].reg] =
+			cpcap_cache_defaults[i].policy;
+}
+
+int cpcap_cache_set_policy(struct cpcap_cache *cache, int index, int policy,
+			   unsigned int ttl_ms)
+{
+	if (index < 0 || index >= CPCAP_NUM_REG_CPCAP ||
+	    policy < CPCAP_CACHE_VOLATILE || policy > CPCAP_CACHE_STATIC)
+		return -EINVAL;
+
+	cache->policy[index] = policy;
+	cache->ttl_ms[index] = ttl_ms;
+	cache->expires[index] = 0;
+
+	return 0;
+}
+
+void cpcap_cache_enable(struct cpcap_dev *dev, struct cpcap_cache *cache)
+{
+	dev->cache = cache;
+}
+
+void cpcap_cache_invalidate(struct cpcap_dev *dev, int index)
+{
+	if (!dev->cache)
+		return;
+
+	if (index < 0)
+		memset(dev->cache->expires, 0, sizeof(dev->cache->expires));
+	else if (index < CPCAP_NUM_REG_CPCAP)
+		dev->cache->expires[index] = 0;
+}
+
+static unsigned long long cpcap_mono_nsecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void cpcap_cache_store(struct cpcap_cache *cache, int index,
+			      unsigned short val)
+{
+	switch (cache->policy[index]) {
+	case CPCAP_CACHE_STATIC:
+		cache->expires[index] = ~0ULL;
+		break;
+	case CPCAP_CACHE_TTL:
+		cache->expires[index] = cpcap_mono_nsecs() +
+			cache->ttl_ms[index] * 1000000ULL;
+		break;
+	default:
+		return;
+	}
+	cache->vals[index] = val;
+}
+
+static int cpcap_cache_valid(const struct cpcap_cache *cache, int index)
+{
+	return cache->expires[index] == ~0ULL ||
+		(cache->expires[index] &&
+		 cache->expires[index] > cpcap_mono_nsecs());
+}
+
+/*
+ * All the register reads and writes go through these, for the ioctl
+ * backend that is one ioctl each unless the value is cached.
+ */
+static int cpcap_dev_read(struct cpcap_dev *dev, int index,
+			  unsigned short *val)
+{
+	struct cpcap_cache *cache = dev->cache;
+	int error;
+
+	if (!cache)
+		return cpcap_timed_read(dev, index, val);
+
+	if (cpcap_cache_valid(cache, index)) {
+		cache->hits++;
+		*val = cache->vals[index];
+		return 0;
+	}
+
+	cache->misses++;
+	error = cpcap_timed_read(dev, index, val);
+	if (error < 0)
+		return error;
+
+	cpcap_cache_store(cache, index, *val);
+
+	return 0;
+}
+
+/*
+ * Updates a cached value the way the driver does the write, or drops
+ * it if not cached as the bits outside mask are not known.
+ */
+static int cpcap_dev_write(struct cpcap_dev *dev, int index,
+			   unsigned short value, unsigned short mask)
+{
+	const struct cpcap_register_info *info = &cpcap_register_info_tbl[index];
+	struct cpcap_cache *cache = dev->cache;
+	unsigned short keep;
+	int error;
+
+	error = cpcap_timed_write(dev, index, value, mask);
+	if (!cache)
+		return error;
+
+	if (error < 0 || !cpcap_cache_valid(cache, index)) {
+		cache->expires[index] = 0;
+		return error;
+	}
+
+	keep = info->constant_mask | (info->rbw_mask & ~mask);
+	cpcap_cache_store(cache, index, (cache->vals[index] & keep) |
+			  (value & mask & ~keep));
+
+	return error;
+}
+
+int cpcap_read_reg(struct cpcap_dev *dev, int reg_offset, unsigned short *val)
+{
+	int index, error;
+
+	index = cpcap_offset_to_index(reg_offset);
+	if (index < 0)
+		return index;
+
+	error = cpcap_dev_read(dev, index, val);
+	if (error < 0)
+		return error;
+
+	return index;
+}
+
+int cpcap_write_reg(struct cpcap_dev *dev, int reg_offset,
+		    unsigned short value, unsigned short mask)
+{
+	int index, error;
+
+	index = cpcap_offset_to_index(reg_offset);
+	if (index < 0)
+		return index;
+
+	if (!mask)
+		mask = cpcap_register_info_tbl[index].rbw_mask;
+
+	error = cpcap_dev_write(dev, index, value, mask);
+	if (error < 0)
+		return error;
+
+	return index;
+}
+
+int cpcap_read_index(struct cpcap_dev *dev, int index, unsigned short *val)
+{
+	if (index < 0 || index >= CPCAP_NUM_REG_CPCAP)
+		return -EINVAL;
+
+	return cpcap_dev_read(dev, index, val);
+}
+
+int cpcap_write_index(struct cpcap_dev *dev, int index, unsigned short value,
+		      unsigned short mask)
+{
+	if (index < 0 || index >= CPCAP_NUM_REG_CPCAP)
+		return -EINVAL;
+
+	return cpcap_dev_write(dev, index, value, mask);
+}
+
+int cpcap_snapshot(struct cpcap_dev *dev, unsigned short *vals)
+{
+	return dev->ops->snapshot(dev, vals);
+}
+
+int cpcap_readv(struct cpcap_dev *dev, const unsigned short *offsets,
+		unsigned short *vals, int n)
+{
+	unsigned short all[CPCAP_NUM_REG_CPCAP];
+	int i, index, error;
+
+	for (i = 0; i < n; i++) {
+		if (cpcap_offset_to_index(offsets[i]) < 0)
+			return -EINVAL;
+	}
+
+	if (dev->ops->bulk && n > 1) {
+		error = dev->ops->snapshot(dev, all);
+		if (error < 0)
+			return error;
+
+		for (i = 0; i < n; i++)
+			vals[i] = all[cpcap_offset_to_index(offsets[i])];
+
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		index = cpcap_offset_to_index(offsets[i]);
+		error = cpcap_dev_read(dev, index, &vals[i]);
+		if (error < 0)
+			return error;
+	}
+
+	return 0;
+}
+
+/*
+ * The registers of a group are read low first, so a carry between the
+ * reads gives an upper part from after the carry with a lower part
+ * from before it, off by a whole lower part. CCA is signed and borrows
+ * too. The lower parts only carry within window of their limit, which
+ * allows for how far the counter moves while the group is read: TOD
+ * counts seconds and CCS four times a second so they only carry from
+ * the limit, CCA adds up to about 0x1400 per sample at 2 A, and the
+ * rate of SW is not known so it gets some margin.
+ */
+#define CPCAP_GROUP_RETRIES	4
+
+const struct cpcap_group cpcap_group_tbl[CPCAP_NUM_GROUPS] = {
+	[CPCAP_GROUP_SW] = {
+		.name = "sw",
+		.n = 2,
+		.offsets = { 0x0404, 0x0408 },
+		.masks = { 0xffff, 0x007f },
+		.window = 0x100,
+	},
+	[CPCAP_GROUP_TOD] = {
+		.name = "tod",
+		.n = 3,
+		.offsets = { 0x0410, 0x0414, 0x0420 },
+		.masks = { 0x00ff, 0x01ff, 0x7fff },
+		.wrap = 86400,
+	},
+	[CPCAP_GROUP_CCS] = {
+		.name = "ccs",
+		.n = 2,
+		.offsets = { 0x0a0c, 0x0a10 },
+		.masks = { 0xffff, 0x00ff },
+	},
+	[CPCAP_GROUP_CCA] = {
+		.name = "cca",
+		.n = 2,
+		.offsets = { 0x0a14, 0x0a18 },
+		.masks = { 0xffff, 0xffff },
+		.window = 0x2000,
+		.sign = 1,
+	},
+};
+
+/*
+ * Puts the counter bits of the first n registers together, and
+ * returns the number of bits in bits.
+ */
+static unsigned int cpcap_group_bits(const struct cpcap_group *g,
+				     const unsigned short *vals, int n,
+				     int *bits)
+{
+	unsigned int val = 0;
+	int i;
+
+	*bits = 0;
+	for (i = 0; i < n; i++) {
+		val |= (unsigned int)(vals[i] & g->masks[i]) << *bits;
+		*bits += __builtin_popcount(g->masks[i]);
+	}
+
+	return val;
+}
+
+/* Returns 1 if any of the lower registers may carry into the next */
+static int cpcap_group_near_carry(const struct cpcap_group *g,
+				  const unsigned short *vals)
+{
+	unsigned int low, limit;
+	int i, bits;
+
+	for (i = 1; i < g->n; i++) {
+		low = cpcap_group_bits(g, vals, i, &bits);
+		limit = i == g->n - 1 && g->wrap ? g->wrap - 1 :
+			(1U << bits) - 1;
+		if (low >= limit - g->window || (g->sign && low <= g->window))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int cpcap_group_readv(struct cpcap_dev *dev,
+			     const struct cpcap_group *g, unsigned short *vals)
+{
+	int i, index;
+
+	/* Cached values would read the same every time */
+	for (i = 0; i < g->n; i++) {
+		index = cpcap_offset_to_index(g->offsets[i]);
+		cpcap_cache_invalidate(dev, index);
+	}
+
+	return cpcap_readv(dev, g->offsets, vals, g->n);
+}
+
+int cpcap_read_group(struct cpcap_dev *dev, int group, unsigned short *vals,
+		     int have_vals)
+{
+	unsigned short prev[CPCAP_GROUP_REGS], diff;
+	const struct cpcap_group *g;
+	int i, retries = 0, error = 0;
+
+	if (group < 0 || group >= CPCAP_NUM_GROUPS)
+		return -EINVAL;
+	g = &cpcap_group_tbl[group];
+
+	if (!have_vals) {
+		error = cpcap_group_readv(dev, g, vals);
+		if (error < 0)
+			return error;
+	}
+
+	while (cpcap_group_near_carry(g, vals)) {
+		if (retries == CPCAP_GROUP_RETRIES) {
+			error = -EAGAIN;
+			break;
+		}
+
+		memcpy(prev, vals, g->n * sizeof(*vals));
+		error = cpcap_group_readv(dev, g, vals);
+		if (error < 0)
+			break;
+		retries++;
+
+		/* No carry while the lower registers were read again */
+		for (i = 1, diff = 0; i < g->n; i++)
+			diff |= (prev[i] ^ vals[i]) & g->masks[i];
+		if (!diff)
+			break;
+	}
+
+	if (dev->stats) {
+		dev->stats->group_reads[group]++;
+		dev->stats->group_retries[group] += retries;
+	}
+
+	return error < 0 ? error : retries;
+}
+
+long long cpcap_group_value(int group, const unsigned short *vals)
+{
+	const struct cpcap_group *g = &cpcap_group_tbl[group];
+	unsigned long long val;
+	unsigned int low, high;
+	int bits, top;
+
+	low = cpcap_group_bits(g, vals, g->n - 1, &bits);
+	high = vals[g->n - 1] & g->masks[g->n - 1];
+	if (g->wrap)
+		return (long long)high * g->wrap + low;
+
+	val = (unsigned long long)high << bits | low;
+	top = bits + __builtin_popcount(g->masks[g->n - 1]);
+	if (g->sign && val >> (top - 1))
+		return val - (1ULL << top);
+
+	return val;
+}